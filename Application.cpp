@@ -1,22 +1,46 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <future>
+#include <signal.h>
 #include <stdio.h>
 #include <limits>
 #include <math.h>
 #include <memory>
+#include <mutex>
 #include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 #ifdef _MSC_VER
+#  include <fcntl.h>
+#  include <io.h>
 #  include "getopt/getopt.h"
 #else
 #  include <unistd.h>
 #  include <getopt.h>
 #endif
 
+#include "AsyncWriter.hpp"
 #include "Bitmap.hpp"
+#include "BitmapDownsampled.hpp"
+#include "BitmapHdr.hpp"
 #include "BlockData.hpp"
+#include "BlockWriter.hpp"
+#include "CostScheduler.hpp"
 #include "DataProvider.hpp"
 #include "Debug.hpp"
 #include "Error.hpp"
+#include "Etc1s.hpp"
+#include "FrameSequence.hpp"
+#include "MipMap.hpp"
+#include "PageFile.hpp"
+#include "ProcessRGB.hpp"
+#include "Progress.hpp"
+#include "RealtimeCompressor.hpp"
+#include "StreamWriter.hpp"
 #include "System.hpp"
 #include "TaskDispatch.hpp"
 #include "Timing.hpp"
@@ -29,22 +53,1023 @@ struct DebugCallback_t : public DebugLog::Callback
     }
 } DebugCallback;
 
+static std::string MipLevelName( const char* fn, int level )
+{
+    std::string name( fn );
+    const auto dot = name.rfind( '.' );
+    const auto ext = dot == std::string::npos ? std::string() : name.substr( dot );
+    if( dot != std::string::npos ) name.resize( dot );
+    return name + "-" + std::to_string( level ) + ext;
+}
+
+static bool IsCompressedFile( const char* fn )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return false;
+    uint32_t magic = 0;
+    fread( &magic, 1, 4, f );
+    fclose( f );
+    return magic == 0x03525650 || magic == 0x58544BAB;
+}
+
+static void PrintErrorStats( const ErrorStats& stats, const v2i& size, bool alpha )
+{
+    const double px = double( size.x ) * size.y;
+    const double mse = ( stats.sq[0] + stats.sq[1] + stats.sq[2] ) / ( px * 3 );
+    printf( "  RGB    MSE: %f  PSNR: %f\n", mse, 20 * log10( 255 ) - 10 * log10( mse ) );
+    if( alpha )
+    {
+        const double msea = stats.sq[3] / px;
+        printf( "  Alpha  MSE: %f  PSNR: %f\n", msea, 20 * log10( 255 ) - 10 * log10( msea ) );
+    }
+    printf( "  Max error: %u\n", stats.max );
+    printf( "  Differing blocks: %u of %u (%0.2f%%)\n", stats.diffBlocks, stats.blocks, 100.f * stats.diffBlocks / stats.blocks );
+}
+
+static int Compare( const char* fn1, const char* fn2, unsigned int cpus )
+{
+    const bool c1 = IsCompressedFile( fn1 );
+    const bool c2 = IsCompressedFile( fn2 );
+    if( !c1 && !c2 )
+    {
+        fprintf( stderr, "At least one of the compared files must be a pvr/ktx file.\n" );
+        return 1;
+    }
+    if( !c1 ) std::swap( fn1, fn2 );
+
+    TaskDispatch taskDispatch( cpus );
+
+    auto bd1 = std::make_shared<BlockData>( fn1 );
+    BlockDataPtr bd2;
+    BitmapPtr bmp;
+    const uint32_t* bmpData = nullptr;
+    if( c1 && c2 )
+    {
+        bd2 = std::make_shared<BlockData>( fn2 );
+    }
+    else
+    {
+        bmp = std::make_shared<Bitmap>( fn2, std::numeric_limits<unsigned int>::max(), false );
+        bmpData = bmp->Data();
+    }
+
+    const bool alpha = bd1->IsAlpha() || ( bd2 ? bd2->IsAlpha() : bmp->Alpha() );
+    const int levels = bd2 ? std::min( bd1->Levels(), bd2->Levels() ) : 1;
+    for( int level=0; level<levels; level++ )
+    {
+        const auto size = bd1->LevelSize( level );
+        const auto size2 = bd2 ? bd2->LevelSize( level ) : bmp->Size();
+        if( size.x != size2.x || size.y != size2.y )
+        {
+            fprintf( stderr, "Image sizes differ: %ix%i vs %ix%i.\n", size.x, size.y, size2.x, size2.y );
+            return 1;
+        }
+
+        constexpr int RowsPerTask = 32;
+        const auto width = std::max( 4, size.x );
+        const auto rows = std::max( 4, size.y ) / 4;
+        std::vector<ErrorStats> res( ( rows + RowsPerTask - 1 ) / RowsPerTask );
+        memset( res.data(), 0, res.size() * sizeof( ErrorStats ) );
+
+        for( int row=0, idx=0; row<rows; row+=RowsPerTask, idx++ )
+        {
+            const auto num = std::min( RowsPerTask, rows - row );
+            TaskDispatch::Queue( [&bd1, &bd2, &res, bmpData, size, width, level, row, num, idx, alpha]
+            {
+                std::vector<uint32_t> buf1( width * num * 4 ), buf2;
+                bd1->Decode( (uint8_t*)buf1.data(), width * 4, BlockData::RGBA8, level, row, num );
+
+                const uint32_t* ptr2;
+                size_t stride2;
+                if( bd2 )
+                {
+                    buf2.resize( width * num * 4 );
+                    bd2->Decode( (uint8_t*)buf2.data(), width * 4, BlockData::RGBA8, level, row, num );
+                    ptr2 = buf2.data();
+                    stride2 = width;
+                }
+                else
+                {
+                    ptr2 = bmpData + row * 4 * size.x;
+                    stride2 = size.x;
+                }
+
+                const v2i band( size.x, std::min( size.y - row * 4, num * 4 ) );
+                CalcErrorStats( buf1.data(), width, ptr2, stride2, band, alpha, res[idx] );
+            } );
+        }
+        TaskDispatch::Sync();
+
+        ErrorStats stats = {};
+        for( auto& v : res )
+        {
+            for( int c=0; c<4; c++ ) stats.sq[c] += v.sq[c];
+            stats.max = std::max( stats.max, v.max );
+            stats.blocks += v.blocks;
+            stats.diffBlocks += v.diffBlocks;
+        }
+
+        if( levels > 1 ) printf( "Level %i (%ix%i)\n", level, size.x, size.y );
+        else printf( "%ix%i\n", size.x, size.y );
+        PrintErrorStats( stats, size, alpha );
+    }
+
+    return 0;
+}
+
+static BlockData::Type SelectType( bool etc2, bool rgba, bool dxtc, bool alpha )
+{
+    if( etc2 ) return rgba && alpha ? BlockData::Etc2_RGBA : BlockData::Etc2_RGB;
+    if( dxtc ) return alpha ? BlockData::Dxt5 : BlockData::Dxt1;
+    return BlockData::Etc1;
+}
+
+struct BatchOptions
+{
+    bool mipmap;
+    bool etc2;
+    bool rgba;
+    bool dxtc;
+    bool dither;
+    bool linearize;
+    bool useHeuristics;
+    BlockOrder order;
+};
+
+// Compresses one image of a batch, either on the calling thread or split
+// into strips queued on the dispatcher. False if the image can't be loaded
+// or the output can't be written.
+static bool CompressImage( const char* input, const char* output, const BatchOptions& opt, bool parallel )
+{
+    DataProvider dp( input, opt.mipmap, !opt.dxtc, opt.linearize );
+    if( dp.Size().x == 0 )
+    {
+        fprintf( stderr, "Skipping %s: unable to load.\n", input );
+        return false;
+    }
+    BlockData bd( output, dp.Size(), opt.mipmap, SelectType( opt.etc2, opt.rgba, opt.dxtc, dp.Alpha() ), BlockData::Mmap, opt.order );
+    if( !bd.IsOpen() )
+    {
+        fprintf( stderr, "Skipping %s: unable to write %s.\n", input, output );
+        return false;
+    }
+    const auto num = dp.NumberOfParts();
+    for( unsigned int i=0; i<num; i++ )
+    {
+        const auto part = dp.NextPart();
+        auto process = [&bd, &opt, part]
+        {
+            if( bd.IsAlpha() )
+            {
+                bd.ProcessRGBA( part.src, part.width / 4 * part.lines, part.offset, part.width, opt.useHeuristics );
+            }
+            else
+            {
+                bd.Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::RGB, opt.dither, opt.useHeuristics );
+            }
+        };
+        if( parallel )
+        {
+            TaskDispatch::Queue( process );
+        }
+        else
+        {
+            process();
+        }
+    }
+    if( parallel ) TaskDispatch::Sync();
+    return true;
+}
+
+// Compresses the "input output" pairs listed in a file. Small images, whole
+// mip chains included, are packed into tasks of about the same block count,
+// so a sprite set doesn't turn into thousands of tiny tasks. Images bigger
+// than a task are split into strips, one image at a time.
+static int CompressBatch( const char* list, const BatchOptions& opt, unsigned int cpus, const WorkerPolicy& policy )
+{
+    enum { MinTaskBlocks = 4096, MaxTaskBlocks = 65536 };
+
+    struct Job
+    {
+        std::string input;
+        std::string output;
+        uint64_t blocks;
+        bool failed;
+    };
+
+    FILE* f = fopen( list, "r" );
+    if( !f )
+    {
+        fprintf( stderr, "Unable to open %s\n", list );
+        return 1;
+    }
+
+    int ret = 0;
+    std::vector<Job> jobs;
+    uint64_t total = 0;
+    char input[4096], output[4096];
+    while( fscanf( f, "%4095s %4095s", input, output ) == 2 )
+    {
+        v2i size;
+        if( !Bitmap::ReadSize( input, size ) || size.x <= 0 || size.y <= 0 || size.x % 4 != 0 || size.y % 4 != 0 )
+        {
+            fprintf( stderr, "Skipping %s: unreadable, or dimensions not divisible by 4.\n", input );
+            ret = 1;
+            continue;
+        }
+        uint64_t blocks = uint64_t( size.x / 4 ) * ( size.y / 4 );
+        if( opt.mipmap )
+        {
+            const int levels = NumberOfMipLevels( size );
+            for( int i=1; i<levels; i++ )
+            {
+                size.x = std::max( 1, size.x / 2 );
+                size.y = std::max( 1, size.y / 2 );
+                blocks += uint64_t( std::max( 4, size.x ) / 4 ) * ( std::max( 4, size.y ) / 4 );
+            }
+        }
+        jobs.emplace_back( Job { input, output, blocks, false } );
+        total += blocks;
+    }
+    fclose( f );
+
+    // A few tasks per worker for balance, none too small to be worth queueing
+    const uint64_t target = std::max<uint64_t>( MinTaskBlocks, std::min<uint64_t>( MaxTaskBlocks, total / ( cpus * 4 ) ) );
+
+    TaskDispatch taskDispatch( cpus, policy );
+
+    std::vector<Job*> large;
+    std::vector<Job*> batch;
+    uint64_t batchBlocks = 0;
+    auto flush = [&batch, &batchBlocks, &opt]
+    {
+        if( batch.empty() ) return;
+        TaskDispatch::Queue( [batch, &opt]
+        {
+            for( auto job : batch ) job->failed = !CompressImage( job->input.c_str(), job->output.c_str(), opt, false );
+        } );
+        batch.clear();
+        batchBlocks = 0;
+    };
+
+    for( auto& job : jobs )
+    {
+        if( job.blocks >= target )
+        {
+            large.emplace_back( &job );
+            continue;
+        }
+        batch.emplace_back( &job );
+        batchBlocks += job.blocks;
+        if( batchBlocks >= target ) flush();
+    }
+    flush();
+    TaskDispatch::Sync();
+
+    for( auto job : large ) job->failed = !CompressImage( job->input.c_str(), job->output.c_str(), opt, true );
+
+    for( auto& job : jobs ) if( job.failed ) ret = 1;
+    return ret;
+}
+
+// Compresses an ordered list of "input output" frames with FrameSequence.
+// Each strip of block rows goes through the frames on its own: when a strip
+// of one frame is done and the next frame is loaded, the same strip of the
+// next frame is queued. Loading frames is queued work too, started when the
+// frame two places earlier finishes, so at most three frames are held.
+static int CompressSequence( const char* list, const BatchOptions& opt, bool stats, unsigned int cpus, const WorkerPolicy& policy )
+{
+    enum { RowsPerTask = 32 };
+
+    FILE* f = fopen( list, "r" );
+    if( !f )
+    {
+        fprintf( stderr, "Unable to open %s\n", list );
+        return 1;
+    }
+
+    int ret = 0;
+    std::vector<std::pair<std::string, std::string>> frames;
+    v2i size;
+    char input[4096], output[4096];
+    while( fscanf( f, "%4095s %4095s", input, output ) == 2 )
+    {
+        v2i frameSize;
+        if( !Bitmap::ReadSize( input, frameSize ) || frameSize.x <= 0 || frameSize.y <= 0 || frameSize.x % 4 != 0 || frameSize.y % 4 != 0 )
+        {
+            fprintf( stderr, "Skipping %s: unreadable, or dimensions not divisible by 4.\n", input );
+            ret = 1;
+            continue;
+        }
+        if( frames.empty() )
+        {
+            size = frameSize;
+        }
+        else if( frameSize.x != size.x || frameSize.y != size.y )
+        {
+            fprintf( stderr, "Skipping %s: size differs from the first frame.\n", input );
+            ret = 1;
+            continue;
+        }
+        frames.emplace_back( input, output );
+    }
+    fclose( f );
+    if( frames.empty() ) return 1;
+
+    if( opt.mipmap ) fprintf( stderr, "Mipmaps are not generated in sequence mode.\n" );
+
+    const auto start = GetTime();
+    TaskDispatch taskDispatch( cpus, policy );
+
+    // The first frame that loads decides the format of all
+    const bool bgr = !opt.dxtc;
+    BitmapPtr first;
+    while( !frames.empty() )
+    {
+        first = std::make_shared<Bitmap>( frames[0].first.c_str(), std::numeric_limits<unsigned int>::max(), bgr );
+        first->Data();
+        if( first->Size().x == size.x && first->Size().y == size.y ) break;
+        fprintf( stderr, "Skipping %s: unable to load.\n", frames[0].first.c_str() );
+        ret = 1;
+        frames.erase( frames.begin() );
+    }
+    if( frames.empty() ) return 1;
+    const auto type = SelectType( opt.etc2, opt.rgba, opt.dxtc, first->Alpha() );
+    FrameSequence seq( size, type, opt.dither, opt.useHeuristics );
+
+    struct Frame
+    {
+        BitmapPtr bmp;
+        std::unique_ptr<BlockData> bd;
+        bool ready;
+        int pending;            // strips left
+    };
+
+    const int rows = size.y / 4;
+    const int strips = ( rows + RowsPerTask - 1 ) / RowsPerTask;
+    std::vector<Frame> state( frames.size() );
+    std::vector<int> stripFrame( strips, -1 );      // last frame each strip finished
+    std::mutex lock;
+
+    std::function<void(int)> load;
+    std::function<void(int, int)> run;
+
+    run = [&]( int idx, int strip )
+    {
+        auto& frame = state[idx];
+        const auto row = strip * RowsPerTask;
+        if( frame.bd )
+        {
+            // After a skipped frame the next one is compressed from scratch
+            const auto prev = idx > 0 && state[idx-1].bmp ? state[idx-1].bmp->Data() : nullptr;
+            seq.Process( *frame.bd, frame.bmp->Data(), prev, row, std::min<int>( RowsPerTask, rows - row ) );
+        }
+
+        std::unique_lock<std::mutex> guard( lock );
+        stripFrame[strip] = idx;
+        if( idx+1 < (int)frames.size() && state[idx+1].ready ) TaskDispatch::Queue( [&run, idx, strip] { run( idx+1, strip ); } );
+        if( --frame.pending == 0 )
+        {
+            // Nothing reads the previous frame's pixels anymore
+            auto bd = std::move( frame.bd );
+            auto prev = idx > 0 ? std::move( state[idx-1].bmp ) : BitmapPtr();
+            if( idx+2 < (int)frames.size() ) TaskDispatch::Queue( [&load, idx] { load( idx+2 ); } );
+            guard.unlock();
+        }
+    };
+
+    load = [&]( int idx )
+    {
+        auto bmp = idx == 0 ? std::move( first ) : std::make_shared<Bitmap>( frames[idx].first.c_str(), std::numeric_limits<unsigned int>::max(), bgr );
+        bmp->Data();
+        std::unique_ptr<BlockData> bd;
+        if( bmp->Size().x != size.x || bmp->Size().y != size.y )
+        {
+            fprintf( stderr, "Skipping %s: unable to load.\n", frames[idx].first.c_str() );
+        }
+        else
+        {
+            bd.reset( new BlockData( frames[idx].second.c_str(), size, false, type, BlockData::Mmap, opt.order ) );
+            if( !bd->IsOpen() )
+            {
+                fprintf( stderr, "Skipping %s: unable to write %s.\n", frames[idx].first.c_str(), frames[idx].second.c_str() );
+                bd.reset();
+            }
+        }
+        // Skipped frames still pass through every strip, with nothing to do
+        if( !bd ) bmp.reset();
+
+        std::lock_guard<std::mutex> guard( lock );
+        if( !bd ) ret = 1;
+        auto& frame = state[idx];
+        frame.bmp = std::move( bmp );
+        frame.bd = std::move( bd );
+        frame.pending = strips;
+        frame.ready = true;
+        for( int i=0; i<strips; i++ )
+        {
+            if( stripFrame[i] == idx-1 ) TaskDispatch::Queue( [&run, idx, i] { run( idx, i ); } );
+        }
+    };
+
+    TaskDispatch::Queue( [&load] { load( 0 ); } );
+    if( frames.size() > 1 ) TaskDispatch::Queue( [&load] { load( 1 ); } );
+    TaskDispatch::Sync();
+    const auto end = GetTime();
+
+    if( stats )
+    {
+        const double total = double( seq.Copied() + seq.Reused() + seq.Compressed() );
+        printf( "Frames: %i (%ix%i), %0.3f ms per frame\n", (int)frames.size(), size.x, size.y, ( end - start ) / 1000.f / frames.size() );
+        printf( "  Copied blocks:     %10llu (%5.1f%%)\n", (unsigned long long)seq.Copied(), 100 * seq.Copied() / total );
+        printf( "  Reused blocks:     %10llu (%5.1f%%)\n", (unsigned long long)seq.Reused(), 100 * seq.Reused() / total );
+        printf( "  Compressed blocks: %10llu (%5.1f%%)\n", (unsigned long long)seq.Compressed(), 100 * seq.Compressed() / total );
+    }
+
+    return ret;
+}
+
+// Cuts the input and, with -m, its mip levels into bordered pages and
+// compresses them into a PageFile. The source is read once; each level is
+// downsampled from the previous one while the workers compress its pages.
+static int CompressPages( const char* input, const char* output, const BatchOptions& opt, int pageSize, int border, Bitmap::Storage storage, bool stats, unsigned int cpus, const WorkerPolicy& policy )
+{
+    v2i size;
+    if( !Bitmap::ReadSize( input, size ) || size.x <= 0 || size.y <= 0 || size.x % 4 != 0 || size.y % 4 != 0 )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+
+    const auto start = GetTime();
+    std::unique_ptr<Bitmap> bmp( new Bitmap( input, std::numeric_limits<unsigned int>::max(), !opt.dxtc, storage ) );
+    bmp->Data();
+    if( bmp->Size().x != size.x || bmp->Size().y != size.y )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+    PageFile pages( output, size, opt.mipmap, SelectType( opt.etc2, opt.rgba, opt.dxtc, bmp->Alpha() ), pageSize, border, opt.order );
+    if( !pages.IsOpen() )
+    {
+        fprintf( stderr, "Unable to write %s\n", output );
+        return 1;
+    }
+
+    TaskDispatch taskDispatch( cpus, policy );
+    for( int level=0; level<pages.Levels(); level++ )
+    {
+        const Bitmap* current = bmp.get();
+        const auto& num = pages.Pages( level );
+        for( int y=0; y<num.y; y++ )
+        {
+            for( int x=0; x<num.x; x++ )
+            {
+                TaskDispatch::Queue( [&pages, &opt, current, level, x, y] { pages.Process( *current, level, x, y, opt.dither, opt.useHeuristics ); } );
+            }
+        }
+        std::unique_ptr<Bitmap> next;
+        if( level+1 < pages.Levels() ) next.reset( new BitmapDownsampled( *current, std::numeric_limits<unsigned int>::max(), opt.linearize ) );
+        TaskDispatch::Sync();
+        if( next )
+        {
+            next->Data();
+            bmp = std::move( next );
+        }
+    }
+    const auto end = GetTime();
+
+    if( stats )
+    {
+        printf( "Pages: %i levels, %llu pages of %ix%i (%i pixel border), %.1f MB\n", pages.Levels(), (unsigned long long)pages.NumberOfPages(), pageSize + border * 2, pageSize + border * 2, border, pages.DataSize() / 1048576.0 );
+        printf( "  Time: %0.3f ms\n", ( end - start ) / 1000.f );
+    }
+
+    return 0;
+}
+
+// Encodes the input, and its mip levels with -m, to the ETC1S intermediate
+// format. With -s the ETC1 and DXT1 transcodes of level 0 are measured.
+static int CompressEtc1s( const char* input, const char* output, bool mipmap, bool linearize, int endpoints, int selectors, bool stats, unsigned int cpus, const WorkerPolicy& policy )
+{
+    v2i size;
+    if( !Bitmap::ReadSize( input, size ) || size.x <= 0 || size.y <= 0 || size.x % 4 != 0 || size.y % 4 != 0 )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+
+    const auto start = GetTime();
+    Bitmap bmp( input, std::numeric_limits<unsigned int>::max(), false );
+    bmp.Data();
+    if( bmp.Size().x != size.x || bmp.Size().y != size.y )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+    TaskDispatch taskDispatch( cpus, policy );
+    Etc1sData etc1s( bmp, mipmap, linearize, endpoints, selectors );
+    const auto end = GetTime();
+    if( !etc1s.Write( output ) )
+    {
+        fprintf( stderr, "Unable to write %s\n", output );
+        return 1;
+    }
+
+    if( stats )
+    {
+        printf( "ETC1S: %zu endpoints, %zu selectors, %.1f KB\n", etc1s.Endpoints(), etc1s.Selectors(), etc1s.FileSize() / 1024.0 );
+        printf( "  Time: %0.3f ms\n", ( end - start ) / 1000.f );
+        const BlockData::Type types[] = { BlockData::Etc1, BlockData::Dxt1 };
+        for( auto type : types )
+        {
+            BlockData bd( size, mipmap, type );
+            const auto tstart = GetTime();
+            etc1s.Transcode( bd );
+            const auto tend = GetTime();
+            auto out = bd.Decode();
+            const auto mse = CalcMSE3( bmp, *out );
+            printf( "  %s transcode: %0.3f ms  PSNR: %f\n", type == BlockData::Etc1 ? "ETC1" : "DXT1", ( tend - tstart ) / 1000.f, 20 * log10( 255 ) - 10 * log10( mse ) );
+        }
+    }
+
+    return 0;
+}
+
+// Writes an ETC1S file out as a pvr of the given type
+static int TranscodeEtc1s( const char* input, const char* output, BlockData::Type type, BlockData::WriteMode mode, const BlockOrder& order, bool stats )
+{
+    Etc1sData etc1s( input );
+    if( !etc1s.IsValid() )
+    {
+        fprintf( stderr, "Unable to read ETC1S file %s\n", input );
+        return 1;
+    }
+
+    const auto start = GetTime();
+    {
+        BlockData bd( output, etc1s.Size(), etc1s.Levels() > 1, type, mode, order );
+        if( !bd.IsOpen() )
+        {
+            fprintf( stderr, "Unable to write %s\n", output );
+            return 1;
+        }
+        etc1s.Transcode( bd );
+    }
+    const auto end = GetTime();
+
+    if( stats ) printf( "Transcode time: %0.3f ms\n", ( end - start ) / 1000.f );
+    return 0;
+}
+
+// Compresses a Radiance .hdr or PFM image, and its mip levels with -m, to
+// BC6H. Each level is downsampled while the workers compress the previous one.
+static int CompressHdr( const char* input, const char* output, bool mipmap, bool stats, BlockData::WriteMode mode, const BlockOrder& order, unsigned int cpus, const WorkerPolicy& policy )
+{
+    const auto start = GetTime();
+    BitmapHdrPtr bmp = std::make_shared<BitmapHdr>( input );
+    const auto size = bmp->Size();
+    if( !bmp->IsValid() || size.x % 4 != 0 || size.y % 4 != 0 )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+
+    if( strcmp( output, "-" ) == 0 )
+    {
+        if( stats )
+        {
+            fprintf( stderr, "Image quality measurements can't be displayed when streaming to stdout.\n" );
+            return 1;
+        }
+        mode = BlockData::Stream;
+#ifdef _MSC_VER
+        _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+    }
+
+    TaskDispatch taskDispatch( cpus, policy );
+    BlockData bd( output, size, mipmap, BlockData::Bc6h, mode, order );
+    if( !bd.IsOpen() )
+    {
+        fprintf( stderr, "Unable to write %s\n", output );
+        return 1;
+    }
+    std::vector<BitmapHdrPtr> levels;
+    size_t offset = 0;
+    for( int level=0; level<bd.Levels(); level++ )
+    {
+        const auto width = bmp->Stride();
+        const int rows = std::max( 4, bmp->Size().y ) / 4;
+        for( int row=0; row<rows; row+=32 )
+        {
+            const auto src = bmp->Data() + row * 4 * width;
+            const auto blocks = uint32_t( width / 4 * std::min( 32, rows - row ) );
+            TaskDispatch::Queue( [&bd, src, blocks, offset, width] { bd.ProcessHdr( src, blocks, offset, width ); } );
+            offset += blocks;
+        }
+        BitmapHdrPtr next;
+        if( level+1 < bd.Levels() ) next = std::make_shared<BitmapHdrDownsampled>( *bmp );
+        TaskDispatch::Sync();
+        if( stats ) levels.emplace_back( bmp );
+        bmp = std::move( next );
+    }
+    const auto end = GetTime();
+
+    if( stats )
+    {
+        printf( "HDR data\n" );
+        printf( "  Time: %0.3f ms\n", ( end - start ) / 1000.f );
+        for( int i=0; i<bd.Levels(); i++ )
+        {
+            const auto out = bd.DecodeHdr( i );
+            const auto mse = CalcLogMSE3( *levels[i], *out );
+            if( i == 0 )
+            {
+                printf( "  log2 RMSE: %f\n", sqrt( mse ) );
+            }
+            else
+            {
+                const auto lsize = bd.LevelSize( i );
+                printf( "  Level %2i %5ix%-5i  log2 RMSE: %f\n", i, lsize.x, lsize.y, sqrt( mse ) );
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Median BC6H compression time of a Radiance .hdr or PFM image
+static int BenchmarkHdr( const char* input, bool mt, unsigned int cpus, const WorkerPolicy& policy )
+{
+    auto start = GetTime();
+    BitmapHdr bmp( input );
+    auto end = GetTime();
+    if( !bmp.IsValid() || bmp.Size().x % 4 != 0 || bmp.Size().y % 4 != 0 )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+    printf( "Image load time: %0.3f ms\n", ( end - start ) / 1000.f );
+
+    const auto& size = bmp.Size();
+    std::unique_ptr<TaskDispatch> taskDispatch;
+    if( mt ) taskDispatch.reset( new TaskDispatch( cpus, policy ) );
+
+    constexpr int NumTasks = 9;
+    uint64_t timeData[NumTasks];
+    for( int i=0; i<NumTasks; i++ )
+    {
+        BlockData bd( size, false, BlockData::Bc6h );
+        const auto localStart = GetTime();
+        if( mt )
+        {
+            const int rows = size.y / 4;
+            for( int row=0; row<rows; row+=32 )
+            {
+                const auto src = bmp.Data() + size_t( row ) * 4 * size.x;
+                const auto blocks = uint32_t( size.x / 4 * std::min( 32, rows - row ) );
+                const auto offset = size_t( row ) * size.x / 4;
+                const size_t width = size.x;
+                TaskDispatch::Queue( [&bd, src, blocks, offset, width] { bd.ProcessHdr( src, blocks, offset, width ); } );
+            }
+            TaskDispatch::Sync();
+        }
+        else
+        {
+            bd.ProcessHdr( bmp.Data(), size.x * size.y / 16, 0, size.x );
+        }
+        timeData[i] = GetTime() - localStart;
+    }
+    std::sort( timeData, timeData+NumTasks );
+    const auto median = timeData[NumTasks/2] / 1000.f;
+    printf( "Median BC6H compression time for %i runs: %0.3f ms (%0.3f Mpx/s)", NumTasks, median, size.x * size.y / ( median * 1000 ) );
+    if( mt )
+    {
+        printf( " multi threaded (%i cores)\n", cpus );
+    }
+    else
+    {
+        printf( " single threaded\n" );
+    }
+
+    return 0;
+}
+
+static void PrintLatency( const char* name, const std::vector<uint64_t>& latency, uint64_t time )
+{
+    auto sorted = latency;
+    std::sort( sorted.begin(), sorted.end() );
+    auto pct = [&sorted]( double p ) { return sorted[std::min( sorted.size() - 1, size_t( sorted.size() * p ) )] / 1000.f; };
+    printf( "  %-12s %7.1f fps  latency p50 %0.3f ms  p99 %0.3f ms  max %0.3f ms\n", name, sorted.size() * 1000000.f / time, pct( 0.5 ), pct( 0.99 ), sorted.back() / 1000.f );
+}
+
+// Compresses a stream of frames with RealtimeCompressor, first waiting for
+// each frame, then with the next frame compressing while the previous
+// frame's output is copied out. The frames are the input image rotated
+// sideways by different amounts, so consecutive inputs differ.
+static int RealtimeBenchmark( const char* input, const BatchOptions& opt, unsigned int cpus, WorkerPolicy policy )
+{
+    enum { Frames = 300, Variants = 4 };
+
+    auto bmp = std::make_shared<Bitmap>( input, std::numeric_limits<unsigned int>::max(), !opt.dxtc );
+    const auto size = bmp->Size();
+    if( size.x == 0 )
+    {
+        fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+        return 1;
+    }
+    const auto src = bmp->Data();
+    std::vector<std::vector<uint32_t>> frames( Variants );
+    for( int i=0; i<Variants; i++ )
+    {
+        auto& frame = frames[i];
+        frame.resize( size_t( size.x ) * size.y );
+        const int shift = i * size.x / Variants / 4 * 4;
+        for( int y=0; y<size.y; y++ )
+        {
+            auto line = src + size_t( y ) * size.x;
+            auto dst = frame.data() + size_t( y ) * size.x;
+            memcpy( dst, line + shift, ( size.x - shift ) * sizeof( uint32_t ) );
+            memcpy( dst + size.x - shift, line, shift * sizeof( uint32_t ) );
+        }
+    }
+
+    // Persistent workers are pinned unless told otherwise
+    if( policy.pinning == WorkerPolicy::NoPinning ) policy.pinning = WorkerPolicy::Compact;
+
+    const auto type = SelectType( opt.etc2, opt.rgba, opt.dxtc, bmp->Alpha() );
+    static const char* TypeName[] = { "ETC1", "ETC2 RGB", "ETC2 RGBA", "DXT1", "DXT5" };
+
+    RealtimeCompressor rc( size, type, cpus, policy, opt.useHeuristics );
+    printf( "Real-time compression of %i %ix%i frames to %s, %u pinned worker threads\n", Frames, size.x, size.y, TypeName[type], rc.Threads() );
+
+    // Warm up page mappings and caches
+    for( int i=0; i<Variants; i++ ) rc.Compress( frames[i].data() );
+
+    auto start = GetTime();
+    for( int i=0; i<Frames; i++ ) rc.Compress( frames[i % Variants].data() );
+    auto end = GetTime();
+    std::vector<uint64_t> latency( rc.Latencies().end() - Frames, rc.Latencies().end() );
+    PrintLatency( "Synchronous", latency, end - start );
+
+    std::vector<uint64_t> send( rc.FrameBytes() / sizeof( uint64_t ) );
+    start = GetTime();
+    rc.Submit( frames[0].data() );
+    for( int i=1; i<=Frames; i++ )
+    {
+        auto blocks = rc.Wait();
+        if( i < Frames ) rc.Submit( frames[i % Variants].data() );
+        memcpy( send.data(), blocks, rc.FrameBytes() );
+    }
+    end = GetTime();
+    latency.assign( rc.Latencies().end() - Frames, rc.Latencies().end() );
+    PrintLatency( "Pipelined", latency, end - start );
+
+    return 0;
+}
+
+// Accepts "t0,t1,t2", or a file whose first line starts with that (as printed by --tune)
+static bool ParseThresholds( const char* str, float* t )
+{
+    char line[256];
+    if( sscanf( str, "%f , %f , %f", t, t+1, t+2 ) != 3 )
+    {
+        FILE* f = fopen( str, "r" );
+        if( !f ) return false;
+        const bool ok = fgets( line, sizeof( line ), f ) && sscanf( line, "%f , %f , %f", t, t+1, t+2 ) == 3;
+        fclose( f );
+        if( !ok ) return false;
+    }
+    return t[0] >= 0 && t[0] <= t[1];
+}
+
+// Compresses a corpus with each setting of a grid of ETC2 mode decision
+// thresholds and prints the settings that no other one beats in both speed
+// and quality. Compression uses all workers; only the RGB error is counted,
+// as the thresholds don't affect alpha.
+static int Tune( char** inputs, int num, bool rgba, unsigned int cpus, const WorkerPolicy& policy )
+{
+    enum { Runs = 3 };
+    static const float t0[] = { 0.f, 0.015f, 0.03f, 0.05f };
+    static const float t1[] = { 0.05f, 0.09f, 0.15f, 0.25f };
+    static const float t2[] = { 0.1f, 0.2f, 0.3f, 0.38f, 0.5f, 0.7f, 1.01f };
+
+    struct Result
+    {
+        float t[3];
+        double mpxs;
+        double psnr;
+    };
+
+    std::vector<BitmapPtr> corpus;
+    uint64_t pixels = 0;
+    for( int i=0; i<num; i++ )
+    {
+        auto bmp = std::make_shared<Bitmap>( inputs[i], std::numeric_limits<unsigned int>::max(), true );
+        const auto size = bmp->Size();
+        if( size.x <= 0 || size.y <= 0 || size.x % 4 != 0 || size.y % 4 != 0 )
+        {
+            fprintf( stderr, "Skipping %s: unreadable, or dimensions not divisible by 4.\n", inputs[i] );
+            continue;
+        }
+        bmp->Data();
+        pixels += uint64_t( size.x ) * size.y;
+        corpus.emplace_back( std::move( bmp ) );
+    }
+    if( corpus.empty() ) return 1;
+
+    TaskDispatch taskDispatch( cpus, policy );
+
+    std::vector<BlockDataPtr> out( corpus.size() );
+    auto compress = [&corpus, &out, rgba]
+    {
+        for( size_t i=0; i<corpus.size(); i++ )
+        {
+            auto& bmp = corpus[i];
+            const auto size = bmp->Size();
+            auto bd = std::make_shared<BlockData>( size, false, SelectType( true, rgba, false, bmp->Alpha() ) );
+            const uint32_t* ptr = bmp->Data();
+            for( int row=0; row<size.y/4; row+=32 )
+            {
+                const auto lines = std::min( 32, size.y/4 - row );
+                TaskDispatch::Queue( [bd, ptr, size, row, lines]
+                {
+                    const auto src = ptr + size_t( row ) * 4 * size.x;
+                    const auto offset = size_t( row ) * size.x / 4;
+                    if( bd->IsAlpha() )
+                    {
+                        bd->ProcessRGBA( src, size.x / 4 * lines, offset, size.x, true );
+                    }
+                    else
+                    {
+                        bd->Process( src, size.x / 4 * lines, offset, size.x, Channels::RGB, false, true );
+                    }
+                } );
+            }
+            out[i] = std::move( bd );
+        }
+        TaskDispatch::Sync();
+    };
+
+    // The grid, plus the thresholds in use for reference
+    const Result current = { { ecmd_threshold[0], ecmd_threshold[1], ecmd_threshold[2] }, 0, 0 };
+    auto isCurrent = [&current]( const Result& v ) { return memcmp( v.t, current.t, sizeof( v.t ) ) == 0; };
+    std::vector<Result> results;
+    for( auto a : t0 )
+    {
+        for( auto b : t1 )
+        {
+            if( b < a ) continue;
+            for( auto c : t2 )
+            {
+                if( c >= b ) results.emplace_back( Result { { a, b, c }, 0, 0 } );
+            }
+        }
+    }
+    if( std::none_of( results.begin(), results.end(), isCurrent ) ) results.emplace_back( current );
+
+    int done = 0;
+    for( auto& v : results )
+    {
+        memcpy( ecmd_threshold, v.t, sizeof( v.t ) );
+
+        uint64_t best = std::numeric_limits<uint64_t>::max();
+        for( int run=0; run<Runs; run++ )
+        {
+            const auto start = GetTime();
+            compress();
+            best = std::min( best, GetTime() - start );
+        }
+
+        uint64_t sq = 0;
+        for( size_t i=0; i<corpus.size(); i++ )
+        {
+            const auto size = corpus[i]->Size();
+            std::vector<uint32_t> buf( size_t( size.x ) * size.y );
+            out[i]->Decode( (uint8_t*)buf.data(), size.x * 4, BlockData::BGRA8 );
+            ErrorStats stats = {};
+            CalcErrorStats( buf.data(), size.x, corpus[i]->Data(), size.x, size, false, stats );
+            sq += stats.sq[0] + stats.sq[1] + stats.sq[2];
+        }
+
+        const double mse = double( sq ) / ( double( pixels ) * 3 );
+        v.mpxs = pixels / ( best / 1000. ) / 1000.;
+        v.psnr = mse > 0 ? 20 * log10( 255 ) - 10 * log10( mse ) : 99;
+        fprintf( stderr, "\r%i/%i settings tested", ++done, (int)results.size() );
+    }
+    fprintf( stderr, "\n" );
+
+    // Fastest first; a setting is on the front if it's better than every faster one
+    std::sort( results.begin(), results.end(), []( const Result& l, const Result& r ) { return l.mpxs > r.mpxs; } );
+    printf( "Pareto front of %i settings, %i images, %.1f Mpx (use a line with --thresholds):\n", (int)results.size(), (int)corpus.size(), pixels / 1000000. );
+    double bestPsnr = -1;
+    for( auto& v : results )
+    {
+        if( v.psnr <= bestPsnr ) continue;
+        bestPsnr = v.psnr;
+        printf( "%.3f,%.3f,%.3f  %10.2f Mpx/s  PSNR %.3f%s\n", v.t[0], v.t[1], v.t[2], v.mpxs, v.psnr, isCurrent( v ) ? "  (current)" : "" );
+    }
+    for( auto& v : results )
+    {
+        if( isCurrent( v ) ) printf( "Current %.3f,%.3f,%.3f: %.2f Mpx/s  PSNR %.3f\n", v.t[0], v.t[1], v.t[2], v.mpxs, v.psnr );
+    }
+
+    memcpy( ecmd_threshold, current.t, sizeof( current.t ) );
+    return 0;
+}
+
+// Parses lists like "0,2,4-7"
+static bool ParseCpuList( const char* str, std::vector<int>& cpus )
+{
+    while( *str )
+    {
+        char* end;
+        const int first = (int)strtol( str, &end, 10 );
+        if( end == str || first < 0 ) return false;
+        int last = first;
+        if( *end == '-' )
+        {
+            str = end + 1;
+            last = (int)strtol( str, &end, 10 );
+            if( end == str || last < first ) return false;
+        }
+        for( int i=first; i<=last; i++ ) cpus.emplace_back( i );
+        if( *end == ',' ) end++;
+        else if( *end != '\0' ) return false;
+        str = end;
+    }
+    return !cpus.empty();
+}
+
+static Progress* s_progress = nullptr;
+
+static void OnInterrupt( int )
+{
+    // First interrupt cancels the job cleanly, a second one kills the process
+    signal( SIGINT, SIG_DFL );
+    if( s_progress ) s_progress->Cancel();
+}
+
 void Usage()
 {
     fprintf( stderr, "Usage: etcpak [options] input.png {output.pvr}\n" );
+    fprintf( stderr, "  Input may be png, raw4, binary ppm/pam, bmp or tga (24/32 bit, uncompressed).\n" );
+    fprintf( stderr, "  Radiance .hdr and .pfm input is compressed to unsigned BC6H (-m, -s, -b, -M, --order and\n" );
+    fprintf( stderr, "  --write-mode apply).\n" );
+    fprintf( stderr, "  Input file name \"-\" reads a png, raw4, ppm/pam or bmp image from stdin.\n" );
+    fprintf( stderr, "  Output file name \"-\" streams the compressed file to stdout.\n" );
     fprintf( stderr, "  Options:\n" );
     fprintf( stderr, "  -v                     view mode (loads pvr/ktx file, decodes it and saves to png)\n" );
-    fprintf( stderr, "  -s                     display image quality measurements\n" );
+    fprintf( stderr, "                         BC6H files are saved as pfm if the output is named .pfm\n" );
+    fprintf( stderr, "                         with -m every mip level is saved, as output-N.png for level N > 0\n" );
+    fprintf( stderr, "  -s                     display image quality measurements (per mip level with -m)\n" );
     fprintf( stderr, "  -b                     benchmark mode\n" );
+    fprintf( stderr, "  --compare              compare input and output files (pvr/ktx against pvr/ktx or png)\n" );
     fprintf( stderr, "  -M                     switch benchmark to multi-threaded mode\n" );
+    fprintf( stderr, "  --realtime             benchmark low-latency compression of a stream of frames (frame size\n" );
+    fprintf( stderr, "                         is the input's), reporting fps and p50/p99 frame latency\n" );
     fprintf( stderr, "  -m                     generate mipmaps\n" );
+    fprintf( stderr, "  --small-mips-first     with -m, compress and flush from the 1x1 level up to level 0\n" );
     fprintf( stderr, "  -d                     enable dithering\n" );
+    fprintf( stderr, "  --progress             show compression progress (interrupt cancels the job)\n" );
+    fprintf( stderr, "  --cost-schedule        estimate the cost of each strip, queue the expensive ones first and split them\n" );
+    fprintf( stderr, "  --batch                input is a list of \"input output\" file name pairs; small images are\n" );
+    fprintf( stderr, "                         packed into shared tasks (-m, -d and format options apply to all)\n" );
+    fprintf( stderr, "  --sequence             like --batch, for the frames of an animation in order; blocks that\n" );
+    fprintf( stderr, "                         didn't change (much) since the previous frame reuse its output\n" );
+    fprintf( stderr, "                         (pays off in ETC modes; DXT compresses faster than frames compare)\n" );
+    fprintf( stderr, "  --pages size           write a virtual texture page file: the image (and its mip levels with\n" );
+    fprintf( stderr, "                         -m, down to one page) cut into pages of size x size pixels\n" );
+    fprintf( stderr, "  --page-border n        pixels of the neighbouring pages around each page (default 4)\n" );
+    fprintf( stderr, "  --etc1s                write the ETC1S intermediate format: ETC1 blocks of one color and table,\n" );
+    fprintf( stderr, "                         from image wide endpoint and selector codebooks (with -m, mips too)\n" );
+    fprintf( stderr, "  --codebooks e,s        ETC1S endpoint and selector codebook sizes (default 1024,1024)\n" );
+    fprintf( stderr, "  --transcode            input is an ETC1S file; transcode it to ETC1/ETC2 RGB (per --etc1) or DXT1\n" );
+    fprintf( stderr, "  --tune                 inputs are a corpus of images; compress it with a grid of ETC2 mode\n" );
+    fprintf( stderr, "                         decision thresholds and print the speed/PSNR Pareto front\n" );
+    fprintf( stderr, "  --thresholds t         ETC2 mode decision thresholds, as \"t0,t1,t2\" (default 0.03,0.09,0.38)\n" );
+    fprintf( stderr, "                         or a file starting with such a line\n" );
+    fprintf( stderr, "  --out-of-core          keep the source image and mips in temporary files (in $TMPDIR or /var/tmp)\n" );
+    fprintf( stderr, "                         instead of memory; done automatically for images too large for RAM\n" );
+    fprintf( stderr, "  --pin mode             pin worker threads: compact, scatter or a cpu list (e.g. 0,2,4-7)\n" );
+    fprintf( stderr, "  --no-smt               use one worker per physical core\n" );
+    fprintf( stderr, "  --sched class          worker scheduling class: normal (default), batch, idle\n" );
+    fprintf( stderr, "  --nice n               worker nice level (Linux and Windows only; elsewhere nice applies\n" );
+    fprintf( stderr, "                         to the whole process and is ignored)\n" );
     fprintf( stderr, "  -a alpha.pvr           save alpha channel in a separate file\n" );
     fprintf( stderr, "  --etc1                 use ETC1 mode (ETC2 is used by default)\n" );
     fprintf( stderr, "  --rgba                 enable RGBA in ETC2 mode (RGB is used by default\n" );
     fprintf( stderr, "  --disable-heuristics   disable heuristic selector of compression mode\n" );
     fprintf( stderr, "  --dxtc                 use DXT1 compression\n" );
-    fprintf( stderr, "  --linear               input data is in linear space (disable sRGB conversion for mips)\n\n" );
+    fprintf( stderr, "  --linear               input data is in linear space (disable sRGB conversion for mips)\n" );
+    fprintf( stderr, "  --order order          block order in each level: linear (default), morton (Z-order) or\n" );
+    fprintf( stderr, "                         tiles:N (rows of NxN block tiles); stored in the pvr metadata\n" );
+    fprintf( stderr, "  --stream-stores        write compressed blocks with non-temporal stores, bypassing the cache\n" );
+    fprintf( stderr, "  --prefetch             prefetch the source pixels of the next block row\n" );
+    fprintf( stderr, "  --write-mode mode      output file access: mmap (default), populate (prefaulted mmap), pwrite,\n" );
+    fprintf( stderr, "                         async (io_uring or a pwrite thread, stats shown with -s),\n" );
+    fprintf( stderr, "                         stream (sequential writes, for pipes and sockets)\n\n" );
     fprintf( stderr, "Output file name may be unneeded for some modes.\n" );
 }
 
@@ -63,6 +1088,24 @@ int main( int argc, char** argv )
     bool dxtc = false;
     bool linearize = true;
     bool useHeuristics = true;
+    bool compare = false;
+    bool showProgress = false;
+    bool smallFirst = false;
+    bool costSchedule = false;
+    bool batch = false;
+    bool tune = false;
+    bool sequence = false;
+    bool realtime = false;
+    int pageSize = 0;
+    int pageBorder = 4;
+    bool etc1s = false;
+    bool transcode = false;
+    int endpoints = 1024;
+    int selectors = 1024;
+    Bitmap::Storage storage = Bitmap::Auto;
+    WorkerPolicy policy;
+    BlockData::WriteMode writeMode = BlockData::Mmap;
+    BlockOrder order;
     const char* alpha = nullptr;
     unsigned int cpus = System::CPUCores();
 
@@ -78,7 +1121,30 @@ int main( int argc, char** argv )
         OptRgba,
         OptDxtc,
         OptLinear,
-        OptNoHeuristics
+        OptNoHeuristics,
+        OptCompare,
+        OptWriteMode,
+        OptProgress,
+        OptSmallFirst,
+        OptPin,
+        OptNoSmt,
+        OptSched,
+        OptNice,
+        OptCostSchedule,
+        OptOutOfCore,
+        OptBatch,
+        OptThresholds,
+        OptTune,
+        OptSequence,
+        OptRealtime,
+        OptOrder,
+        OptPages,
+        OptPageBorder,
+        OptStreamStores,
+        OptPrefetch,
+        OptEtc1s,
+        OptCodebooks,
+        OptTranscode
     };
 
     struct option longopts[] = {
@@ -87,6 +1153,29 @@ int main( int argc, char** argv )
         { "dxtc", no_argument, nullptr, OptDxtc },
         { "linear", no_argument, nullptr, OptLinear },
         { "disable-heuristics", no_argument, nullptr, OptNoHeuristics },
+        { "compare", no_argument, nullptr, OptCompare },
+        { "write-mode", required_argument, nullptr, OptWriteMode },
+        { "progress", no_argument, nullptr, OptProgress },
+        { "small-mips-first", no_argument, nullptr, OptSmallFirst },
+        { "pin", required_argument, nullptr, OptPin },
+        { "no-smt", no_argument, nullptr, OptNoSmt },
+        { "sched", required_argument, nullptr, OptSched },
+        { "nice", required_argument, nullptr, OptNice },
+        { "cost-schedule", no_argument, nullptr, OptCostSchedule },
+        { "out-of-core", no_argument, nullptr, OptOutOfCore },
+        { "batch", no_argument, nullptr, OptBatch },
+        { "thresholds", required_argument, nullptr, OptThresholds },
+        { "tune", no_argument, nullptr, OptTune },
+        { "sequence", no_argument, nullptr, OptSequence },
+        { "realtime", no_argument, nullptr, OptRealtime },
+        { "order", required_argument, nullptr, OptOrder },
+        { "pages", required_argument, nullptr, OptPages },
+        { "page-border", required_argument, nullptr, OptPageBorder },
+        { "stream-stores", no_argument, nullptr, OptStreamStores },
+        { "prefetch", no_argument, nullptr, OptPrefetch },
+        { "etc1s", no_argument, nullptr, OptEtc1s },
+        { "codebooks", required_argument, nullptr, OptCodebooks },
+        { "transcode", no_argument, nullptr, OptTranscode },
         {}
     };
 
@@ -135,20 +1224,145 @@ int main( int argc, char** argv )
             break;
         case OptNoHeuristics:
             useHeuristics = false;
+            break;
+        case OptCompare:
+            compare = true;
+            break;
+        case OptWriteMode:
+            if( strcmp( optarg, "mmap" ) == 0 ) writeMode = BlockData::Mmap;
+            else if( strcmp( optarg, "populate" ) == 0 ) writeMode = BlockData::MmapPopulate;
+            else if( strcmp( optarg, "pwrite" ) == 0 ) writeMode = BlockData::Pwrite;
+            else if( strcmp( optarg, "async" ) == 0 ) writeMode = BlockData::Async;
+            else if( strcmp( optarg, "stream" ) == 0 ) writeMode = BlockData::Stream;
+            else
+            {
+                Usage();
+                return 1;
+            }
+            break;
+        case OptProgress:
+            showProgress = true;
+            break;
+        case OptSmallFirst:
+            smallFirst = true;
+            break;
+        case OptPin:
+            if( strcmp( optarg, "compact" ) == 0 ) policy.pinning = WorkerPolicy::Compact;
+            else if( strcmp( optarg, "scatter" ) == 0 ) policy.pinning = WorkerPolicy::Scatter;
+            else if( ParseCpuList( optarg, policy.cpus ) ) policy.pinning = WorkerPolicy::List;
+            else
+            {
+                Usage();
+                return 1;
+            }
+            break;
+        case OptNoSmt:
+            policy.avoidSmt = true;
+            break;
+        case OptSched:
+            if( strcmp( optarg, "normal" ) == 0 ) policy.schedClass = WorkerPolicy::Normal;
+            else if( strcmp( optarg, "batch" ) == 0 ) policy.schedClass = WorkerPolicy::Batch;
+            else if( strcmp( optarg, "idle" ) == 0 ) policy.schedClass = WorkerPolicy::Idle;
+            else
+            {
+                Usage();
+                return 1;
+            }
+            break;
+        case OptNice:
+            policy.nice = atoi( optarg );
+            break;
+        case OptCostSchedule:
+            costSchedule = true;
+            break;
+        case OptOutOfCore:
+            storage = Bitmap::TempFile;
+            break;
+        case OptBatch:
+            batch = true;
+            break;
+        case OptThresholds:
+            if( !ParseThresholds( optarg, ecmd_threshold ) )
+            {
+                Usage();
+                return 1;
+            }
+            break;
+        case OptTune:
+            tune = true;
+            break;
+        case OptSequence:
+            sequence = true;
+            break;
+        case OptRealtime:
+            realtime = true;
+            break;
+        case OptPages:
+            pageSize = atoi( optarg );
+            break;
+        case OptPageBorder:
+            pageBorder = atoi( optarg );
+            break;
+        case OptStreamStores:
+            stream_stores = true;
+            break;
+        case OptPrefetch:
+            prefetch_rows = true;
+            break;
+        case OptEtc1s:
+            etc1s = true;
+            break;
+        case OptCodebooks:
+            if( sscanf( optarg, "%i,%i", &endpoints, &selectors ) != 2 || endpoints < 1 || selectors < 1 || endpoints > Etc1sData::MaxCodebookSize || selectors > Etc1sData::MaxCodebookSize )
+            {
+                Usage();
+                return 1;
+            }
+            break;
+        case OptTranscode:
+            transcode = true;
+            break;
+        case OptOrder:
+            if( strcmp( optarg, "linear" ) == 0 ) order = BlockOrder();
+            else if( strcmp( optarg, "morton" ) == 0 ) order = BlockOrder( BlockOrder::Morton );
+            else if( strncmp( optarg, "tiles:", 6 ) == 0 && atoi( optarg + 6 ) > 0 ) order = BlockOrder( BlockOrder::Tiled, atoi( optarg + 6 ) );
+            else
+            {
+                Usage();
+                return 1;
+            }
+            break;
         default:
             break;
         }
     }
 
+    if( policy.avoidSmt )
+    {
+        unsigned int cores = 0;
+        for( auto& v : System::CPUTopology() ) if( v.thread == 0 ) cores++;
+        cpus = std::max( 1u, std::min( cpus, cores ) );
+    }
+    else if( policy.pinning == WorkerPolicy::List )
+    {
+        cpus = (unsigned int)policy.cpus.size();
+    }
+
+    if( pageSize != 0 && ( pageSize < 0 || pageBorder < 0 || ( pageSize + pageBorder * 2 ) % 4 != 0 ) )
+    {
+        fprintf( stderr, "Page size plus borders must be a positive multiple of 4.\n" );
+        return 1;
+    }
+
     if( etc2 && dither )
     {
-        printf( "Dithering is disabled in ETC2 mode, as it degrades image quality.\n" );
+        fprintf( stderr, "Dithering is disabled in ETC2 mode, as it degrades image quality.\n" );
         dither = false;
     }
 
     const char* input = nullptr;
     const char* output = nullptr;
-    if( benchmark )
+    if( benchmark || batch || sequence || tune || realtime )
     {
         if( argc - optind < 1 )
         {
@@ -170,7 +1384,48 @@ int main( int argc, char** argv )
         output = argv[optind+1];
     }
 
-    if( benchmark )
+    if( compare )
+    {
+        return Compare( input, output, cpus );
+    }
+    else if( batch )
+    {
+        const BatchOptions opt = { mipmap, etc2, rgba, dxtc, dither, linearize, useHeuristics, order };
+        return CompressBatch( input, opt, cpus, policy );
+    }
+    else if( sequence )
+    {
+        const BatchOptions opt = { mipmap, etc2, rgba, dxtc, dither, linearize, useHeuristics, order };
+        return CompressSequence( input, opt, stats, cpus, policy );
+    }
+    else if( pageSize != 0 )
+    {
+        const BatchOptions opt = { mipmap, etc2, rgba, dxtc, dither, linearize, useHeuristics, order };
+        return CompressPages( input, output, opt, pageSize, pageBorder, storage, stats, cpus, policy );
+    }
+    else if( etc1s )
+    {
+        return CompressEtc1s( input, output, mipmap, linearize, endpoints, selectors, stats, cpus, policy );
+    }
+    else if( transcode )
+    {
+        return TranscodeEtc1s( input, output, SelectType( etc2, false, dxtc, false ), writeMode, order, stats );
+    }
+    else if( realtime )
+    {
+        const BatchOptions opt = { false, etc2, rgba, dxtc, false, linearize, useHeuristics, order };
+        return RealtimeBenchmark( input, opt, cpus, policy );
+    }
+    else if( tune )
+    {
+        return Tune( argv + optind, argc - optind, rgba, cpus, policy );
+    }
+    else if( !viewMode && BitmapHdr::IsHdrFile( input ) )
+    {
+        if( benchmark ) return BenchmarkHdr( input, benchMt, cpus, policy );
+        return CompressHdr( input, output, mipmap, stats, writeMode, order, cpus, policy );
+    }
+    else if( benchmark )
     {
         if( viewMode )
         {
@@ -193,15 +1448,25 @@ int main( int argc, char** argv )
         {
             auto start = GetTime();
             auto bmp = std::make_shared<Bitmap>( input, std::numeric_limits<unsigned int>::max(), !dxtc );
+            if( bmp->Size().x == 0 )
+            {
+                fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+                return 1;
+            }
             auto data = bmp->Data();
             auto end = GetTime();
             printf( "Image load time: %0.3f ms\n", ( end - start ) / 1000.f );
 
             constexpr int NumTasks = 9;
             uint64_t timeData[NumTasks];
+            size_t scratchPeak;
+            // Opened before the workers start so that their counts are included
+            CacheCounters counters;
+            const auto refs0 = counters.References();
+            const auto misses0 = counters.Misses();
             if( benchMt )
             {
-                TaskDispatch taskDispatch( cpus );
+                TaskDispatch taskDispatch( cpus, policy );
                 const unsigned int parts = ( ( bmp->Size().y / 4 ) + 32 - 1 ) / 32;
 
                 for( int i=0; i<NumTasks; i++ )
@@ -250,6 +1515,7 @@ int main( int argc, char** argv )
                     const auto localEnd = GetTime();
                     timeData[i] = localEnd - localStart;
                 }
+                scratchPeak = TaskDispatch::ScratchPeak();
             }
             else
             {
@@ -276,7 +1542,10 @@ int main( int argc, char** argv )
                     const auto localEnd = GetTime();
                     timeData[i] = localEnd - localStart;
                 }
+                scratchPeak = TaskDispatch::ScratchPeak();
             }
+            const auto refs = counters.References() - refs0;
+            const auto misses = counters.Misses() - misses0;
             std::sort( timeData, timeData+NumTasks );
             const auto median = timeData[NumTasks/2] / 1000.f;
             printf( "Median compression time for %i runs: %0.3f ms (%0.3f Mpx/s)", NumTasks, median, bmp->Size().x * bmp->Size().y / ( median * 1000 ) );
@@ -288,91 +1557,324 @@ int main( int argc, char** argv )
             {
                 printf( " single threaded\n" );
             }
+            const double blocks = double( bmp->Size().x / 4 ) * ( bmp->Size().y / 4 ) * NumTasks;
+            // The kernels reuse one scratch block per row of blocks, so the
+            // arena peak is what each block in flight works in
+            if( scratchPeak != 0 ) printf( "Scratch memory per block: %zu bytes\n", scratchPeak );
+            if( counters.IsValid() && refs != 0 )
+            {
+                printf( "Cache misses: %0.3f per block, %0.2f%% of %0.2f references per block\n", misses / blocks, 100.0 * misses / refs, refs / blocks );
+            }
         }
     }
     else if( viewMode )
     {
         auto bd = std::make_shared<BlockData>( input );
-        auto out = bd->Decode();
-        out->Write( output );
+        const auto ext = strrchr( output, '.' );
+        if( bd->BlockType() == BlockData::Bc6h && ext && strcmp( ext, ".pfm" ) == 0 )
+        {
+            const int levels = mipmap ? bd->Levels() : 1;
+            for( int i=0; i<levels; i++ )
+            {
+                bd->DecodeHdr( i )->Write( i == 0 ? output : MipLevelName( output, i ).c_str() );
+            }
+        }
+        else if( mipmap && bd->Levels() > 1 )
+        {
+            TaskDispatch taskDispatch( cpus, policy );
+            auto levels = bd->DecodeLevels();
+            levels[0]->Write( output );
+            for( size_t i=1; i<levels.size(); i++ )
+            {
+                levels[i]->Write( MipLevelName( output, int( i ) ).c_str() );
+            }
+        }
+        else
+        {
+            auto out = bd->Decode();
+            out->Write( output );
+        }
     }
     else
     {
-        DataProvider dp( input, mipmap, !dxtc, linearize );
-        auto num = dp.NumberOfParts();
-
-        BlockData::Type type;
-        if( etc2 )
+        if( strcmp( output, "-" ) == 0 )
         {
-            if( rgba && dp.Alpha() )
+            if( stats )
             {
-                type = BlockData::Etc2_RGBA;
+                fprintf( stderr, "Image quality measurements can't be displayed when streaming to stdout.\n" );
+                return 1;
             }
-            else
+            writeMode = BlockData::Stream;
+#ifdef _MSC_VER
+            _setmode( _fileno( stdout ), _O_BINARY );
+#endif
+        }
+
+        if( costSchedule && ( smallFirst || writeMode == BlockData::Stream ) )
+        {
+            // Both need parts processed in order
+            fprintf( stderr, "Cost scheduling is not available with ordered output.\n" );
+            costSchedule = false;
+        }
+        if( smallFirst && writeMode == BlockData::Stream )
+        {
+            // The stream has to start with level 0, so nothing could be emitted early
+            fprintf( stderr, "Small mips first ordering is not available when streaming.\n" );
+            smallFirst = false;
+        }
+
+        // The source image with its mip pyramid is resident unless it went to
+        // a temporary file. Buffered write modes add the whole output, -s adds
+        // the decoded image.
+        auto Footprint = [mipmap, writeMode, stats]( const v2i& size, bool outOfCore, bool wideBlocks )
+        {
+            const uint64_t pixels = uint64_t( size.x ) * size.y * ( mipmap ? 4 : 3 ) / 3;
+            uint64_t footprint = outOfCore ? 0 : pixels * 4;
+            if( writeMode != BlockData::Mmap && writeMode != BlockData::MmapPopulate )
             {
-                type = BlockData::Etc2_RGB;
+                footprint += wideBlocks ? pixels : pixels / 2;
             }
+            if( stats ) footprint += pixels * 4;
+            return footprint;
+        };
+
+        // Leave a quarter of the limit for everything else. Whether the
+        // image has alpha isn't known before loading, so assume it does.
+        const auto memLimit = System::MemoryLimit();
+        v2i inputSize;
+        if( memLimit != 0 && storage == Bitmap::Auto && Bitmap::ReadSize( input, inputSize ) && Footprint( inputSize, false, true ) > memLimit / 4 * 3 )
+        {
+            storage = Bitmap::TempFile;
+        }
+
+        DataProvider dp( input, mipmap, !dxtc, linearize, smallFirst ? DataProvider::SmallestFirst : DataProvider::LargestFirst, storage );
+        if( dp.Size().x == 0 )
+        {
+            fprintf( stderr, "Unable to read %s, or dimensions not divisible by 4.\n", input );
+            return 1;
         }
-        else if( dxtc )
+        auto num = dp.NumberOfParts();
+
+        const auto type = SelectType( etc2, rgba, dxtc, dp.Alpha() );
+
+        const uint64_t footprint = Footprint( dp.Size(), dp.OutOfCore(), type == BlockData::Etc2_RGBA || type == BlockData::Dxt5 );
+        const bool boundedMemory = memLimit != 0 && footprint > memLimit / 4 * 3;
+        if( boundedMemory )
         {
-            if( dp.Alpha() )
+            fprintf( stderr, "Estimated memory use of %llu MB exceeds the memory limit of %llu MB, using bounded memory mode.\n", (unsigned long long)( footprint >> 20 ), (unsigned long long)( memLimit >> 20 ) );
+            // Output goes through the page cache, written back as it is produced
+            if( writeMode != BlockData::Stream ) writeMode = BlockData::Mmap;
+            if( !dp.OutOfCore() )
             {
-                type = BlockData::Dxt5;
+                // Input from stdin, or no temporary file could be created
+                fprintf( stderr, "The source image is kept in memory, the memory limit may not be met.\n" );
             }
-            else
+        }
+
+        TaskDispatch taskDispatch( cpus, policy );
+
+        Progress progress;
+        auto bd = std::make_shared<BlockData>( output, dp.Size(), mipmap, type, writeMode, order );
+        if( !bd->IsOpen() )
+        {
+            fprintf( stderr, "Unable to write %s\n", output );
+            return 1;
+        }
+        bd->SetProgress( &progress );
+        bd->SetEagerWriteback( boundedMemory );
+        bd->SetLevelWriteback( smallFirst );
+        BlockDataPtr bda;
+        if( alpha && dp.Alpha() && !rgba )
+        {
+            bda = std::make_shared<BlockData>( alpha, dp.Size(), mipmap, type, writeMode, order );
+            if( !bda->IsOpen() )
             {
-                type = BlockData::Dxt1;
+                fprintf( stderr, "Unable to write %s\n", alpha );
+                return 1;
             }
+            bda->SetProgress( &progress );
+            bda->SetEagerWriteback( boundedMemory );
+            bda->SetLevelWriteback( smallFirst );
         }
-        else
+        progress.SetTotal( bd->NumberOfBlocks() + ( bda ? bda->NumberOfBlocks() : 0 ) );
+
+        // Source levels are freed as soon as both outputs are done with them,
+        // so -s measures each level's quality before letting it go.
+        std::vector<float> levelMse( bd->Levels() );
+        dp.EnableRelease( bda ? 2 : 1 );
+        bd->SetLevelCallback( [&dp, &bd, &levelMse, stats, dxtc, showProgress, mipmap]( int level )
+        {
+            if( stats )
+            {
+                const auto& src = dp.ImageData( level );
+                const auto& size = src.Size();
+                const v2i padded( std::max( 4, size.x ), std::max( 4, size.y ) );
+                Bitmap out( padded );
+                // Compare in the channel order the source was loaded in.
+                bd->Decode( (uint8_t*)out.Data(), padded.x * 4, dxtc ? BlockData::RGBA8 : BlockData::BGRA8, level, 0, padded.y / 4 );
+                levelMse[level] = CalcMSE3( src.Data(), padded.x, out.Data(), padded.x, size );
+            }
+            if( showProgress && mipmap ) fprintf( stderr, "\rLevel %i done\n", level );
+            dp.Release( level );
+        } );
+        if( bda )
         {
-            type = BlockData::Etc1;
+            bda->SetLevelCallback( [&dp]( int level ) { dp.Release( level ); } );
         }
 
-        TaskDispatch taskDispatch( cpus );
+        s_progress = &progress;
+        signal( SIGINT, OnInterrupt );
 
-        auto bd = std::make_shared<BlockData>( output, dp.Size(), mipmap, type );
-        BlockDataPtr bda;
-        if( alpha && dp.Alpha() && !rgba )
+        std::atomic<bool> done( false );
+        std::thread progressThread;
+        if( showProgress )
         {
-            bda = std::make_shared<BlockData>( alpha, dp.Size(), mipmap, type );
+            progressThread = std::thread( [&progress, &done]
+            {
+                while( !done.load() )
+                {
+                    fprintf( stderr, "\r%5.1f%%", 100.0 * progress.Blocks() / progress.Total() );
+                    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+                }
+                fprintf( stderr, "\r%5.1f%%\n", 100.0 * progress.Blocks() / progress.Total() );
+            } );
         }
-        for( int i=0; i<num; i++ )
+
+        // Streamed output is written in order, so parts finished ahead of the
+        // write position are held back. A part is queued only once the write
+        // position is within the window of it, which bounds the reorder window
+        // and, with written ranges released, the output buffer in use. Other
+        // block orders emit whole levels, so they can't be bounded that way.
+        enum { StreamWindow = 8 << 20 };
+        const bool streamWindow = writeMode == BlockData::Stream && order.IsLinear();
+        if( writeMode == BlockData::Stream && !stats )
         {
-            auto part = dp.NextPart();
+            bd->SetReleaseWritten( true );
+            if( bda ) bda->SetReleaseWritten( true );
+        }
+        auto streamFailed = [&bd, &bda]
+        {
+            return ( bd->Streamer() && bd->Streamer()->Failed() ) || ( bda && bda->Streamer() && bda->Streamer()->Failed() );
+        };
+        int level = -1;
 
+        auto queuePart = [&bd, &bda, type, dither, useHeuristics]( const DataPart& part )
+        {
             if( type == BlockData::Etc2_RGBA || type == BlockData::Dxt5 )
             {
-                TaskDispatch::Queue( [part, i, &bd, &dither, useHeuristics]()
+                TaskDispatch::Queue( [part, &bd, useHeuristics]()
                 {
                     bd->ProcessRGBA( part.src, part.width / 4 * part.lines, part.offset, part.width, useHeuristics );
                 } );
             }
             else
             {
-                TaskDispatch::Queue( [part, i, &bd, &dither, useHeuristics]()
+                TaskDispatch::Queue( [part, &bd, dither, useHeuristics]()
                 {
                     bd->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::RGB, dither, useHeuristics );
                 } );
                 if( bda )
                 {
-                    TaskDispatch::Queue( [part, i, &bda, useHeuristics]()
+                    TaskDispatch::Queue( [part, &bda, useHeuristics]()
                     {
                         bda->Process( part.src, part.width / 4 * part.lines, part.offset, part.width, Channels::Alpha, false, useHeuristics );
                     } );
                 }
             }
+        };
+
+        std::vector<DataPart> parts;
+        for( int i=0; i<num; i++ )
+        {
+            if( progress.Cancelled() || streamFailed() ) break;
+            auto part = dp.NextPart();
+            if( streamWindow )
+            {
+                // Run queued parts meanwhile, as Sync() would
+                const size_t start = size_t( part.offset ) * bd->BlockWords() * 8;
+                while( start > bd->Streamer()->Written() + StreamWindow && !progress.Cancelled() )
+                {
+                    if( !TaskDispatch::RunOne() ) bd->Streamer()->Wait( start - StreamWindow );
+                }
+            }
+            if( smallFirst && part.level != level )
+            {
+                // The dispatcher is LIFO; finish each level before queueing the next larger one
+                TaskDispatch::Sync();
+                level = part.level;
+            }
+
+            if( costSchedule )
+            {
+                parts.emplace_back( part );
+            }
+            else
+            {
+                queuePart( part );
+            }
+        }
+
+        if( costSchedule && !progress.Cancelled() )
+        {
+            for( auto& part : ScheduleByCost( parts, cpus ) ) queuePart( part );
         }
 
         TaskDispatch::Sync();
 
+        done.store( true );
+        if( progressThread.joinable() ) progressThread.join();
+        signal( SIGINT, SIG_DFL );
+        s_progress = nullptr;
+
+        if( progress.Cancelled() )
+        {
+            fprintf( stderr, "Compression cancelled.\n" );
+            const bool alphaFile = bda != nullptr;
+            bd.reset();
+            bda.reset();
+            if( strcmp( output, "-" ) != 0 ) remove( output );
+            if( alphaFile ) remove( alpha );
+            return 1;
+        }
+        if( streamFailed() )
+        {
+            fprintf( stderr, "Unable to write %s\n", bd->Streamer()->Failed() ? output : alpha );
+            return 1;
+        }
+
         if( stats )
         {
-            auto out = bd->Decode();
-            float mse = CalcMSE3( dp.ImageData(), *out );
+            float mse = levelMse[0];
             printf( "RGB data\n" );
             printf( "  RMSE: %f\n", sqrt( mse ) );
             printf( "  PSNR: %f\n", 20 * log10( 255 ) - 10 * log10( mse ) );
+
+            for( int i=1; i<bd->Levels(); i++ )
+            {
+                const auto size = bd->LevelSize( i );
+                mse = levelMse[i];
+                printf( "  Level %2i %5ix%-5i  RMSE: %f  PSNR: %f\n", i, size.x, size.y, sqrt( mse ), 20 * log10( 255 ) - 10 * log10( mse ) );
+            }
+
+            const bool mapped = bd->Mode() == BlockData::Mmap || bd->Mode() == BlockData::MmapPopulate;
+            printf( "Memory\n" );
+            printf( "  Peak RSS: %.1f MB\n", System::PeakMemoryUsage() / 1048576.0 );
+            printf( "  Source image: %.1f MB (%s)\n", dp.SourceBytes() / 1048576.0, dp.OutOfCore() ? "file backed" : "heap" );
+            if( mipmap ) printf( "  Mip levels: %.1f MB\n", dp.MipBytes() / 1048576.0 );
+            printf( "  Output: %.1f MB (%s)\n", ( bd->DataSize() + ( bda ? bda->DataSize() : 0 ) ) / 1048576.0, mapped ? "mapped" : "heap" );
+            printf( "  Peak bitmap heap: %.1f MB\n", Bitmap::PeakHeapBytes() / 1048576.0 );
+
+            if( auto writer = bd->Writer() )
+            {
+                printf( "Output writer: %s\n", writer->UsesIoUring() ? "io_uring" : "pwrite thread" );
+                printf( "  Max queue depth: %zu\n", writer->MaxQueueDepth() );
+                printf( "  Max bytes in flight: %zu\n", writer->MaxBytesInFlight() );
+            }
+            if( auto stream = bd->Streamer() )
+            {
+                printf( "Streamed output: %zu bytes\n", stream->Written() );
+                printf( "  Max bytes held in reorder window: %zu\n", stream->MaxPendingBytes() );
+            }
         }
     }
 
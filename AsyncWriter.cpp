@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <utility>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+#ifdef __linux__
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+
+#include "AsyncWriter.hpp"
+#include "Debug.hpp"
+#include "System.hpp"
+
+AsyncWriter::AsyncWriter( int fd )
+    : m_fd( fd )
+    , m_exit( false )
+    , m_depth( 0 )
+    , m_bytes( 0 )
+    , m_maxDepth( 0 )
+    , m_maxBytes( 0 )
+    , m_ring( -1 )
+    , m_ringEntries( 0 )
+{
+    if( !SetupRing() )
+    {
+        DBGPRINT( "io_uring not available, falling back to pwrite" );
+    }
+
+    m_thread = std::thread( [this]{ Worker(); } );
+    System::SetThreadName( m_thread, "Writer" );
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    Sync();
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_exit = true;
+    }
+    m_cvWork.notify_one();
+    m_thread.join();
+    DestroyRing();
+}
+
+void AsyncWriter::Write( const uint8_t* data, size_t len, size_t offset )
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    m_queue.emplace_back( Request { data, len, offset } );
+    m_depth++;
+    m_bytes += len;
+    m_maxDepth = std::max( m_maxDepth, m_depth );
+    m_maxBytes = std::max( m_maxBytes, m_bytes );
+    lock.unlock();
+    m_cvWork.notify_one();
+}
+
+void AsyncWriter::Sync()
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    m_cvDone.wait( lock, [this]{ return m_depth == 0; } );
+}
+
+bool AsyncWriter::UsesIoUring() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_ring >= 0;
+}
+
+size_t AsyncWriter::MaxQueueDepth() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_maxDepth;
+}
+
+size_t AsyncWriter::MaxBytesInFlight() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_maxBytes;
+}
+
+void AsyncWriter::Worker()
+{
+    std::vector<Request> batch;
+    for(;;)
+    {
+        std::unique_lock<std::mutex> lock( m_lock );
+        m_cvWork.wait( lock, [this]{ return !m_queue.empty() || m_exit; } );
+        if( m_queue.empty() ) return;
+        std::swap( batch, m_queue );
+        lock.unlock();
+
+        if( m_ring >= 0 )
+        {
+            SubmitRing( batch );
+        }
+        else
+        {
+            for( auto& req : batch )
+            {
+                WriteSync( req );
+                Complete( req );
+            }
+        }
+        batch.clear();
+    }
+}
+
+void AsyncWriter::WriteSync( const Request& req )
+{
+#ifndef _WIN32
+    auto data = req.data;
+    auto len = req.len;
+    auto offset = req.offset;
+    while( len > 0 )
+    {
+        const auto ret = pwrite( m_fd, data, len, offset );
+        if( ret <= 0 )
+        {
+            assert( false );
+            return;
+        }
+        data += ret;
+        len -= ret;
+        offset += ret;
+    }
+#endif
+}
+
+void AsyncWriter::Complete( const Request& req )
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    m_depth--;
+    m_bytes -= req.len;
+    const bool notify = m_depth == 0;
+    lock.unlock();
+    if( notify ) m_cvDone.notify_all();
+}
+
+#ifdef __linux__
+
+bool AsyncWriter::SetupRing()
+{
+    enum { QueueDepth = 64 };
+
+    io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    const int fd = (int)syscall( __NR_io_uring_setup, QueueDepth, &p );
+    if( fd < 0 ) return false;
+
+    m_sqSize = p.sq_off.array + p.sq_entries * sizeof( unsigned int );
+    m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof( io_uring_cqe );
+    const bool single = ( p.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+    if( single ) m_sqSize = m_cqSize = std::max( m_sqSize, m_cqSize );
+
+    m_sqPtr = mmap( nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if( m_sqPtr == MAP_FAILED )
+    {
+        close( fd );
+        return false;
+    }
+    m_cqPtr = single ? m_sqPtr : mmap( nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    m_sqes = mmap( nullptr, p.sq_entries * sizeof( io_uring_sqe ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if( m_cqPtr == MAP_FAILED || m_sqes == MAP_FAILED )
+    {
+        if( m_sqes != MAP_FAILED ) munmap( m_sqes, p.sq_entries * sizeof( io_uring_sqe ) );
+        if( !single && m_cqPtr != MAP_FAILED ) munmap( m_cqPtr, m_cqSize );
+        munmap( m_sqPtr, m_sqSize );
+        close( fd );
+        return false;
+    }
+
+    auto sq = (uint8_t*)m_sqPtr;
+    auto cq = (uint8_t*)m_cqPtr;
+    m_sqHead = (unsigned int*)( sq + p.sq_off.head );
+    m_sqTail = (unsigned int*)( sq + p.sq_off.tail );
+    m_sqMask = (unsigned int*)( sq + p.sq_off.ring_mask );
+    m_sqArray = (unsigned int*)( sq + p.sq_off.array );
+    m_cqHead = (unsigned int*)( cq + p.cq_off.head );
+    m_cqTail = (unsigned int*)( cq + p.cq_off.tail );
+    m_cqMask = (unsigned int*)( cq + p.cq_off.ring_mask );
+    m_cqes = cq + p.cq_off.cqes;
+
+    m_ring = fd;
+    m_ringEntries = p.sq_entries;
+    return true;
+}
+
+void AsyncWriter::DestroyRing()
+{
+    if( m_ring < 0 ) return;
+    munmap( m_sqes, m_ringEntries * sizeof( io_uring_sqe ) );
+    if( m_cqPtr != m_sqPtr ) munmap( m_cqPtr, m_cqSize );
+    munmap( m_sqPtr, m_sqSize );
+    close( m_ring );
+    m_ring = -1;
+}
+
+// Completes the requests whose writes the kernel has finished, returns how many
+size_t AsyncWriter::ReapRing( const std::vector<Request>& batch )
+{
+    auto cqes = (io_uring_cqe*)m_cqes;
+    size_t count = 0;
+    unsigned int head = *m_cqHead;
+    const unsigned int cqTail = __atomic_load_n( m_cqTail, __ATOMIC_ACQUIRE );
+    while( head != cqTail )
+    {
+        const auto& cqe = cqes[head & *m_cqMask];
+        const auto& req = batch[cqe.user_data];
+        if( cqe.res != (int)req.len )
+        {
+            // Short or failed write (e.g. IORING_OP_WRITE not supported), redo it synchronously.
+            WriteSync( req );
+        }
+        Complete( req );
+        count++;
+        head++;
+    }
+    __atomic_store_n( m_cqHead, head, __ATOMIC_RELEASE );
+    return count;
+}
+
+void AsyncWriter::SubmitRing( const std::vector<Request>& batch )
+{
+    enum { MaxRetries = 1000 };
+
+    auto sqes = (io_uring_sqe*)m_sqes;
+
+    // The ring is empty between batches, so the sqe at ring position first + i
+    // carries batch[i]
+    const unsigned int first = *m_sqTail;
+    size_t next = 0;
+    size_t reaped = 0;
+    int retries = 0;
+    while( reaped < batch.size() )
+    {
+        unsigned int tail = *m_sqTail;
+        while( next < batch.size() && next - reaped < m_ringEntries )
+        {
+            const auto& req = batch[next];
+            const auto idx = tail & *m_sqMask;
+            auto sqe = sqes + idx;
+            memset( sqe, 0, sizeof( io_uring_sqe ) );
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = m_fd;
+            sqe->addr = (uint64_t)req.data;
+            sqe->len = (uint32_t)req.len;
+            sqe->off = req.offset;
+            sqe->user_data = next;
+            m_sqArray[idx] = idx;
+            tail++;
+            next++;
+        }
+        __atomic_store_n( m_sqTail, tail, __ATOMIC_RELEASE );
+
+        // Entries left over from a partial submission are submitted again
+        const unsigned int pending = tail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE );
+        const bool ok = syscall( __NR_io_uring_enter, m_ring, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0 ) >= 0;
+        const auto err = errno;
+        const auto done = ReapRing( batch );
+        reaped += done;
+        if( ok || done != 0 )
+        {
+            retries = 0;
+            continue;
+        }
+        // Interrupted, or out of resources until completions are reaped
+        if( ( err == EINTR || err == EAGAIN || err == EBUSY ) && ++retries < MaxRetries )
+        {
+            if( err != EINTR ) usleep( 1000 );
+            continue;
+        }
+
+        // The ring is unusable. Writes the kernel already took still use their
+        // buffers, so wait for them before finishing the rest with pwrite.
+        const size_t consumed = __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE ) - first;
+        while( reaped < consumed )
+        {
+            if( syscall( __NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0 ) < 0 ) usleep( 1000 );
+            reaped += ReapRing( batch );
+        }
+        for( size_t i=consumed; i<batch.size(); i++ )
+        {
+            WriteSync( batch[i] );
+            Complete( batch[i] );
+        }
+        DestroyRing();
+        return;
+    }
+}
+
+#else
+
+bool AsyncWriter::SetupRing()
+{
+    return false;
+}
+
+void AsyncWriter::DestroyRing()
+{
+}
+
+void AsyncWriter::SubmitRing( const std::vector<Request>& /*batch*/ )
+{
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef __ASYNCWRITER_HPP__
+#define __ASYNCWRITER_HPP__
+
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Writes finished ranges of an output buffer to a file descriptor on a
+// dedicated thread, using io_uring where the kernel allows it and pwrite()
+// otherwise. Write() only queues the range, so callers never wait on I/O.
+// The buffer must stay alive and unmodified until Sync() returns.
+class AsyncWriter
+{
+public:
+    AsyncWriter( int fd );
+    ~AsyncWriter();
+
+    void Write( const uint8_t* data, size_t len, size_t offset );
+    void Sync();
+
+    bool UsesIoUring() const;
+    size_t MaxQueueDepth() const;
+    size_t MaxBytesInFlight() const;
+
+private:
+    struct Request
+    {
+        const uint8_t* data;
+        size_t len;
+        size_t offset;
+    };
+
+    void Worker();
+    void WriteSync( const Request& req );
+    void Complete( const Request& req );
+
+    bool SetupRing();
+    void DestroyRing();
+    void SubmitRing( const std::vector<Request>& batch );
+    size_t ReapRing( const std::vector<Request>& batch );
+
+    int m_fd;
+
+    std::vector<Request> m_queue;
+    mutable std::mutex m_lock;
+    std::condition_variable m_cvWork, m_cvDone;
+    bool m_exit;
+
+    size_t m_depth;
+    size_t m_bytes;
+    size_t m_maxDepth;
+    size_t m_maxBytes;
+
+    int m_ring;
+    unsigned int m_ringEntries;
+    void* m_sqPtr;
+    void* m_cqPtr;
+    void* m_sqes;
+    void* m_cqes;
+    size_t m_sqSize;
+    size_t m_cqSize;
+    unsigned int* m_sqHead;
+    unsigned int* m_sqTail;
+    unsigned int* m_sqMask;
+    unsigned int* m_sqArray;
+    unsigned int* m_cqHead;
+    unsigned int* m_cqTail;
+    unsigned int* m_cqMask;
+
+    std::thread m_thread;
+};
+
+#endif
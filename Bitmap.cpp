@@ -1,50 +1,510 @@
+#include <algorithm>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "libpng/png.h"
 #include "lz4/lz4.h"
 
+#ifdef _WIN32
+#  include <fcntl.h>
+#  include <io.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#ifdef __ARM_NEON
+#  include <arm_neon.h>
+#endif
+
+#if defined __SSE4_1__ || defined __AVX2__
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
 #include "Bitmap.hpp"
 #include "Debug.hpp"
+#include "System.hpp"
+
+// Sequential reader over a file, stdin or a memory buffer. Nothing here
+// seeks, so pipes work.
+class BitmapSource
+{
+public:
+    BitmapSource( FILE* f ) : m_file( f ), m_data( nullptr ), m_size( 0 ), m_pos( 0 ), m_map( nullptr ), m_mapLen( 0 ) {}
+    BitmapSource( const uint8_t* data, size_t size ) : m_file( nullptr ), m_data( data ), m_size( size ), m_pos( 0 ), m_map( nullptr ), m_mapLen( 0 ) {}
+    ~BitmapSource()
+    {
+#ifndef _WIN32
+        if( m_map ) munmap( m_map, m_mapLen );
+#endif
+        if( m_file && m_file != stdin ) fclose( m_file );
+    }
+
+    size_t Read( void* dst, size_t len )
+    {
+        if( m_file )
+        {
+            const auto read = fread( dst, 1, len, m_file );
+            // Kept for Contents() on inputs that can't be mapped
+            if( m_pos < sizeof( m_head ) ) memcpy( m_head + m_pos, dst, std::min( read, sizeof( m_head ) - m_pos ) );
+            m_pos += read;
+            return read;
+        }
+        len = std::min( len, m_size - m_pos );
+        memcpy( dst, m_data + m_pos, len );
+        m_pos += len;
+        return len;
+    }
+
+    // The whole input from its first byte. Regular files are mapped privately
+    // (see TakeMapping()), pipes are read to the end.
+    const uint8_t* Contents( size_t& size )
+    {
+        if( !m_file )
+        {
+            size = m_size;
+            return m_data;
+        }
+#ifndef _WIN32
+        struct stat st;
+        if( fstat( fileno( m_file ), &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 )
+        {
+            auto ptr = mmap( nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno( m_file ), 0 );
+            if( ptr != MAP_FAILED )
+            {
+                m_map = ptr;
+                m_mapLen = st.st_size;
+                size = m_mapLen;
+                return (const uint8_t*)m_map;
+            }
+        }
+#endif
+        assert( m_pos <= sizeof( m_head ) );
+        m_buffer.assign( m_head, m_head + m_pos );
+        uint8_t chunk[64*1024];
+        size_t read;
+        while( ( read = fread( chunk, 1, sizeof( chunk ), m_file ) ) > 0 )
+        {
+            m_buffer.insert( m_buffer.end(), chunk, chunk + read );
+        }
+        size = m_buffer.size();
+        return m_buffer.data();
+    }
+
+    bool Mapped() const { return m_map != nullptr; }
+
+    // Hands the mapping made by Contents() over to the caller, who has to
+    // munmap() it. Pages are copy on write, the file is never modified.
+    void* TakeMapping( size_t& len )
+    {
+        auto ret = m_map;
+        len = m_mapLen;
+        m_map = nullptr;
+        return ret;
+    }
+
+private:
+    FILE* m_file;
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_pos;
+    uint8_t m_head[16];
+    std::vector<uint8_t> m_buffer;
+    void* m_map;
+    size_t m_mapLen;
+};
+
+enum UncompressedFormat
+{
+    Pnm,
+    Bmp,
+    Tga
+};
+
+// Location and layout of the pixels of an uncompressed image
+struct RawImage
+{
+    const uint8_t* data;    // top row
+    ptrdiff_t stride;       // from one row to the one below it, negative if stored bottom up
+    int width;
+    int height;
+    int bpp;                // 3 or 4 bytes per pixel
+    bool bgrOrder;          // B, G, R in memory order, R, G, B otherwise
+    bool alpha;             // the fourth byte is alpha, not padding
+    size_t end;             // offset of the end of the pixel data in the file
+};
+
+// The parsers only look at the header, so they also work on a file prefix.
+// Whether the pixels are all there is checked against RawImage::end.
+
+static uint16_t Le16( const uint8_t* ptr ) { return ptr[0] | ( ptr[1] << 8 ); }
+static uint32_t Le32( const uint8_t* ptr ) { return ptr[0] | ( ptr[1] << 8 ) | ( ptr[2] << 16 ) | ( uint32_t( ptr[3] ) << 24 ); }
+
+// Binary PPM (P6) and PAM (P7) with RGB or RGB_ALPHA tuples, 8 bits per channel
+static bool ParsePnm( const uint8_t* ptr, size_t size, RawImage& img )
+{
+    const auto end = ptr + size;
+    auto p = ptr + 2;
+    int maxval = 0;
+    img.width = img.height = 0;
+    img.bgrOrder = false;
+
+    if( ptr[1] == '6' )
+    {
+        int* fields[3] = { &img.width, &img.height, &maxval };
+        for( auto field : fields )
+        {
+            for(;;)
+            {
+                while( p < end && isspace( *p ) ) p++;
+                if( p == end || *p != '#' ) break;
+                while( p < end && *p != '\n' ) p++;
+            }
+            if( p == end || !isdigit( *p ) ) return false;
+            while( p < end && isdigit( *p ) )
+            {
+                if( *field > 99999999 ) return false;
+                *field = *field * 10 + ( *p++ - '0' );
+            }
+        }
+        // A single whitespace character separates the header from the pixels
+        if( p == end || !isspace( *p ) ) return false;
+        p++;
+        img.bpp = 3;
+        img.alpha = false;
+    }
+    else
+    {
+        int depth = 0;
+        for(;;)
+        {
+            while( p < end && isspace( *p ) ) p++;
+            const auto line = p;
+            while( p < end && *p != '\n' ) p++;
+            if( p == end ) return false;
+            const std::string str( (const char*)line, p - line );
+            p++;
+
+            char key[16];
+            int value;
+            if( str.compare( 0, 6, "ENDHDR" ) == 0 ) break;
+            if( sscanf( str.c_str(), "%15s %d", key, &value ) != 2 ) continue;
+            if( strcmp( key, "WIDTH" ) == 0 ) img.width = value;
+            else if( strcmp( key, "HEIGHT" ) == 0 ) img.height = value;
+            else if( strcmp( key, "DEPTH" ) == 0 ) depth = value;
+            else if( strcmp( key, "MAXVAL" ) == 0 ) maxval = value;
+        }
+        if( depth != 3 && depth != 4 ) return false;
+        img.bpp = depth;
+        img.alpha = depth == 4;
+    }
+
+    if( maxval != 255 || img.width <= 0 || img.height <= 0 ) return false;
+    img.data = p;
+    img.stride = ptrdiff_t( img.width ) * img.bpp;
+    img.end = ( p - ptr ) + size_t( img.stride ) * img.height;
+    return true;
+}
 
-Bitmap::Bitmap( const char* fn, unsigned int lines, bool bgr )
+// 24 and 32 bit uncompressed BMP, including BI_BITFIELDS with byte aligned masks
+static bool ParseBmp( const uint8_t* ptr, size_t size, RawImage& img )
+{
+    if( size < 54 ) return false;
+    const auto offset = Le32( ptr + 10 );
+    const auto header = Le32( ptr + 14 );
+    const auto w = int32_t( Le32( ptr + 18 ) );
+    const auto h = int32_t( Le32( ptr + 22 ) );
+    const auto bits = Le16( ptr + 28 );
+    const auto compression = Le32( ptr + 30 );
+    if( header < 40 || w <= 0 || h == 0 || h == INT32_MIN ) return false;
+
+    img.bgrOrder = true;
+    img.alpha = false;
+    if( bits == 24 && compression == 0 )
+    {
+        img.bpp = 3;
+    }
+    else if( bits == 32 && ( compression == 0 || compression == 3 ) )
+    {
+        img.bpp = 4;
+        if( compression == 3 )
+        {
+            // Masks directly follow the 40 byte part of any info header
+            if( size < 66 || Le32( ptr + 58 ) != 0x0000FF00 ) return false;
+            const auto r = Le32( ptr + 54 );
+            const auto b = Le32( ptr + 62 );
+            if( r == 0x000000FF && b == 0x00FF0000 ) img.bgrOrder = false;
+            else if( r != 0x00FF0000 || b != 0x000000FF ) return false;
+        }
+        // Only V3 and later headers say whether the fourth byte is alpha
+        img.alpha = header >= 56 && size >= 70 && Le32( ptr + 66 ) == 0xFF000000;
+    }
+    else
+    {
+        return false;
+    }
+
+    const size_t pitch = ( size_t( w ) * img.bpp + 3 ) & ~size_t( 3 );
+    const int rows = h < 0 ? -h : h;
+    img.end = offset + pitch * rows;
+    img.width = w;
+    img.height = rows;
+    // Bottom up unless the height is negative
+    img.data = ptr + offset + ( h < 0 ? 0 : pitch * ( rows - 1 ) );
+    img.stride = h < 0 ? ptrdiff_t( pitch ) : -ptrdiff_t( pitch );
+    return true;
+}
+
+// Uncompressed 24 and 32 bit true color TGA, stored left to right
+static bool ParseTga( const uint8_t* ptr, size_t size, RawImage& img )
+{
+    if( size < 18 ) return false;
+    const int idLen = ptr[0];
+    const int cmapType = ptr[1];
+    const int type = ptr[2];
+    const int w = Le16( ptr + 12 );
+    const int h = Le16( ptr + 14 );
+    const int bits = ptr[16];
+    const int desc = ptr[17];
+    if( type != 2 || cmapType > 1 || ( bits != 24 && bits != 32 ) || ( desc & 0x10 ) || w == 0 || h == 0 ) return false;
+
+    // A color map may be present even though true color images don't use it
+    const size_t offset = 18 + idLen + ( cmapType ? Le16( ptr + 5 ) * ( ( ptr[7] + 7 ) / 8 ) : 0 );
+    img.bpp = bits / 8;
+    img.bgrOrder = true;
+    img.alpha = bits == 32 && ( desc & 0xF ) != 0;
+
+    const size_t pitch = size_t( w ) * img.bpp;
+    img.end = offset + pitch * h;
+    img.width = w;
+    img.height = h;
+    // Bottom up unless the top left origin bit is set
+    const bool topDown = ( desc & 0x20 ) != 0;
+    img.data = ptr + offset + ( topDown ? 0 : pitch * ( h - 1 ) );
+    img.stride = topDown ? ptrdiff_t( pitch ) : -ptrdiff_t( pitch );
+    return true;
+}
+
+// Expands a row of 3 or 4 byte pixels to 32 bit ones, swapping the red and
+// blue bytes if requested and filling in opaque alpha where there is none.
+static void ConvertRow( const uint8_t* src, uint32_t* dst, int width, int bpp, bool swap, bool alpha )
+{
+    int x = 0;
+    if( bpp == 4 )
+    {
+        if( !swap && alpha )
+        {
+            memcpy( dst, src, width * sizeof( uint32_t ) );
+            return;
+        }
+#ifdef __AVX2__
+        const __m256i shuf256 = swap ? _mm256_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 ) :
+                                       _mm256_setr_epi8( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 );
+        const __m256i fill256 = _mm256_set1_epi32( alpha ? 0 : 0xFF000000 );
+        for( ; x+8 <= width; x+=8 )
+        {
+            __m256i px = _mm256_loadu_si256( (const __m256i*)( src + x*4 ) );
+            _mm256_storeu_si256( (__m256i*)( dst + x ), _mm256_or_si256( _mm256_shuffle_epi8( px, shuf256 ), fill256 ) );
+        }
+#endif
+#ifdef __SSE4_1__
+        const __m128i shuf = swap ? _mm_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 ) :
+                                    _mm_setr_epi8( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 );
+        const __m128i fill = _mm_set1_epi32( alpha ? 0 : 0xFF000000 );
+        for( ; x+4 <= width; x+=4 )
+        {
+            __m128i px = _mm_loadu_si128( (const __m128i*)( src + x*4 ) );
+            _mm_storeu_si128( (__m128i*)( dst + x ), _mm_or_si128( _mm_shuffle_epi8( px, shuf ), fill ) );
+        }
+#elif defined __ARM_NEON
+        for( ; x+16 <= width; x+=16 )
+        {
+            uint8x16x4_t px = vld4q_u8( src + x*4 );
+            if( swap ) std::swap( px.val[0], px.val[2] );
+            if( !alpha ) px.val[3] = vdupq_n_u8( 0xFF );
+            vst4q_u8( (uint8_t*)( dst + x ), px );
+        }
+#endif
+    }
+    else
+    {
+#ifdef __AVX2__
+        // Two 12 byte groups per lane load; reads stay 4 bytes short of the row end
+        const __m256i shuf256 = swap ? _mm256_setr_epi8( 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1 ) :
+                                       _mm256_setr_epi8( 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1 );
+        const __m256i fill256 = _mm256_set1_epi32( 0xFF000000 );
+        for( ; x+10 <= width; x+=8 )
+        {
+            const __m128i lo = _mm_loadu_si128( (const __m128i*)( src + x*3 ) );
+            const __m128i hi = _mm_loadu_si128( (const __m128i*)( src + x*3 + 12 ) );
+            const __m256i px = _mm256_inserti128_si256( _mm256_castsi128_si256( lo ), hi, 1 );
+            _mm256_storeu_si256( (__m256i*)( dst + x ), _mm256_or_si256( _mm256_shuffle_epi8( px, shuf256 ), fill256 ) );
+        }
+#endif
+#ifdef __SSE4_1__
+        const __m128i shuf = swap ? _mm_setr_epi8( 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1 ) :
+                                    _mm_setr_epi8( 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1 );
+        const __m128i fill = _mm_set1_epi32( 0xFF000000 );
+        for( ; x+6 <= width; x+=4 )
+        {
+            __m128i px = _mm_loadu_si128( (const __m128i*)( src + x*3 ) );
+            _mm_storeu_si128( (__m128i*)( dst + x ), _mm_or_si128( _mm_shuffle_epi8( px, shuf ), fill ) );
+        }
+#elif defined __ARM_NEON
+        for( ; x+16 <= width; x+=16 )
+        {
+            const uint8x16x3_t px = vld3q_u8( src + x*3 );
+            uint8x16x4_t out;
+            out.val[0] = swap ? px.val[2] : px.val[0];
+            out.val[1] = px.val[1];
+            out.val[2] = swap ? px.val[0] : px.val[2];
+            out.val[3] = vdupq_n_u8( 0xFF );
+            vst4q_u8( (uint8_t*)( dst + x ), out );
+        }
+#endif
+    }
+
+    const int c0 = swap ? 2 : 0;
+    const int c2 = swap ? 0 : 2;
+    for( ; x<width; x++ )
+    {
+        const auto px = src + x*bpp;
+        const uint32_t a = alpha ? px[3] : 0xFF;
+        dst[x] = px[c0] | ( px[1] << 8 ) | ( px[c2] << 16 ) | ( a << 24 );
+    }
+}
+
+static bool IsTga( const char* name )
+{
+    const auto len = strlen( name );
+    if( len < 4 ) return false;
+    const auto ext = name + len - 4;
+    return ext[0] == '.' && tolower( ext[1] ) == 't' && tolower( ext[2] ) == 'g' && tolower( ext[3] ) == 'a';
+}
+
+// Format of an uncompressed image from its first four bytes and name, -1 if it isn't one
+static int DetectUncompressed( const uint8_t* buf, const char* name )
+{
+    if( buf[0] == 'P' && ( buf[1] == '6' || buf[1] == '7' ) && isspace( buf[2] ) ) return Pnm;
+    if( buf[0] == 'B' && buf[1] == 'M' ) return Bmp;
+    if( IsTga( name ) ) return Tga;
+    return -1;
+}
+
+static bool ParseUncompressed( const uint8_t* ptr, size_t size, int format, RawImage& img )
+{
+    switch( format )
+    {
+    case Pnm:
+        return ParsePnm( ptr, size, img );
+    case Bmp:
+        return ParseBmp( ptr, size, img );
+    default:
+        return ParseTga( ptr, size, img );
+    }
+}
+
+std::atomic<size_t> Bitmap::s_heapBytes( 0 );
+std::atomic<size_t> Bitmap::s_peakHeapBytes( 0 );
+
+static void PngRead( png_structp png_ptr, png_bytep data, png_size_t len )
+{
+    auto src = (BitmapSource*)png_get_io_ptr( png_ptr );
+    const auto read = src->Read( data, len );
+    // Truncated input decodes as black rather than erroring out of the loader thread
+    if( read < len ) memset( data + read, 0, len - read );
+}
+
+Bitmap::Bitmap( const char* fn, unsigned int lines, bool bgr, Storage storage )
     : m_block( nullptr )
     , m_lines( lines )
     , m_alpha( true )
+    , m_storage( storage )
+    , m_map( nullptr )
+    , m_mapped( 0 )
+    , m_heap( 0 )
     , m_sema( 0 )
 {
-    FILE* f = fopen( fn, "rb" );
+    FILE* f;
+    if( strcmp( fn, "-" ) == 0 )
+    {
+#ifdef _WIN32
+        _setmode( _fileno( stdin ), _O_BINARY );
+#endif
+        f = stdin;
+    }
+    else
+    {
+        f = fopen( fn, "rb" );
+    }
     assert( f );
 
+    Load( new BitmapSource( f ), fn, bgr );
+}
+
+Bitmap::Bitmap( const uint8_t* data, size_t size, unsigned int lines, bool bgr, Storage storage )
+    : m_block( nullptr )
+    , m_lines( lines )
+    , m_alpha( true )
+    , m_storage( storage )
+    , m_map( nullptr )
+    , m_mapped( 0 )
+    , m_heap( 0 )
+    , m_sema( 0 )
+{
+    Load( new BitmapSource( data, size ), "<memory>", bgr );
+}
+
+void Bitmap::Load( BitmapSource* src, const char* name, bool bgr )
+{
     char buf[4];
-    fread( buf, 1, 4, f );
+    src->Read( buf, 4 );
     if( memcmp( buf, "raw4", 4 ) == 0 )
     {
         uint8_t a;
-        fread( &a, 1, 1, f );
+        src->Read( &a, 1 );
         m_alpha = a == 1;
         uint32_t d;
-        fread( &d, 1, 4, f );
+        src->Read( &d, 4 );
         m_size.x = d;
-        fread( &d, 1, 4, f );
+        src->Read( &d, 4 );
         m_size.y = d;
-        DBGPRINT( "Raw bitmap " << fn << "  " << m_size.x << "x" << m_size.y );
-
-        assert( m_size.x % 4 == 0 );
-        assert( m_size.y % 4 == 0 );
-
-        int32_t csize;
-        fread( &csize, 1, 4, f );
+        DBGPRINT( "Raw bitmap " << name << "  " << m_size.x << "x" << m_size.y );
+
+        // The LZ4 block API takes int sizes, which limits raw4 images to 2 GB
+        int32_t csize = 0;
+        src->Read( &csize, 4 );
+        const size_t bytes = size_t( m_size.x ) * m_size.y * 4;
+        if( m_size.x <= 0 || m_size.y <= 0 || m_size.x % 4 != 0 || m_size.y % 4 != 0 || bytes > size_t( LZ4_MAX_INPUT_SIZE ) ||
+            csize <= 0 || csize > LZ4_compressBound( int( bytes ) ) )
+        {
+            LoadFailed( src );
+            return;
+        }
         char* cbuf = new char[csize];
-        fread( cbuf, 1, csize, f );
-        fclose( f );
+        const bool complete = src->Read( cbuf, csize ) == size_t( csize );
+        delete src;
 
-        m_block = m_data = new uint32_t[m_size.x*m_size.y];
+        Allocate( size_t( m_size.x ) * m_size.y );
+        m_block = m_data;
         m_linesLeft = m_size.y / 4;
 
-        LZ4_decompress_fast( cbuf, (char*)m_data, m_size.x*m_size.y*4 );
+        // Truncated or corrupt data decodes as black, like a truncated png
+        if( !complete || LZ4_decompress_safe( cbuf, (char*)m_data, csize, int( bytes ) ) != int( bytes ) )
+        {
+            memset( m_data, 0, bytes );
+        }
         delete[] cbuf;
 
         for( int i=0; i<m_size.y/4; i++ )
@@ -52,18 +512,21 @@ Bitmap::Bitmap( const char* fn, unsigned int lines, bool bgr )
             m_sema.unlock();
         }
     }
+    else if( DetectUncompressed( (const uint8_t*)buf, name ) >= 0 )
+    {
+        LoadUncompressed( src, bgr, DetectUncompressed( (const uint8_t*)buf, name ) );
+    }
     else
     {
-        fseek( f, 0, SEEK_SET );
-
-        unsigned int sig_read = 0;
+        // The first four signature bytes were consumed by the raw4 check
+        unsigned int sig_read = 4;
         int bit_depth, color_type, interlace_type;
 
         png_structp png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
         png_infop info_ptr = png_create_info_struct( png_ptr );
         setjmp( png_jmpbuf( png_ptr ) );
 
-        png_init_io( png_ptr, f );
+        png_set_read_fn( png_ptr, src, PngRead );
         png_set_sig_bytes( png_ptr, sig_read );
 
         png_uint_32 w, h;
@@ -115,15 +578,16 @@ Bitmap::Bitmap( const char* fn, unsigned int lines, bool bgr )
             break;
         }
 
-        DBGPRINT( "Bitmap " << fn << "  " << w << "x" << h );
+        DBGPRINT( "Bitmap " << name << "  " << w << "x" << h );
 
         assert( w % 4 == 0 );
         assert( h % 4 == 0 );
 
-        m_block = m_data = new uint32_t[w*h];
+        Allocate( size_t( w ) * h );
+        m_block = m_data;
         m_linesLeft = h / 4;
 
-        m_load = std::async( std::launch::async, [this, f, png_ptr, info_ptr]() mutable
+        StartLoad( [this, src, png_ptr, info_ptr]() mutable
         {
             auto ptr = m_data;
             unsigned int lines = 0;
@@ -149,31 +613,234 @@ Bitmap::Bitmap( const char* fn, unsigned int lines, bool bgr )
 
             png_read_end( png_ptr, info_ptr );
             png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
-            fclose( f );
+            delete src;
         } );
     }
 }
 
+void Bitmap::LoadFailed( BitmapSource* src )
+{
+    delete src;
+    m_size = v2i( 0, 0 );
+    m_data = m_block = nullptr;
+    m_linesLeft = 0;
+    // NextBlock() returns no lines instead of waiting
+    m_sema.unlock();
+}
+
+bool Bitmap::ReadSize( const char* fn, v2i& size )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return false;
+    uint8_t buf[4096];
+    const auto len = fread( buf, 1, sizeof( buf ), f );
+    fclose( f );
+    if( len < 24 ) return false;
+
+    if( memcmp( buf, "raw4", 4 ) == 0 )
+    {
+        uint32_t d[2];
+        memcpy( d, buf + 5, 8 );
+        size = v2i( d[0], d[1] );
+        return size.x > 0 && size.y > 0 && uint64_t( size.x ) * size.y * 4 <= LZ4_MAX_INPUT_SIZE;
+    }
+    const int format = DetectUncompressed( buf, fn );
+    if( format >= 0 )
+    {
+        RawImage img;
+        if( !ParseUncompressed( buf, len, format, img ) ) return false;
+        size = v2i( img.width, img.height );
+        return true;
+    }
+    if( png_sig_cmp( buf, 0, 8 ) != 0 || memcmp( buf + 12, "IHDR", 4 ) != 0 ) return false;
+    const auto be32 = []( const uint8_t* p ) { return int( ( p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3] ); };
+    size = v2i( be32( buf + 16 ), be32( buf + 20 ) );
+    return true;
+}
+
+void Bitmap::LoadUncompressed( BitmapSource* src, bool bgr, int format )
+{
+    size_t size;
+    const auto ptr = src->Contents( size );
+    RawImage img;
+    if( !ptr || !ParseUncompressed( ptr, size, format, img ) || img.end > size || img.width % 4 != 0 || img.height % 4 != 0 )
+    {
+        LoadFailed( src );
+        return;
+    }
+
+    m_size = v2i( img.width, img.height );
+    m_alpha = img.alpha;
+    DBGPRINT( "Uncompressed bitmap " << m_size.x << "x" << m_size.y );
+
+    m_linesLeft = m_size.y / 4;
+    const bool swap = img.bgrOrder != bgr;
+    const bool mapped = src->Mapped();
+
+    if( mapped && img.bpp == 4 && img.alpha && !swap && img.stride == ptrdiff_t( m_size.x ) * 4 && ( uintptr_t( img.data ) & 3 ) == 0 )
+    {
+        // Pixels are already in the loaded layout
+        m_map = src->TakeMapping( m_mapped );
+        m_block = m_data = (uint32_t*)img.data;
+        delete src;
+        for( int i=0; i<m_size.y/4; i++ )
+        {
+            m_sema.unlock();
+        }
+        return;
+    }
+
+#ifndef _WIN32
+    if( mapped ) madvise( (void*)ptr, size, MADV_SEQUENTIAL );
+#endif
+    Allocate( size_t( m_size.x ) * m_size.y );
+    m_block = m_data;
+
+    StartLoad( [this, src, img, swap, mapped]
+    {
+        // Bands of m_lines block rows are converted in parallel and handed
+        // out in order as soon as all bands above them are done
+        const int bandRows = int( std::min<size_t>( size_t( m_lines ) * 4, m_size.y ) );
+        const int bands = ( m_size.y + bandRows - 1 ) / bandRows;
+        std::vector<char> ready( bands, 0 );
+        int published = 0;
+        std::atomic<int> next( 0 );
+        std::mutex lock;
+
+        auto convert = [&]
+        {
+            for(;;)
+            {
+                const int band = next++;
+                if( band >= bands ) return;
+                const int end = std::min( m_size.y, ( band + 1 ) * bandRows );
+                for( int y=band*bandRows; y<end; y++ )
+                {
+                    ConvertRow( img.data + y * img.stride, m_data + size_t( y ) * m_size.x, m_size.x, img.bpp, swap, img.alpha );
+                }
+#ifndef _WIN32
+                if( mapped )
+                {
+                    // Converted input rows are not read again; the pages are clean, so drop them
+                    const auto first = img.data + band * bandRows * img.stride;
+                    const auto last = img.data + ( end - 1 ) * img.stride;
+                    static const uintptr_t page = sysconf( _SC_PAGESIZE );
+                    const auto lo = ( uintptr_t( std::min( first, last ) ) + page - 1 ) & ~( page - 1 );
+                    const auto hi = ( uintptr_t( std::max( first, last ) ) + m_size.x * img.bpp ) & ~( page - 1 );
+                    if( hi > lo ) madvise( (void*)lo, hi - lo, MADV_DONTNEED );
+                }
+#endif
+                std::lock_guard<std::mutex> guard( lock );
+                ready[band] = 1;
+                while( published < bands && ready[published] )
+                {
+                    m_sema.unlock();
+                    published++;
+                }
+            }
+        };
+
+        std::vector<std::thread> helpers;
+        const int threads = size_t( m_size.x ) * m_size.y <= SyncLoadPixels ? 1 : std::min<int>( System::CPUCores(), bands );
+        for( int i=1; i<threads; i++ ) helpers.emplace_back( convert );
+        convert();
+        for( auto& thread : helpers ) thread.join();
+        delete src;
+    } );
+}
+
 Bitmap::Bitmap( const v2i& size )
-    : m_data( new uint32_t[size.x*size.y] )
+    : m_data( new uint32_t[size_t( size.x ) * size.y] )
     , m_block( nullptr )
     , m_lines( 1 )
     , m_linesLeft( size.y / 4 )
     , m_size( size )
+    , m_storage( Heap )
+    , m_map( nullptr )
+    , m_mapped( 0 )
+    , m_heap( 0 )
     , m_sema( 0 )
 {
+    CountHeap( size_t( size.x ) * size.y * sizeof( uint32_t ) );
 }
 
 Bitmap::Bitmap( const Bitmap& src, unsigned int lines )
     : m_lines( lines )
     , m_alpha( src.Alpha() )
+    , m_storage( src.m_storage )
+    , m_map( nullptr )
+    , m_mapped( 0 )
+    , m_heap( 0 )
     , m_sema( 0 )
 {
 }
 
 Bitmap::~Bitmap()
 {
+    // A caller bailing out early may not have waited for the load
+    if( m_load.valid() ) m_load.wait();
+
+#ifndef _WIN32
+    if( m_map )
+    {
+        munmap( m_map, m_mapped );
+        return;
+    }
+#endif
     delete[] m_data;
+    s_heapBytes -= m_heap;
+}
+
+void Bitmap::Allocate( size_t pixels )
+{
+    if( m_storage == Auto )
+    {
+        // Same budget as bounded memory mode: the image plus a third for its
+        // mip chain has to fit in three quarters of the limit
+        const auto limit = System::MemoryLimit();
+        m_storage = limit != 0 && uint64_t( pixels ) * 4 * 4 / 3 > limit / 4 * 3 ? TempFile : Heap;
+    }
+
+#ifndef _WIN32
+    if( m_storage == TempFile )
+    {
+        const auto len = pixels * sizeof( uint32_t );
+        const char* dir = getenv( "TMPDIR" );
+        std::string path = std::string( dir && *dir ? dir : "/var/tmp" ) + "/etcpak-XXXXXX";
+        const int fd = mkstemp( &path[0] );
+        if( fd >= 0 )
+        {
+            // The mapping keeps the file alive, nothing is left behind on exit
+            unlink( path.c_str() );
+            void* ptr = MAP_FAILED;
+            if( ftruncate( fd, len ) == 0 )
+            {
+                ptr = mmap( nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            }
+            close( fd );
+            if( ptr != MAP_FAILED )
+            {
+                madvise( ptr, len, MADV_SEQUENTIAL );
+                m_map = ptr;
+                m_data = (uint32_t*)ptr;
+                m_mapped = len;
+                return;
+            }
+        }
+        DBGPRINT( "Unable to create temporary file in " << ( dir && *dir ? dir : "/var/tmp" ) << ", keeping bitmap in memory" );
+    }
+#endif
+
+    m_data = new uint32_t[pixels];
+    CountHeap( pixels * sizeof( uint32_t ) );
+}
+
+void Bitmap::CountHeap( size_t bytes )
+{
+    m_heap = bytes;
+    const auto total = s_heapBytes += bytes;
+    auto peak = s_peakHeapBytes.load();
+    while( total > peak && !s_peakHeapBytes.compare_exchange_weak( peak, total ) ) {}
 }
 
 void Bitmap::Write( const char* fn )
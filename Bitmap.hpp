@@ -1,10 +1,13 @@
 #ifndef __DARKRL__BITMAP_HPP__
 #define __DARKRL__BITMAP_HPP__
 
+#include <atomic>
+#include <chrono>
 #include <future>
 #include <memory>
 #include <mutex>
 #include <stdint.h>
+#include <utility>
 
 #include "Semaphore.hpp"
 #include "Vector.hpp"
@@ -15,10 +18,33 @@ enum class Channels
     Alpha
 };
 
+class BitmapSource;
+
 class Bitmap
 {
 public:
-    Bitmap( const char* fn, unsigned int lines, bool bgr );
+    // Where pixel data lives. TempFile backs it with an unlinked temporary
+    // file (in $TMPDIR, or /var/tmp) so the kernel can page it out, which lets
+    // images larger than RAM go through. Auto picks TempFile once the image
+    // and its mip chain would not fit in three quarters of the memory limit.
+    // Downsampled levels inherit the storage of their source.
+    enum Storage
+    {
+        Heap,
+        TempFile,
+        Auto
+    };
+
+    // Reads PNG, raw4, binary PPM/PAM, BMP and (by extension) TGA. File name
+    // "-" reads from stdin. The memory buffer variant isn't copied as a whole:
+    // the decoder reads it piece by piece like a file, and uncompressed pixels
+    // are converted straight from it, so the buffer must outlive loading (see
+    // Data()). The pixels are always stored separately. Uncompressed files whose
+    // pixels are already in the loaded layout are mapped and used directly.
+    // Raw4, PPM/PAM, BMP and TGA input with a malformed header or dimensions
+    // not divisible by 4 loads as an empty (0x0) bitmap.
+    Bitmap( const char* fn, unsigned int lines, bool bgr, Storage storage = Heap );
+    Bitmap( const uint8_t* data, size_t size, unsigned int lines, bool bgr, Storage storage = Heap );
     Bitmap( const v2i& size );
     virtual ~Bitmap();
 
@@ -28,21 +54,65 @@ public:
     const uint32_t* Data() const { if( m_load.valid() ) m_load.wait(); return m_data; }
     const v2i& Size() const { return m_size; }
     bool Alpha() const { return m_alpha; }
+    // Pixels live in a file mapping, either a temporary file or the input itself
+    bool OutOfCore() const { return m_mapped != 0; }
+    bool Loaded() const { return !m_load.valid() || m_load.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready; }
+
+    // Heap memory held by all bitmaps (file backed storage excluded)
+    static size_t HeapBytes() { return s_heapBytes.load(); }
+    static size_t PeakHeapBytes() { return s_peakHeapBytes.load(); }
 
     const uint32_t* NextBlock( unsigned int& lines, bool& done );
 
+    // Reads just enough of a file to tell its dimensions. False if the file
+    // can't be read or isn't an image this class loads. Loading the file can
+    // still fail (truncated pixel data), so callers check Size() after it.
+    static bool ReadSize( const char* fn, v2i& size );
+
 protected:
     Bitmap( const Bitmap& src, unsigned int lines );
 
+    void Load( BitmapSource* src, const char* name, bool bgr );
+    void LoadUncompressed( BitmapSource* src, bool bgr, int format );
+    // Leaves an empty bitmap, for input that can't be loaded
+    void LoadFailed( BitmapSource* src );
+    void Allocate( size_t pixels );
+    void CountHeap( size_t bytes );
+
+    // Small images are loaded right away on the calling thread, where a
+    // loader thread would cost more than the overlap with compression gains
+    template<class F>
+    void StartLoad( F&& load )
+    {
+        if( size_t( m_size.x ) * m_size.y <= SyncLoadPixels )
+        {
+            m_load = std::async( std::launch::deferred, std::forward<F>( load ) );
+            m_load.wait();
+        }
+        else
+        {
+            m_load = std::async( std::launch::async, std::forward<F>( load ) );
+        }
+    }
+
+    enum { SyncLoadPixels = 256 * 256 };
+
     uint32_t* m_data;
     uint32_t* m_block;
     unsigned int m_lines;
     unsigned int m_linesLeft;
     v2i m_size;
     bool m_alpha;
+    Storage m_storage;
+    void* m_map;
+    size_t m_mapped;
+    size_t m_heap;
     Semaphore m_sema;
     std::mutex m_lock;
     std::future<void> m_load;
+
+    static std::atomic<size_t> s_heapBytes;
+    static std::atomic<size_t> s_peakHeapBytes;
 };
 
 typedef std::shared_ptr<Bitmap> BitmapPtr;
@@ -59,11 +59,12 @@ BitmapDownsampled::BitmapDownsampled( const Bitmap& bmp, unsigned int lines, boo
 
     DBGPRINT( "Subbitmap " << m_size.x << "x" << m_size.y );
 
-    m_block = m_data = new uint32_t[w*h];
+    Allocate( size_t( w ) * h );
+    m_block = m_data;
 
     if( m_size.x < w || m_size.y < h )
     {
-        memset( m_data, 0, w*h*sizeof( uint32_t ) );
+        memset( m_data, 0, size_t( w ) * h * sizeof( uint32_t ) );
         m_linesLeft = h / 4;
         unsigned int lines = 0;
         for( int i=0; i<h/4; i++ )
@@ -88,7 +89,7 @@ BitmapDownsampled::BitmapDownsampled( const Bitmap& bmp, unsigned int lines, boo
         m_linesLeft = h / 4;
         if( linearize )
         {
-            m_load = std::async( std::launch::async, [this, &bmp, w, h]() mutable
+            StartLoad( [this, &bmp, w, h]() mutable
             {
                 auto ptr = m_data;
                 auto src1 = bmp.Data();
@@ -274,7 +275,7 @@ BitmapDownsampled::BitmapDownsampled( const Bitmap& bmp, unsigned int lines, boo
         }
         else
         {
-            m_load = std::async( std::launch::async, [this, &bmp, w, h]() mutable
+            StartLoad( [this, &bmp, w, h]() mutable
             {
                 auto ptr = m_data;
                 auto src1 = bmp.Data();
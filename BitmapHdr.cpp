@@ -0,0 +1,273 @@
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "BitmapHdr.hpp"
+#include "Half.hpp"
+
+// Values beyond the half range are clamped to the largest finite half, NaN
+// becomes zero
+static etcpak_force_inline uint16_t ToHalf( float v )
+{
+    return FloatToHalf( v == v ? std::max( -65504.f, std::min( 65504.f, v ) ) : 0.f );
+}
+
+static etcpak_force_inline uint64_t PackHalf( float r, float g, float b )
+{
+    return uint64_t( ToHalf( r ) ) | ( uint64_t( ToHalf( g ) ) << 16 ) | ( uint64_t( ToHalf( b ) ) << 32 ) | ( uint64_t( 0x3C00 ) << 48 );
+}
+
+static bool HasExtension( const char* fn, const char* ext )
+{
+    auto dot = strrchr( fn, '.' );
+    if( !dot ) return false;
+    while( *++dot && *ext )
+    {
+        if( tolower( *dot ) != *ext++ ) return false;
+    }
+    return *dot == '\0' && *ext == '\0';
+}
+
+bool BitmapHdr::IsHdrFile( const char* fn )
+{
+    return HasExtension( fn, "hdr" ) || HasExtension( fn, "pfm" );
+}
+
+BitmapHdr::BitmapHdr( const char* fn )
+    : m_size( 0, 0 )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return;
+    std::vector<uint8_t> buf;
+    uint8_t tmp[64*1024];
+    size_t len;
+    while( ( len = fread( tmp, 1, sizeof( tmp ), f ) ) != 0 ) buf.insert( buf.end(), tmp, tmp + len );
+    fclose( f );
+
+    const bool ok = HasExtension( fn, "pfm" ) ? LoadPfm( buf ) : LoadRadiance( buf );
+    if( !ok )
+    {
+        m_size = v2i( 0, 0 );
+        m_data.clear();
+        return;
+    }
+    PadEdges();
+}
+
+BitmapHdr::BitmapHdr( const v2i& size )
+    : m_size( size )
+{
+    Allocate();
+}
+
+void BitmapHdr::Allocate()
+{
+    m_data.assign( Stride() * std::max( 4, m_size.y ), 0 );
+}
+
+void BitmapHdr::PadEdges()
+{
+    const auto stride = Stride();
+    for( int y=0; y<m_size.y; y++ )
+    {
+        auto row = m_data.data() + y * stride;
+        for( size_t x=m_size.x; x<stride; x++ ) row[x] = row[m_size.x-1];
+    }
+    for( int y=m_size.y; y<4; y++ )
+    {
+        memcpy( m_data.data() + y * stride, m_data.data() + ( m_size.y - 1 ) * stride, stride * sizeof( uint64_t ) );
+    }
+}
+
+// Header lines up to an empty one, then the resolution line. Only the
+// standard orientation (-Y h +X w) and bottom up rows (+Y h +X w) are read,
+// and scanlines must be flat or new style run length encoded.
+bool BitmapHdr::LoadRadiance( const std::vector<uint8_t>& buf )
+{
+    size_t pos = 0;
+    auto line = [&buf, &pos]( char* dst, size_t max ) -> bool
+    {
+        size_t n = 0;
+        while( pos < buf.size() && buf[pos] != '\n' )
+        {
+            if( n + 1 < max ) dst[n++] = char( buf[pos] );
+            pos++;
+        }
+        if( pos == buf.size() ) return false;
+        pos++;
+        dst[n] = '\0';
+        return true;
+    };
+
+    char str[256];
+    if( !line( str, sizeof( str ) ) || strncmp( str, "#?", 2 ) != 0 ) return false;
+    for(;;)
+    {
+        if( !line( str, sizeof( str ) ) ) return false;
+        if( str[0] == '\0' ) break;
+        if( strncmp( str, "FORMAT=", 7 ) == 0 && strcmp( str + 7, "32-bit_rle_rgbe" ) != 0 ) return false;
+    }
+
+    char ysign;
+    int w, h;
+    if( !line( str, sizeof( str ) ) || sscanf( str, "%cY %d +X %d", &ysign, &h, &w ) != 3 || ( ysign != '-' && ysign != '+' ) ) return false;
+    if( w <= 0 || h <= 0 ) return false;
+    m_size = v2i( w, h );
+    Allocate();
+
+    std::vector<uint8_t> scan( size_t( w ) * 4 );
+    for( int y=0; y<h; y++ )
+    {
+        if( pos + 4 > buf.size() ) return false;
+        const uint8_t* src = buf.data() + pos;
+        if( w >= 8 && w < 0x8000 && src[0] == 2 && src[1] == 2 && ( ( src[2] << 8 ) | src[3] ) == w )
+        {
+            // Each channel run length encoded separately
+            pos += 4;
+            for( int c=0; c<4; c++ )
+            {
+                int x = 0;
+                while( x < w )
+                {
+                    if( pos >= buf.size() ) return false;
+                    int n = buf[pos++];
+                    if( n > 128 )
+                    {
+                        n -= 128;
+                        if( x + n > w || pos >= buf.size() ) return false;
+                        const auto v = buf[pos++];
+                        for( int i=0; i<n; i++ ) scan[( x++ ) * 4 + c] = v;
+                    }
+                    else
+                    {
+                        if( n == 0 || x + n > w || pos + n > buf.size() ) return false;
+                        for( int i=0; i<n; i++ ) scan[( x++ ) * 4 + c] = buf[pos++];
+                    }
+                }
+            }
+        }
+        else
+        {
+            if( pos + scan.size() > buf.size() ) return false;
+            memcpy( scan.data(), src, scan.size() );
+            pos += scan.size();
+        }
+
+        auto dst = m_data.data() + size_t( ysign == '-' ? y : h - 1 - y ) * Stride();
+        for( int x=0; x<w; x++ )
+        {
+            const auto p = scan.data() + x * 4;
+            if( p[3] == 0 )
+            {
+                *dst++ = PackHalf( 0, 0, 0 );
+            }
+            else
+            {
+                const float f = ldexpf( 1.f, p[3] - ( 128 + 8 ) );
+                *dst++ = PackHalf( ( p[0] + 0.5f ) * f, ( p[1] + 0.5f ) * f, ( p[2] + 0.5f ) * f );
+            }
+        }
+    }
+    return true;
+}
+
+// "PF" (RGB) or "Pf" (grey), width, height, scale (negative for little
+// endian), a single whitespace, then float rows bottom up
+bool BitmapHdr::LoadPfm( const std::vector<uint8_t>& buf )
+{
+    if( buf.size() < 2 || buf[0] != 'P' || ( buf[1] != 'F' && buf[1] != 'f' ) ) return false;
+    const int channels = buf[1] == 'F' ? 3 : 1;
+
+    size_t pos = 2;
+    char tok[3][32];
+    for( int i=0; i<3; i++ )
+    {
+        while( pos < buf.size() && isspace( buf[pos] ) ) pos++;
+        size_t n = 0;
+        while( pos < buf.size() && !isspace( buf[pos] ) && n + 1 < sizeof( tok[i] ) ) tok[i][n++] = char( buf[pos++] );
+        tok[i][n] = '\0';
+    }
+    pos++;
+
+    const int w = atoi( tok[0] );
+    const int h = atoi( tok[1] );
+    const float scale = float( atof( tok[2] ) );
+    if( w <= 0 || h <= 0 || scale == 0 ) return false;
+    const size_t count = size_t( w ) * h * channels;
+    if( pos + count * sizeof( float ) > buf.size() ) return false;
+
+    m_size = v2i( w, h );
+    Allocate();
+
+    const bool swap = scale > 0;
+    auto src = buf.data() + pos;
+    for( int y=h-1; y>=0; y-- )
+    {
+        auto dst = m_data.data() + size_t( y ) * Stride();
+        for( int x=0; x<w; x++ )
+        {
+            float v[3];
+            for( int c=0; c<channels; c++ )
+            {
+                uint32_t u;
+                memcpy( &u, src, sizeof( u ) );
+                src += sizeof( u );
+                if( swap ) u = ( u >> 24 ) | ( ( u >> 8 ) & 0xFF00 ) | ( ( u << 8 ) & 0xFF0000 ) | ( u << 24 );
+                memcpy( v + c, &u, sizeof( u ) );
+            }
+            if( channels == 1 ) v[1] = v[2] = v[0];
+            *dst++ = PackHalf( v[0], v[1], v[2] );
+        }
+    }
+    return true;
+}
+
+bool BitmapHdr::Write( const char* fn ) const
+{
+    FILE* f = fopen( fn, "wb" );
+    if( !f ) return false;
+    fprintf( f, "PF\n%i %i\n-1.0\n", m_size.x, m_size.y );
+    std::vector<float> row( size_t( m_size.x ) * 3 );
+    for( int y=m_size.y-1; y>=0; y-- )
+    {
+        auto src = m_data.data() + size_t( y ) * Stride();
+        for( int x=0; x<m_size.x; x++ )
+        {
+            for( int c=0; c<3; c++ ) row[x*3+c] = HalfToFloat( uint16_t( src[x] >> ( c * 16 ) ) );
+        }
+        fwrite( row.data(), sizeof( float ), row.size(), f );
+    }
+    const bool ok = ferror( f ) == 0;
+    fclose( f );
+    return ok;
+}
+
+BitmapHdrDownsampled::BitmapHdrDownsampled( const BitmapHdr& bmp )
+    : BitmapHdr( v2i( std::max( 1, bmp.Size().x / 2 ), std::max( 1, bmp.Size().y / 2 ) ) )
+{
+    const auto& src = bmp.Size();
+    const auto srcStride = bmp.Stride();
+    const auto stride = Stride();
+    for( int y=0; y<m_size.y; y++ )
+    {
+        const auto row0 = bmp.Data() + std::min( y * 2, src.y - 1 ) * srcStride;
+        const auto row1 = bmp.Data() + std::min( y * 2 + 1, src.y - 1 ) * srcStride;
+        auto dst = m_data.data() + y * stride;
+        for( int x=0; x<m_size.x; x++ )
+        {
+            const int x0 = std::min( x * 2, src.x - 1 );
+            const int x1 = std::min( x * 2 + 1, src.x - 1 );
+            const uint64_t px[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+            float v[3] = {};
+            for( int i=0; i<4; i++ )
+            {
+                for( int c=0; c<3; c++ ) v[c] += HalfToFloat( uint16_t( px[i] >> ( c * 16 ) ) );
+            }
+            dst[x] = PackHalf( v[0] * 0.25f, v[1] * 0.25f, v[2] * 0.25f );
+        }
+    }
+    PadEdges();
+}
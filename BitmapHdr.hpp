@@ -0,0 +1,53 @@
+#ifndef __BITMAPHDR_HPP__
+#define __BITMAPHDR_HPP__
+
+#include <algorithm>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "Vector.hpp"
+
+// Half float RGBA pixels, R in the low 16 bits, top row first. Rows are at
+// least 4 pixels long and there are at least 4 of them; images smaller than
+// a block are padded with their edge pixels.
+class BitmapHdr
+{
+public:
+    // Reads Radiance RGBE (.hdr) and PFM (.pfm), by extension. Alpha is 1.0.
+    BitmapHdr( const char* fn );
+    BitmapHdr( const v2i& size );
+
+    bool IsValid() const { return !m_data.empty(); }
+    // Writes the RGB channels as PFM
+    bool Write( const char* fn ) const;
+
+    uint64_t* Data() { return m_data.data(); }
+    const uint64_t* Data() const { return m_data.data(); }
+    const v2i& Size() const { return m_size; }
+    size_t Stride() const { return size_t( std::max( 4, m_size.x ) ); }
+
+    static bool IsHdrFile( const char* fn );
+
+protected:
+    void Allocate();
+    void PadEdges();
+
+    v2i m_size;
+    std::vector<uint64_t> m_data;
+
+private:
+    bool LoadRadiance( const std::vector<uint8_t>& buf );
+    bool LoadPfm( const std::vector<uint8_t>& buf );
+};
+
+// Next mip level, 2x2 box filter of the linear values
+class BitmapHdrDownsampled : public BitmapHdr
+{
+public:
+    BitmapHdrDownsampled( const BitmapHdr& bmp );
+};
+
+typedef std::shared_ptr<BitmapHdr> BitmapHdrPtr;
+
+#endif
@@ -1,13 +1,25 @@
+#include <algorithm>
 #include <assert.h>
+#include <math.h>
 #include <string.h>
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
 
+#include "AsyncWriter.hpp"
+#include "BitmapHdr.hpp"
 #include "BlockData.hpp"
 #include "ColorSpace.hpp"
 #include "Debug.hpp"
+#include "Half.hpp"
 #include "MipMap.hpp"
 #include "mmap.hpp"
+#include "ProcessBc6h.hpp"
 #include "ProcessRGB.hpp"
 #include "ProcessDxtc.hpp"
+#include "Progress.hpp"
+#include "StreamWriter.hpp"
 #include "Tables.hpp"
 #include "TaskDispatch.hpp"
 
@@ -33,8 +45,22 @@
 
 static uint8_t table59T58H[8] = { 3,6,11,16,23,32,41,64 };
 
+// PVR metadata block holding the block order: mode and tile size
+enum { OrderFourCC = 0x4B505445 };  // "ETPK"
+enum { OrderMetadataSize = 12 + 8 };
+
+static size_t HeaderSize( const BlockOrder& order )
+{
+    return 52 + ( order.IsLinear() ? 0 : OrderMetadataSize );
+}
+
 BlockData::BlockData( const char* fn )
     : m_file( fopen( fn, "rb" ) )
+    , m_mode( Mmap )
+    , m_levels( 1 )
+    , m_progress( nullptr )
+    , m_eagerWriteback( false )
+    , m_levelWriteback( false )
 {
     assert( m_file );
     fseek( m_file, 0, SEEK_END );
@@ -57,6 +83,9 @@ BlockData::BlockData( const char* fn )
         case 11:
             m_type = Dxt5;
             break;
+        case 14:
+            m_type = Bc6h;
+            break;
         case 22:
             m_type = Etc2_RGB;
             break;
@@ -70,7 +99,31 @@ BlockData::BlockData( const char* fn )
 
         m_size.y = *(data32+6);
         m_size.x = *(data32+7);
+        m_levels = std::max<int>( 1, *(data32+11) );
         m_dataOffset = 52 + *(data32+12);
+
+        auto meta = m_data + 52;
+        while( meta + 12 <= m_data + m_dataOffset )
+        {
+            uint32_t hdr[3];
+            memcpy( hdr, meta, sizeof( hdr ) );
+            if( hdr[0] == OrderFourCC && hdr[1] == 0 && hdr[2] >= 8 )
+            {
+                uint32_t order[2];
+                memcpy( order, meta + 12, sizeof( order ) );
+                if( order[0] == BlockOrder::Morton || ( order[0] == BlockOrder::Tiled && order[1] > 0 && order[1] <= 0x10000 ) )
+                {
+                    m_order = BlockOrder( BlockOrder::Mode( order[0] ), int( order[1] ) );
+                }
+                else
+                {
+                    // Corrupt metadata; the blocks are read in row order
+                    DBGPRINT( "Invalid block order " << order[0] << ", tile " << order[1] );
+                }
+            }
+            meta += 12 + hdr[2];
+        }
+        CalcLevelOffsets( false );
     }
     else if( *data32 == 0x58544BAB )
     {
@@ -90,7 +143,9 @@ BlockData::BlockData( const char* fn )
 
         m_size.x = *(data32+9);
         m_size.y = *(data32+10);
+        m_levels = std::max<int>( 1, *(data32+14) );
         m_dataOffset = sizeof( uint32_t ) * 17 + *(data32+15);
+        CalcLevelOffsets( true );
     }
     else
     {
@@ -98,17 +153,9 @@ BlockData::BlockData( const char* fn )
     }
 }
 
-static uint8_t* OpenForWriting( const char* fn, size_t len, const v2i& size, FILE** f, int levels, BlockData::Type type )
+static void WriteHeader( uint8_t* ptr, const v2i& size, int levels, BlockData::Type type, const BlockOrder& order )
 {
-    *f = fopen( fn, "wb+" );
-    assert( *f );
-    fseek( *f, len - 1, SEEK_SET );
-    const char zero = 0;
-    fwrite( &zero, 1, 1, *f );
-    fseek( *f, 0, SEEK_SET );
-
-    auto ret = (uint8_t*)mmap( nullptr, len, PROT_WRITE, MAP_SHARED, fileno( *f ), 0 );
-    auto dst = (uint32_t*)ret;
+    auto dst = (uint32_t*)ptr;
 
     *dst++ = 0x03525650;  // version
     *dst++ = 0;           // flags
@@ -129,90 +176,406 @@ static uint8_t* OpenForWriting( const char* fn, size_t len, const v2i& size, FIL
     case BlockData::Dxt5:
         *dst++ = 11;
         break;
+    case BlockData::Bc6h:
+        *dst++ = 14;
+        break;
     default:
         assert( false );
         break;
     }
     *dst++ = 0;           // pixelformat[1]
     *dst++ = 0;           // colourspace
-    *dst++ = 0;           // channel type
+    *dst++ = type == BlockData::Bc6h ? 13 : 0;    // channel type (unsigned float)
     *dst++ = size.y;      // height
     *dst++ = size.x;      // width
     *dst++ = 1;           // depth
     *dst++ = 1;           // num surfs
     *dst++ = 1;           // num faces
     *dst++ = levels;      // mipmap count
-    *dst++ = 0;           // metadata size
+    if( order.IsLinear() )
+    {
+        *dst++ = 0;       // metadata size
+    }
+    else
+    {
+        *dst++ = OrderMetadataSize;
+        *dst++ = OrderFourCC;
+        *dst++ = 0;       // key
+        *dst++ = 8;       // data size
+        *dst++ = order.mode;
+        *dst++ = order.tile;
+    }
+}
+
+static void Preallocate( FILE* f, size_t len )
+{
+#ifdef __linux__
+    // Reserve the blocks up front, so that page faults in the workers
+    // don't have to allocate space on the filesystem.
+    if( fallocate( fileno( f ), 0, 0, len ) == 0 ) return;
+#endif
+    fseek( f, len - 1, SEEK_SET );
+    const char zero = 0;
+    fwrite( &zero, 1, 1, f );
+    fseek( f, 0, SEEK_SET );
+}
+
+// Stream buffers are private anonymous mappings, so that the stream writer
+// can give written pages back
+static uint8_t* AllocStreamBuffer( size_t len )
+{
+#ifndef _WIN32
+    const auto ptr = mmap( nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    return ptr != MAP_FAILED ? (uint8_t*)ptr : nullptr;
+#else
+    return new uint8_t[len];
+#endif
+}
 
+static void FreeStreamBuffer( uint8_t* ptr, size_t len )
+{
+#ifndef _WIN32
+    if( ptr ) munmap( ptr, len );
+#else
+    delete[] ptr;
+#endif
+}
+
+static uint8_t* OpenForWriting( const char* fn, size_t len, const v2i& size, FILE** f, int levels, BlockData::Type type, BlockData::WriteMode mode, const BlockOrder& order )
+{
+    uint8_t* ret;
+    if( mode == BlockData::Stream )
+    {
+        // Pipes and sockets can't be preallocated or mapped; "-" is stdout
+        *f = strcmp( fn, "-" ) == 0 ? nullptr : fopen( fn, "wb" );
+        if( !*f && strcmp( fn, "-" ) != 0 ) return nullptr;
+        ret = AllocStreamBuffer( len );
+        if( !ret )
+        {
+            if( *f ) fclose( *f );
+            *f = nullptr;
+            return nullptr;
+        }
+        WriteHeader( ret, size, levels, type, order );
+        return ret;
+    }
+
+    *f = fopen( fn, "wb+" );
+    if( !*f ) return nullptr;
+    Preallocate( *f, len );
+
+    if( mode == BlockData::Pwrite || mode == BlockData::Async )
+    {
+        ret = new uint8_t[len];
+    }
+    else
+    {
+        const int flags = MAP_SHARED | ( mode == BlockData::MmapPopulate ? MAP_POPULATE : 0 );
+        ret = (uint8_t*)mmap( nullptr, len, PROT_WRITE, flags, fileno( *f ), 0 );
+        if( ret == MAP_FAILED )
+        {
+            fclose( *f );
+            *f = nullptr;
+            return nullptr;
+        }
+    }
+
+    WriteHeader( ret, size, levels, type, order );
     return ret;
 }
 
-static int AdjustSizeForMipmaps( const v2i& size, int levels )
+static size_t AdjustSizeForMipmaps( const v2i& size, int levels )
 {
-    int len = 0;
+    size_t len = 0;
     v2i current = size;
     for( int i=1; i<levels; i++ )
     {
         assert( current.x != 1 || current.y != 1 );
         current.x = std::max( 1, current.x / 2 );
         current.y = std::max( 1, current.y / 2 );
-        len += std::max( 4, current.x ) * std::max( 4, current.y ) / 2;
+        len += size_t( std::max( 4, current.x ) ) * std::max( 4, current.y ) / 2;
     }
     assert( current.x == 1 && current.y == 1 );
     return len;
 }
 
-BlockData::BlockData( const char* fn, const v2i& size, bool mipmap, Type type )
+BlockData::BlockData( const char* fn, const v2i& size, bool mipmap, Type type, WriteMode mode, const BlockOrder& order )
     : m_size( size )
-    , m_dataOffset( 52 )
-    , m_maplen( m_size.x*m_size.y/2 )
+    , m_dataOffset( HeaderSize( order ) )
+    , m_maplen( size_t( m_size.x ) * m_size.y / 2 )
     , m_type( type )
+#ifdef _WIN32
+    , m_mode( mode == Pwrite || mode == Async ? Mmap : mode )
+#else
+    , m_mode( mode )
+#endif
+    , m_order( order )
+    , m_levels( 1 )
+    , m_progress( nullptr )
+    , m_eagerWriteback( false )
+    , m_levelWriteback( false )
 {
     assert( m_size.x%4 == 0 && m_size.y%4 == 0 );
 
-    uint32_t cnt = m_size.x * m_size.y / 16;
+    size_t cnt = size_t( m_size.x ) * m_size.y / 16;
     DBGPRINT( cnt << " blocks" );
 
-    int levels = 1;
+    if( mipmap )
+    {
+        m_levels = NumberOfMipLevels( size );
+        DBGPRINT( "Number of mipmaps: " << m_levels );
+        m_maplen += AdjustSizeForMipmaps( size, m_levels );
+    }
+
+    m_maplen *= BlockWords( type );
+
+    m_maplen += m_dataOffset;
+    m_data = OpenForWriting( fn, m_maplen, m_size, &m_file, m_levels, type, m_mode, order );
+    if( !m_data ) return;
+    if( m_mode == Async ) m_writer.reset( new AsyncWriter( fileno( m_file ) ) );
+    if( m_mode == Stream ) m_stream.reset( new StreamWriter( m_file ? fileno( m_file ) : fileno( stdout ), m_data ) );
+    Flush( 0, m_dataOffset );
+    CalcLevelOffsets( false );
+}
 
+BlockData::BlockData( int fd, const v2i& size, bool mipmap, Type type, const BlockOrder& order )
+    : m_size( size )
+    , m_dataOffset( HeaderSize( order ) )
+    , m_file( nullptr )
+    , m_maplen( size_t( m_size.x ) * m_size.y / 2 )
+    , m_type( type )
+    , m_mode( Stream )
+    , m_order( order )
+    , m_levels( 1 )
+    , m_progress( nullptr )
+    , m_eagerWriteback( false )
+    , m_levelWriteback( false )
+{
+    assert( m_size.x%4 == 0 && m_size.y%4 == 0 );
     if( mipmap )
     {
-        levels = NumberOfMipLevels( size );
-        DBGPRINT( "Number of mipmaps: " << levels );
-        m_maplen += AdjustSizeForMipmaps( size, levels );
+        m_levels = NumberOfMipLevels( size );
+        m_maplen += AdjustSizeForMipmaps( size, m_levels );
     }
 
-    if( type == Etc2_RGBA || type == Dxt5 ) m_maplen *= 2;
+    m_maplen *= BlockWords( type );
 
     m_maplen += m_dataOffset;
-    m_data = OpenForWriting( fn, m_maplen, m_size, &m_file, levels, type );
+    m_data = AllocStreamBuffer( m_maplen );
+    if( !m_data ) return;
+    WriteHeader( m_data, m_size, m_levels, type, order );
+    m_stream.reset( new StreamWriter( fd, m_data ) );
+    Flush( 0, m_dataOffset );
+    CalcLevelOffsets( false );
 }
 
-BlockData::BlockData( const v2i& size, bool mipmap, Type type )
+BlockData::BlockData( const v2i& size, bool mipmap, Type type, const BlockOrder& order )
     : m_size( size )
-    , m_dataOffset( 52 )
+    , m_dataOffset( HeaderSize( order ) )
     , m_file( nullptr )
-    , m_maplen( m_size.x*m_size.y/2 )
+    , m_maplen( size_t( m_size.x ) * m_size.y / 2 )
     , m_type( type )
+    , m_mode( Mmap )
+    , m_order( order )
+    , m_levels( 1 )
+    , m_progress( nullptr )
+    , m_eagerWriteback( false )
+    , m_levelWriteback( false )
 {
     assert( m_size.x%4 == 0 && m_size.y%4 == 0 );
     if( mipmap )
     {
-        const int levels = NumberOfMipLevels( size );
-        m_maplen += AdjustSizeForMipmaps( size, levels );
+        m_levels = NumberOfMipLevels( size );
+        m_maplen += AdjustSizeForMipmaps( size, m_levels );
     }
 
-    if( type == Etc2_RGBA || type == Dxt5 ) m_maplen *= 2;
+    m_maplen *= BlockWords( type );
 
     m_maplen += m_dataOffset;
     m_data = new uint8_t[m_maplen];
+    CalcLevelOffsets( false );
+}
+
+void BlockData::CalcLevelOffsets( bool ktx )
+{
+    const size_t blockSize = BlockWords() * 8;
+
+    m_levelOffset.reserve( m_levels );
+    m_levelPending.reset( new std::atomic<uint32_t>[m_levels] );
+    size_t offset = m_dataOffset;
+    for( int i=0; i<m_levels; i++ )
+    {
+        m_levelOffset.emplace_back( offset );
+        const auto size = LevelSize( i );
+        const uint32_t blocks = std::max( 4, size.x ) / 4 * ( std::max( 4, size.y ) / 4 );
+        m_levelPending[i].store( blocks );
+        offset += blocks * blockSize;
+        // KTX prefixes every level after the first with its image size
+        if( ktx ) offset += sizeof( uint32_t );
+    }
+}
+
+v2i BlockData::LevelSize( int level ) const
+{
+    return v2i( std::max( 1, m_size.x >> level ), std::max( 1, m_size.y >> level ) );
+}
+
+void BlockData::WriteRange( size_t start, size_t len )
+{
+#ifndef _WIN32
+    const auto fd = fileno( m_file );
+    while( len > 0 )
+    {
+        const auto ret = pwrite( fd, m_data + start, len, start );
+        if( ret <= 0 )
+        {
+            assert( false );
+            return;
+        }
+        start += ret;
+        len -= ret;
+    }
+#endif
+}
+
+void BlockData::Flush( size_t start, size_t len )
+{
+    switch( m_mode )
+    {
+    case Pwrite:
+        WriteRange( start, len );
+        break;
+    case Async:
+        m_writer->Write( m_data + start, len, start );
+        break;
+    case Stream:
+        m_stream->Write( start, len );
+        break;
+    default:
+        if( m_eagerWriteback ) StartWriteback( start, len );
+        break;
+    }
+}
+
+void BlockData::CompleteBlocks( size_t start, uint32_t blocks )
+{
+    if( m_progress && m_progress->Cancelled() ) return;
+
+    const size_t blockSize = BlockWords() * 8;
+    int level = int( std::upper_bound( m_levelOffset.begin(), m_levelOffset.end(), start ) - m_levelOffset.begin() ) - 1;
+    while( blocks > 0 && level < m_levels )
+    {
+        const auto end = level+1 < m_levels ? m_levelOffset[level+1] : m_maplen;
+        const auto num = uint32_t( std::min<size_t>( blocks, ( end - start ) / blockSize ) );
+        if( m_levelPending[level].fetch_sub( num ) == num ) CompleteLevel( level );
+        blocks -= num;
+        start += num * blockSize;
+        level++;
+    }
+}
+
+void BlockData::CompleteLevel( int level )
+{
+    const auto end = level+1 < m_levels ? m_levelOffset[level+1] : m_maplen;
+    if( !m_order.IsLinear() )
+    {
+        // Processed ranges are scattered over the level, it goes out in one piece
+        Flush( m_levelOffset[level], end - m_levelOffset[level] );
+    }
+    if( ( m_mode == Mmap || m_mode == MmapPopulate ) && m_levelWriteback && !m_eagerWriteback )
+    {
+        // Start writeback of the finished level now instead of at unmap
+        StartWriteback( m_levelOffset[level], end - m_levelOffset[level] );
+    }
+    if( m_levelCallback ) m_levelCallback( level );
+}
+
+void BlockData::StartWriteback( size_t start, size_t len )
+{
+    if( !m_file ) return;
+#ifdef __linux__
+    // msync( MS_ASYNC ) is a no-op on Linux
+    sync_file_range( fileno( m_file ), start, len, SYNC_FILE_RANGE_WRITE );
+#elif !defined _WIN32
+    const size_t page = sysconf( _SC_PAGESIZE );
+    const auto begin = start / page * page;
+    msync( m_data + begin, start + len - begin, MS_ASYNC );
+#endif
+}
+
+int BlockData::LevelOf( size_t offset ) const
+{
+    const size_t start = m_dataOffset + offset * ( BlockWords() * 8 );
+    return int( std::upper_bound( m_levelOffset.begin(), m_levelOffset.end(), start ) - m_levelOffset.begin() ) - 1;
+}
+
+// Calls copy( i, idx ) for the blocks first to first+blocks-1 of a level in
+// row order, with idx the place of block i in the file's order
+template<class T>
+static etcpak_force_inline void MapBlocks( const BlockOrder& order, const v2i& dim, size_t first, uint32_t blocks, T copy )
+{
+    int x = int( first % dim.x );
+    int y = int( first / dim.x );
+    for( uint32_t i=0; i<blocks; i++ )
+    {
+        copy( i, order.Index( x, y, dim ) );
+        if( ++x == dim.x )
+        {
+            x = 0;
+            y++;
+        }
+    }
+}
+
+void BlockData::Scatter( const uint64_t* src, size_t offset, uint32_t blocks )
+{
+    const int level = LevelOf( offset );
+    const auto size = LevelSize( level );
+    const v2i dim( std::max( 4, size.x ) / 4, std::max( 4, size.y ) / 4 );
+    const size_t words = BlockWords();
+    const auto base = (uint64_t*)( m_data + m_levelOffset[level] );
+    const auto first = offset - ( m_levelOffset[level] - m_dataOffset ) / ( words * 8 );
+
+    MapBlocks( m_order, dim, first, blocks, [src, base, words]( uint32_t i, size_t idx )
+    {
+        memcpy( base + idx * words, src + i * words, words * 8 );
+    } );
+}
+
+void BlockData::Gather( uint64_t* dst, int level, size_t first, uint32_t blocks ) const
+{
+    const auto size = LevelSize( level );
+    const v2i dim( std::max( 4, size.x ) / 4, std::max( 4, size.y ) / 4 );
+    const size_t words = BlockWords();
+    const auto base = (const uint64_t*)( m_data + m_levelOffset[level] );
+
+    MapBlocks( m_order, dim, first, blocks, [dst, base, words]( uint32_t i, size_t idx )
+    {
+        memcpy( dst + i * words, base + idx * words, words * 8 );
+    } );
 }
 
 BlockData::~BlockData()
 {
-    if( m_file )
+    // Drain pending writes before the buffer they point into goes away
+    m_writer.reset();
+    m_stream.reset();
+
+    if( m_mode == Stream )
     {
-        munmap( m_data, m_maplen );
+        FreeStreamBuffer( m_data, m_maplen );
+        if( m_file ) fclose( m_file );
+    }
+    else if( m_file )
+    {
+        if( m_mode == Pwrite || m_mode == Async )
+        {
+            delete[] m_data;
+        }
+        else
+        {
+            munmap( m_data, m_maplen );
+        }
         fclose( m_file );
     }
     else
@@ -221,19 +584,36 @@ BlockData::~BlockData()
     }
 }
 
+void BlockData::SetReleaseWritten( bool enable )
+{
+    if( m_stream ) m_stream->SetReleaseWritten( enable );
+}
+
 void BlockData::Process( const uint32_t* src, uint32_t blocks, size_t offset, size_t width, Channels type, bool dither, bool useHeuristics )
 {
+    // Tasks still queued when the job is cancelled finish immediately
+    if( m_progress && m_progress->Cancelled() ) return;
+
     auto dst = ((uint64_t*)( m_data + m_dataOffset )) + offset;
+    const auto start = (uint8_t*)dst - m_data;
+
+    // Blocks come out of the compressors in row order
+    std::vector<uint64_t> ordered;
+    if( !m_order.IsLinear() )
+    {
+        ordered.resize( blocks );
+        dst = ordered.data();
+    }
 
     if( type == Channels::Alpha )
     {
         if( m_type != Etc1 )
         {
-            CompressEtc2Alpha( src, dst, blocks, width, useHeuristics );
+            CompressEtc2Alpha( src, dst, blocks, width, useHeuristics, m_progress );
         }
         else
         {
-            CompressEtc1Alpha( src, dst, blocks, width );
+            CompressEtc1Alpha( src, dst, blocks, width, m_progress );
         }
     }
     else
@@ -243,24 +623,24 @@ void BlockData::Process( const uint32_t* src, uint32_t blocks, size_t offset, si
         case Etc1:
             if( dither )
             {
-                CompressEtc1RgbDither( src, dst, blocks, width );
+                CompressEtc1RgbDither( src, dst, blocks, width, m_progress );
             }
             else
             {
-                CompressEtc1Rgb( src, dst, blocks, width );
+                CompressEtc1Rgb( src, dst, blocks, width, m_progress );
             }
             break;
         case Etc2_RGB:
-            CompressEtc2Rgb( src, dst, blocks, width, useHeuristics );
+            CompressEtc2Rgb( src, dst, blocks, width, useHeuristics, m_progress );
             break;
         case Dxt1:
             if( dither )
             {
-                CompressDxt1Dither( src, dst, blocks, width );
+                CompressDxt1Dither( src, dst, blocks, width, m_progress );
             }
             else
             {
-                CompressDxt1( src, dst, blocks, width );
+                CompressDxt1( src, dst, blocks, width, m_progress );
             }
             break;
         default:
@@ -268,24 +648,114 @@ void BlockData::Process( const uint32_t* src, uint32_t blocks, size_t offset, si
             break;
         }
     }
+
+    if( m_order.IsLinear() )
+    {
+        Flush( start, blocks * sizeof( uint64_t ) );
+    }
+    else
+    {
+        Scatter( dst, offset, blocks );
+    }
+    CompleteBlocks( start, blocks );
 }
 
 void BlockData::ProcessRGBA( const uint32_t* src, uint32_t blocks, size_t offset, size_t width, bool useHeuristics )
 {
+    if( m_progress && m_progress->Cancelled() ) return;
+
     auto dst = ((uint64_t*)( m_data + m_dataOffset )) + offset * 2;
+    const auto start = (uint8_t*)dst - m_data;
+
+    std::vector<uint64_t> ordered;
+    if( !m_order.IsLinear() )
+    {
+        ordered.resize( blocks * 2 );
+        dst = ordered.data();
+    }
 
     switch( m_type )
     {
     case Etc2_RGBA:
-        CompressEtc2Rgba( src, dst, blocks, width, useHeuristics );
+        CompressEtc2Rgba( src, dst, blocks, width, useHeuristics, m_progress );
         break;
     case Dxt5:
-        CompressDxt5( src, dst, blocks, width );
+        CompressDxt5( src, dst, blocks, width, m_progress );
         break;
     default:
         assert( false );
         break;
     }
+
+    if( m_order.IsLinear() )
+    {
+        Flush( start, blocks * sizeof( uint64_t ) * 2 );
+    }
+    else
+    {
+        Scatter( dst, offset, blocks );
+    }
+    CompleteBlocks( start, blocks );
+}
+
+void BlockData::ProcessHdr( const uint64_t* src, uint32_t blocks, size_t offset, size_t width )
+{
+    if( m_progress && m_progress->Cancelled() ) return;
+    assert( m_type == Bc6h );
+
+    auto dst = ((uint64_t*)( m_data + m_dataOffset )) + offset * 2;
+    const auto start = (uint8_t*)dst - m_data;
+
+    std::vector<uint64_t> ordered;
+    if( !m_order.IsLinear() )
+    {
+        ordered.resize( blocks * 2 );
+        dst = ordered.data();
+    }
+
+    CompressBc6h( src, dst, blocks, width, m_progress );
+
+    if( m_order.IsLinear() )
+    {
+        Flush( start, blocks * sizeof( uint64_t ) * 2 );
+    }
+    else
+    {
+        Scatter( dst, offset, blocks );
+    }
+    CompleteBlocks( start, blocks );
+}
+
+void BlockData::Store( const uint64_t* src, size_t offset, uint32_t blocks )
+{
+    if( m_progress && m_progress->Cancelled() ) return;
+
+    const size_t blockSize = BlockWords() * 8;
+    const auto start = m_dataOffset + offset * blockSize;
+    if( m_order.IsLinear() )
+    {
+        memcpy( m_data + start, src, blocks * blockSize );
+        Flush( start, blocks * blockSize );
+    }
+    else
+    {
+        Scatter( src, offset, blocks );
+    }
+    CompleteBlocks( start, blocks );
+}
+
+void BlockData::Load( uint64_t* dst, size_t offset, uint32_t blocks ) const
+{
+    const size_t blockSize = BlockWords() * 8;
+    if( m_order.IsLinear() )
+    {
+        memcpy( dst, m_data + m_dataOffset + offset * blockSize, blocks * blockSize );
+    }
+    else
+    {
+        const int level = LevelOf( offset );
+        Gather( dst, level, offset - ( m_levelOffset[level] - m_dataOffset ) / blockSize, blocks );
+    }
 }
 
 namespace
@@ -693,20 +1163,246 @@ static etcpak_force_inline void DecodePlanarAlpha( uint64_t block, uint64_t alph
 
 BitmapPtr BlockData::Decode()
 {
+    auto ret = std::make_shared<Bitmap>( m_size );
+    Decode( (uint8_t*)ret->Data(), m_size.x * 4, RGBA8 );
+    return ret;
+}
+
+void BlockData::Decode( uint8_t* dst, size_t stride, Format format )
+{
+    Decode( dst, stride, format, 0, 0, m_size.y / 4 );
+}
+
+void BlockData::Decode( uint8_t* dst, size_t stride, Format format, int level, int firstRow, int rows )
+{
+    assert( level < m_levels );
+    const auto size = LevelSize( level );
+    const auto bx = std::max( 4, size.x ) / 4;
+    assert( firstRow + rows <= std::max( 4, size.y ) / 4 );
+
+    const size_t blockSize = BlockWords();
+    const uint64_t* src = ((const uint64_t*)( m_data + m_levelOffset[level] )) + size_t( firstRow ) * bx * blockSize;
+    const v2i blocks( bx, rows );
+
+    // The decoders read blocks in row order
+    std::vector<uint64_t> ordered;
+    if( !m_order.IsLinear() )
+    {
+        ordered.resize( size_t( bx ) * rows * blockSize );
+        Gather( ordered.data(), level, size_t( firstRow ) * bx, bx * rows );
+        src = ordered.data();
+    }
+
     switch( m_type )
     {
     case Etc1:
     case Etc2_RGB:
-        return DecodeRGB();
+        DecodeRGB( src, blocks, dst, stride, format );
+        break;
     case Etc2_RGBA:
-        return DecodeRGBA();
+        DecodeRGBA( src, blocks, dst, stride, format );
+        break;
     case Dxt1:
-        return DecodeDxt1();
+        DecodeDxt1( src, blocks, dst, stride, format );
+        break;
     case Dxt5:
-        return DecodeDxt5();
+        DecodeDxt5( src, blocks, dst, stride, format );
+        break;
+    case Bc6h:
+        DecodeBc6h( src, blocks, dst, stride, format );
+        break;
     default:
         assert( false );
-        return nullptr;
+        break;
+    }
+}
+
+void BlockData::DecodeBlock( const uint64_t* src, uint32_t* dst, Format format )
+{
+    assert( format == RGBA8 || format == BGRA8 );
+    const v2i blocks( 1, 1 );
+
+    switch( m_type )
+    {
+    case Etc1:
+    case Etc2_RGB:
+        DecodeRGB( src, blocks, (uint8_t*)dst, 16, format );
+        break;
+    case Etc2_RGBA:
+        DecodeRGBA( src, blocks, (uint8_t*)dst, 16, format );
+        break;
+    case Dxt1:
+        DecodeDxt1( src, blocks, (uint8_t*)dst, 16, format );
+        break;
+    case Dxt5:
+        DecodeDxt5( src, blocks, (uint8_t*)dst, 16, format );
+        break;
+    case Bc6h:
+        DecodeBc6h( src, blocks, (uint8_t*)dst, 16, format );
+        break;
+    default:
+        assert( false );
+        break;
+    }
+}
+
+std::vector<BitmapPtr> BlockData::DecodeLevels( Format format )
+{
+    assert( format == RGBA8 || format == BGRA8 );
+
+    std::vector<BitmapPtr> ret;
+    ret.reserve( m_levels );
+    for( int i=0; i<m_levels; i++ )
+    {
+        const auto size = LevelSize( i );
+        const v2i padded( std::max( 4, size.x ), std::max( 4, size.y ) );
+        auto bmp = std::make_shared<Bitmap>( padded );
+        ret.emplace_back( bmp );
+
+        constexpr int RowsPerTask = 32;
+        const auto rows = padded.y / 4;
+        for( int row=0; row<rows; row+=RowsPerTask )
+        {
+            const auto num = std::min( RowsPerTask, rows - row );
+            TaskDispatch::Queue( [this, bmp, padded, format, i, row, num]
+            {
+                Decode( (uint8_t*)( bmp->Data() + row * 4 * padded.x ), padded.x * 4, format, i, row, num );
+            } );
+        }
+    }
+    TaskDispatch::Sync();
+
+    for( int i=0; i<m_levels; i++ )
+    {
+        const auto size = LevelSize( i );
+        if( size.x < 4 || size.y < 4 )
+        {
+            auto bmp = std::make_shared<Bitmap>( size );
+            auto src = ret[i]->Data();
+            auto dst = bmp->Data();
+            for( int y=0; y<size.y; y++ )
+            {
+                memcpy( dst + y * size.x, src + y * 4, size.x * sizeof( uint32_t ) );
+            }
+            ret[i] = bmp;
+        }
+    }
+
+    return ret;
+}
+
+std::shared_ptr<BitmapHdr> BlockData::DecodeHdr( int level )
+{
+    assert( m_type == Bc6h && level < m_levels );
+    const auto size = LevelSize( level );
+    const v2i blocks( std::max( 4, size.x ) / 4, std::max( 4, size.y ) / 4 );
+    const size_t num = size_t( blocks.x ) * blocks.y;
+
+    const uint64_t* src = (const uint64_t*)( m_data + m_levelOffset[level] );
+    std::vector<uint64_t> ordered;
+    if( !m_order.IsLinear() )
+    {
+        ordered.resize( num * 2 );
+        Gather( ordered.data(), level, 0, uint32_t( num ) );
+        src = ordered.data();
+    }
+
+    auto ret = std::make_shared<BitmapHdr>( size );
+    const auto stride = ret->Stride();
+    for( int y=0; y<blocks.y; y++ )
+    {
+        auto dst = ret->Data() + y * 4 * stride;
+        for( int x=0; x<blocks.x; x++ )
+        {
+            ::DecodeBc6h( src, dst, stride );
+            src += 2;
+            dst += 4;
+        }
+    }
+    return ret;
+}
+
+static etcpak_force_inline void StoreBlock( const uint32_t* src, uint8_t* dst, size_t stride, BlockData::Format format, bool alpha )
+{
+    switch( format )
+    {
+    case BlockData::BGRA8:
+        for( int j=0; j<4; j++ )
+        {
+            auto ptr = (uint32_t*)dst;
+            for( int i=0; i<4; i++ )
+            {
+                const auto c = *src++;
+                *ptr++ = ( c & 0xFF00FF00 ) | ( ( c & 0xFF ) << 16 ) | ( ( c >> 16 ) & 0xFF );
+            }
+            dst += stride;
+        }
+        break;
+    case BlockData::RGB8:
+        for( int j=0; j<4; j++ )
+        {
+            auto ptr = dst;
+            for( int i=0; i<4; i++ )
+            {
+                memcpy( ptr, src++, 3 );
+                ptr += 3;
+            }
+            dst += stride;
+        }
+        break;
+    case BlockData::R8:
+    {
+        const auto shift = alpha ? 24 : 0;
+        for( int j=0; j<4; j++ )
+        {
+            for( int i=0; i<4; i++ )
+            {
+                dst[i] = uint8_t( *src++ >> shift );
+            }
+            dst += stride;
+        }
+        break;
+    }
+    default:
+        assert( false );
+        break;
+    }
+}
+
+// Decodes blocks with decode( src, dst, w ), writing RGBA8 straight into the
+// destination and going through a 4x4 staging block for all other formats.
+template<class T>
+static etcpak_force_inline void DecodeBlocks( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, BlockData::Format format, bool alpha, T decode )
+{
+    if( format == BlockData::RGBA8 )
+    {
+        assert( stride % 4 == 0 );
+        for( int y=0; y<blocks.y; y++ )
+        {
+            auto ptr = (uint32_t*)dst;
+            for( int x=0; x<blocks.x; x++ )
+            {
+                decode( src, ptr, uint32_t( stride / 4 ) );
+                ptr += 4;
+            }
+            dst += stride * 4;
+        }
+    }
+    else
+    {
+        const size_t bpp = format == BlockData::RGB8 ? 3 : ( format == BlockData::R8 ? 1 : 4 );
+        uint32_t buf[4*4];
+        for( int y=0; y<blocks.y; y++ )
+        {
+            auto ptr = dst;
+            for( int x=0; x<blocks.x; x++ )
+            {
+                decode( src, buf, 4 );
+                StoreBlock( buf, ptr, stride, format, alpha );
+                ptr += bpp * 4;
+            }
+            dst += stride * 4;
+        }
     }
 }
 
@@ -1001,47 +1697,23 @@ static etcpak_force_inline void DecodeRGBAPart( uint64_t d, uint64_t alpha, uint
     }
 }
 
-BitmapPtr BlockData::DecodeRGB()
+void BlockData::DecodeRGB( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format )
 {
-    auto ret = std::make_shared<Bitmap>( m_size );
-
-    const uint64_t* src = (const uint64_t*)( m_data + m_dataOffset );
-    uint32_t* dst = ret->Data();
-
-    for( int y=0; y<m_size.y/4; y++ )
+    DecodeBlocks( src, blocks, dst, stride, format, false, []( const uint64_t*& src, uint32_t* dst, uint32_t w )
     {
-        for( int x=0; x<m_size.x/4; x++ )
-        {
-            uint64_t d = *src++;
-            DecodeRGBPart( d, dst, m_size.x );
-            dst += 4;
-        }
-        dst += m_size.x*3;
-    }
-
-    return ret;
+        uint64_t d = *src++;
+        DecodeRGBPart( d, dst, w );
+    } );
 }
 
-BitmapPtr BlockData::DecodeRGBA()
+void BlockData::DecodeRGBA( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format )
 {
-    auto ret = std::make_shared<Bitmap>( m_size );
-
-    const uint64_t* src = (const uint64_t*)( m_data + m_dataOffset );
-    uint32_t* dst = ret->Data();
-
-    for( int y=0; y<m_size.y/4; y++ )
+    DecodeBlocks( src, blocks, dst, stride, format, true, []( const uint64_t*& src, uint32_t* dst, uint32_t w )
     {
-        for( int x=0; x<m_size.x/4; x++ )
-        {
-            uint64_t a = *src++;
-            uint64_t d = *src++;
-            DecodeRGBAPart( d, a, dst, m_size.x );
-            dst += 4;
-        }
-        dst += m_size.x*3;
-    }
-
-    return ret;
+        uint64_t a = *src++;
+        uint64_t d = *src++;
+        DecodeRGBAPart( d, a, dst, w );
+    } );
 }
 
 static etcpak_force_inline void DecodeDxt1Part( uint64_t d, uint32_t* dst, uint32_t w )
@@ -1252,45 +1924,45 @@ static etcpak_force_inline void DecodeDxt5Part( uint64_t a, uint64_t d, uint32_t
     dst[3] = dict[idx & 0x3] | adict[aidx & 0x7];
 }
 
-BitmapPtr BlockData::DecodeDxt1()
+void BlockData::DecodeDxt1( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format )
 {
-    auto ret = std::make_shared<Bitmap>( m_size );
-
-    const uint64_t* src = (const uint64_t*)( m_data + m_dataOffset );
-    uint32_t* dst = ret->Data();
-
-    for( int y=0; y<m_size.y/4; y++ )
+    DecodeBlocks( src, blocks, dst, stride, format, false, []( const uint64_t*& src, uint32_t* dst, uint32_t w )
     {
-        for( int x=0; x<m_size.x/4; x++ )
-        {
-            uint64_t d = *src++;
-            DecodeDxt1Part( d, dst, m_size.x );
-            dst += 4;
-        }
-        dst += m_size.x*3;
-    }
-
-    return ret;
+        uint64_t d = *src++;
+        DecodeDxt1Part( d, dst, w );
+    } );
 }
 
-BitmapPtr BlockData::DecodeDxt5()
+void BlockData::DecodeDxt5( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format )
 {
-    auto ret = std::make_shared<Bitmap>( m_size );
-
-    const uint64_t* src = (const uint64_t*)( m_data + m_dataOffset );
-    uint32_t* dst = ret->Data();
+    DecodeBlocks( src, blocks, dst, stride, format, true, []( const uint64_t*& src, uint32_t* dst, uint32_t w )
+    {
+        uint64_t a = *src++;
+        uint64_t d = *src++;
+        DecodeDxt5Part( a, d, dst, w );
+    } );
+}
 
-    for( int y=0; y<m_size.y/4; y++ )
+void BlockData::DecodeBc6h( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format )
+{
+    DecodeBlocks( src, blocks, dst, stride, format, false, []( const uint64_t*& src, uint32_t* dst, uint32_t w )
     {
-        for( int x=0; x<m_size.x/4; x++ )
+        uint64_t px[4*4];
+        ::DecodeBc6h( src, px, 4 );
+        src += 2;
+        for( int y=0; y<4; y++ )
         {
-            uint64_t a = *src++;
-            uint64_t d = *src++;
-            DecodeDxt5Part( a, d, dst, m_size.x );
-            dst += 4;
+            for( int x=0; x<4; x++ )
+            {
+                uint32_t c = 0xFF000000;
+                for( int i=0; i<3; i++ )
+                {
+                    const float v = std::min( 1.f, HalfToFloat( uint16_t( px[y*4+x] >> ( i * 16 ) ) ) );
+                    const float srgb = v <= 0.0031308f ? v * 12.92f : 1.055f * powf( v, 1 / 2.4f ) - 0.055f;
+                    c |= uint32_t( srgb * 255 + 0.5f ) << ( i * 8 );
+                }
+                dst[y*w+x] = c;
+            }
         }
-        dst += m_size.x*3;
-    }
-
-    return ret;
+    } );
 }
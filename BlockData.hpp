@@ -1,7 +1,9 @@
 #ifndef __BLOCKDATA_HPP__
 #define __BLOCKDATA_HPP__
 
+#include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
@@ -10,9 +12,15 @@
 #include <vector>
 
 #include "Bitmap.hpp"
+#include "BlockOrder.hpp"
 #include "ForceInline.hpp"
 #include "Vector.hpp"
 
+class AsyncWriter;
+class BitmapHdr;
+class Progress;
+class StreamWriter;
+
 class BlockData
 {
 public:
@@ -22,26 +30,103 @@ public:
         Etc2_RGB,
         Etc2_RGBA,
         Dxt1,
-        Dxt5
+        Dxt5,
+        Bc6h        // unsigned, from half float pixels
     };
 
+    enum Format
+    {
+        RGBA8,
+        BGRA8,
+        RGB8,
+        R8          // alpha of RGBA types, red of RGB types (as written by -a)
+    };
+
+    enum WriteMode
+    {
+        Mmap,           // shared mapping of the output file, faulted in by workers
+        MmapPopulate,   // as above, with the mapping prefaulted at creation
+        Pwrite,         // private buffer, each processed range written with pwrite()
+        Async,          // private buffer, processed ranges queued on an AsyncWriter
+        Stream          // private buffer, emitted in order to a pipe or socket ("-" is stdout)
+    };
+
+    // Called on the worker thread that finishes the last block of a level
+    typedef std::function<void(int level)> LevelCallback;
+
     BlockData( const char* fn );
-    BlockData( const char* fn, const v2i& size, bool mipmap, Type type );
-    BlockData( const v2i& size, bool mipmap, Type type );
+    // A non-linear block order is recorded in the PVR metadata. Check
+    // IsOpen(), the output file may not be writable.
+    BlockData( const char* fn, const v2i& size, bool mipmap, Type type, WriteMode mode = Mmap, const BlockOrder& order = BlockOrder() );
+    BlockData( int fd, const v2i& size, bool mipmap, Type type, const BlockOrder& order = BlockOrder() );
+    BlockData( const v2i& size, bool mipmap, Type type, const BlockOrder& order = BlockOrder() );
     ~BlockData();
 
     BitmapPtr Decode();
+    void Decode( uint8_t* dst, size_t stride, Format format );
+    void Decode( uint8_t* dst, size_t stride, Format format, int level, int firstRow, int rows );
+    std::vector<BitmapPtr> DecodeLevels( Format format = RGBA8 );
+    // Bc6h level as half float pixels. The 8 bit decodes clamp it to 0..1
+    // and convert to sRGB.
+    std::shared_ptr<BitmapHdr> DecodeHdr( int level = 0 );
 
     void Process( const uint32_t* src, uint32_t blocks, size_t offset, size_t width, Channels type, bool dither, bool useHeuristics );
     void ProcessRGBA( const uint32_t* src, uint32_t blocks, size_t offset, size_t width, bool useHeuristics );
+    // Half float RGBA pixels, for Bc6h
+    void ProcessHdr( const uint64_t* src, uint32_t blocks, size_t offset, size_t width );
+    // Raw level 0 blocks (two words each in alpha types and Bc6h), in row order
+    // whatever the file's block order. Store() completes the blocks like the
+    // Process functions do.
+    void Store( const uint64_t* src, size_t offset, uint32_t blocks );
+    void Load( uint64_t* dst, size_t offset, uint32_t blocks ) const;
+    // Decodes one block in this file's type to 4x4 pixels (RGBA8 or BGRA8)
+    void DecodeBlock( const uint64_t* src, uint32_t* dst, Format format );
 
     const v2i& Size() const { return m_size; }
+    bool IsOpen() const { return m_data != nullptr; }
+    int Levels() const { return m_levels; }
+    Type BlockType() const { return m_type; }
+    bool IsAlpha() const { return m_type == Etc2_RGBA || m_type == Dxt5; }
+    // 64 bit words per block
+    int BlockWords() const { return BlockWords( m_type ); }
+    static int BlockWords( Type type ) { return ( type == Etc2_RGBA || type == Dxt5 || type == Bc6h ) ? 2 : 1; }
+    v2i LevelSize( int level ) const;
+    const BlockOrder& Order() const { return m_order; }
+    // Header and blocks; mapped in the mmap write modes, heap otherwise
+    size_t DataSize() const { return m_maplen; }
+    WriteMode Mode() const { return m_mode; }
+    size_t NumberOfBlocks() const { return ( m_maplen - m_dataOffset ) / ( BlockWords() * 8 ); }
+    void SetProgress( Progress* progress ) { m_progress = progress; }
+    void SetLevelCallback( const LevelCallback& callback ) { m_levelCallback = callback; }
+    // Mmap modes only: start writeback of every processed range right away,
+    // so dirty output pages can be reclaimed under a tight memory limit
+    void SetEagerWriteback( bool enable ) { m_eagerWriteback = enable; }
+    // Mmap modes only: start writeback of each level as soon as it is done,
+    // so levels completed early reach the file early
+    void SetLevelWriteback( bool enable ) { m_levelWriteback = enable; }
+    // Stream mode only: free the memory of ranges once they are written, so
+    // the buffer in use stays about as large as the reorder window. Written
+    // blocks can't be decoded afterwards.
+    void SetReleaseWritten( bool enable );
+    const AsyncWriter* Writer() const { return m_writer.get(); }
+    const StreamWriter* Streamer() const { return m_stream.get(); }
 
 private:
-    etcpak_no_inline BitmapPtr DecodeRGB();
-    etcpak_no_inline BitmapPtr DecodeRGBA();
-    etcpak_no_inline BitmapPtr DecodeDxt1();
-    etcpak_no_inline BitmapPtr DecodeDxt5();
+    void CalcLevelOffsets( bool ktx );
+    void WriteRange( size_t start, size_t len );
+    void Flush( size_t start, size_t len );
+    void CompleteBlocks( size_t start, uint32_t blocks );
+    void CompleteLevel( int level );
+    void StartWriteback( size_t start, size_t len );
+    int LevelOf( size_t offset ) const;
+    void Scatter( const uint64_t* src, size_t offset, uint32_t blocks );
+    void Gather( uint64_t* dst, int level, size_t first, uint32_t blocks ) const;
+
+    etcpak_no_inline void DecodeRGB( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format );
+    etcpak_no_inline void DecodeRGBA( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format );
+    etcpak_no_inline void DecodeDxt1( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format );
+    etcpak_no_inline void DecodeDxt5( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format );
+    etcpak_no_inline void DecodeBc6h( const uint64_t* src, const v2i& blocks, uint8_t* dst, size_t stride, Format format );
 
     uint8_t* m_data;
     v2i m_size;
@@ -49,6 +134,17 @@ private:
     FILE* m_file;
     size_t m_maplen;
     Type m_type;
+    WriteMode m_mode;
+    BlockOrder m_order;
+    int m_levels;
+    std::vector<size_t> m_levelOffset;
+    std::unique_ptr<std::atomic<uint32_t>[]> m_levelPending;
+    LevelCallback m_levelCallback;
+    std::unique_ptr<AsyncWriter> m_writer;
+    std::unique_ptr<StreamWriter> m_stream;
+    Progress* m_progress;
+    bool m_eagerWriteback;
+    bool m_levelWriteback;
 };
 
 typedef std::shared_ptr<BlockData> BlockDataPtr;
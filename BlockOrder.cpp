@@ -0,0 +1,78 @@
+#include <assert.h>
+
+#include "BlockOrder.hpp"
+
+// Blocks of the level within the square of the given size at (x, y)
+static size_t Inside( int x, int y, int size, const v2i& blocks )
+{
+    const int w = std::min( std::max( blocks.x - x, 0 ), size );
+    const int h = std::min( std::max( blocks.y - y, 0 ), size );
+    return size_t( w ) * h;
+}
+
+// Spreads the bits of v to the even bits
+static uint64_t Part1By1( uint32_t v )
+{
+    uint64_t r = v;
+    r = ( r | ( r << 16 ) ) & 0x0000FFFF0000FFFFull;
+    r = ( r | ( r << 8 ) ) & 0x00FF00FF00FF00FFull;
+    r = ( r | ( r << 4 ) ) & 0x0F0F0F0F0F0F0F0Full;
+    r = ( r | ( r << 2 ) ) & 0x3333333333333333ull;
+    r = ( r | ( r << 1 ) ) & 0x5555555555555555ull;
+    return r;
+}
+
+static size_t MortonIndex( int x, int y, const v2i& blocks )
+{
+    int size = 1;
+    while( size < blocks.x || size < blocks.y ) size *= 2;
+
+    // Descend the quadtree of the enclosing square, counting the blocks in
+    // the quadrants that come before the one holding (x, y)
+    size_t idx = 0;
+    int qx = 0;
+    int qy = 0;
+    while( size > 1 )
+    {
+        // Inside the level the curve is plain bit interleaving
+        if( qx + size <= blocks.x && qy + size <= blocks.y )
+        {
+            return idx + size_t( Part1By1( y - qy ) << 1 | Part1By1( x - qx ) );
+        }
+        const int half = size / 2;
+        const int sx = x >= qx + half ? 1 : 0;
+        const int sy = y >= qy + half ? 1 : 0;
+        if( sx | sy ) idx += Inside( qx, qy, half, blocks );
+        if( sy )
+        {
+            idx += Inside( qx + half, qy, half, blocks );
+            if( sx ) idx += Inside( qx, qy + half, half, blocks );
+        }
+        qx += sx * half;
+        qy += sy * half;
+        size = half;
+    }
+    return idx;
+}
+
+size_t BlockOrder::Index( int x, int y, const v2i& blocks ) const
+{
+    assert( x < blocks.x && y < blocks.y );
+
+    switch( mode )
+    {
+    case Morton:
+        return MortonIndex( x, y, blocks );
+    case Tiled:
+    {
+        assert( tile > 0 );
+        const int tx = x / tile * tile;
+        const int ty = y / tile * tile;
+        const int tw = std::min( tile, blocks.x - tx );
+        const int th = std::min( tile, blocks.y - ty );
+        return size_t( ty ) * blocks.x + size_t( tx ) * th + size_t( y - ty ) * tw + ( x - tx );
+    }
+    default:
+        return size_t( y ) * blocks.x + x;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __BLOCKORDER_HPP__
+#define __BLOCKORDER_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Vector.hpp"
+
+// Order of the blocks within each level of an output file.
+//
+// Morton is Z-order over the whole level. When the level isn't a power of two
+// square, the curve skips the positions outside of it, so the blocks stay
+// packed; a power of two square gets plain bit interleaving.
+//
+// Tiled stores squares of tile x tile blocks one after another, in rows, with
+// the blocks of a square in rows too. Squares at the right and bottom edges
+// are cut down to what is left of the level.
+struct BlockOrder
+{
+    enum Mode
+    {
+        Linear,
+        Morton,
+        Tiled
+    };
+
+    BlockOrder( Mode mode = Linear, int tile = 0 ) : mode( mode ), tile( tile ) {}
+
+    bool IsLinear() const { return mode == Linear; }
+    // Place of block (x, y) in a level of blocks.x by blocks.y blocks
+    size_t Index( int x, int y, const v2i& blocks ) const;
+
+    Mode mode;
+    int tile;       // edge of a tile in blocks, Tiled only
+};
+
+#endif
@@ -0,0 +1,4 @@
+#include "BlockWriter.hpp"
+
+bool stream_stores = false;
+bool prefetch_rows = false;
@@ -0,0 +1,121 @@
+#ifndef __BLOCKWRITER_HPP__
+#define __BLOCKWRITER_HPP__
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined __SSE2__ || defined _M_X64 || ( defined _M_IX86_FP && _M_IX86_FP >= 2 )
+#  include <emmintrin.h>
+#  define ETCPAK_STREAM_STORES
+#endif
+
+#include "ForceInline.hpp"
+
+// Compress* driver switches, set before compression starts. Streaming stores
+// write the blocks around the cache, so output lines aren't read in just to
+// be overwritten; worth it when the output isn't read again soon (mmap
+// writes). Prefetching pulls in the source lines of the next block row.
+extern bool stream_stores;
+extern bool prefetch_rows;
+
+// Output of a Compress* driver. With streaming stores, blocks are gathered
+// in a copy of the destination cache line, and each completed line is
+// written out with non-temporal stores. The partial lines at either end of
+// the output may be shared with other ranges and get ordinary stores.
+class BlockWriter
+{
+public:
+    explicit BlockWriter( uint64_t* dst )
+        : m_dst( dst )
+#ifdef ETCPAK_STREAM_STORES
+        , m_stream( stream_stores )
+        , m_base( (uint8_t*)( uintptr_t( dst ) & ~uintptr_t( LineSize - 1 ) ) )
+        , m_first( int( uintptr_t( dst ) & ( LineSize - 1 ) ) )
+        , m_fill( m_first )
+#else
+        , m_stream( false )
+#endif
+    {
+    }
+
+    ~BlockWriter()
+    {
+#ifdef ETCPAK_STREAM_STORES
+        if( !m_stream ) return;
+        memcpy( m_base + m_first, m_line + m_first, m_fill - m_first );
+        // Streaming stores are weakly ordered, finish them before the blocks are reported done
+        _mm_sfence();
+#endif
+    }
+
+    BlockWriter( const BlockWriter& ) = delete;
+    BlockWriter& operator=( const BlockWriter& ) = delete;
+
+    etcpak_force_inline void Store( uint64_t v )
+    {
+#ifdef ETCPAK_STREAM_STORES
+        if( m_stream )
+        {
+            // Blocks aren't necessarily 8 byte aligned (the pvr header is 52 bytes)
+            const int head = std::min<int>( sizeof( uint64_t ), LineSize - m_fill );
+            memcpy( m_line + m_fill, &v, head );
+            m_fill += head;
+            if( m_fill == LineSize )
+            {
+                Flush();
+                memcpy( m_line, (const uint8_t*)&v + head, sizeof( uint64_t ) - head );
+                m_fill = sizeof( uint64_t ) - head;
+            }
+            return;
+        }
+#endif
+        memcpy( m_dst++, &v, sizeof( uint64_t ) );
+    }
+
+private:
+#ifdef ETCPAK_STREAM_STORES
+    enum { LineSize = 64 };
+
+    etcpak_force_inline void Flush()
+    {
+        if( m_first == 0 )
+        {
+            for( int i=0; i<LineSize; i+=16 ) _mm_stream_si128( (__m128i*)( m_base + i ), _mm_load_si128( (const __m128i*)( m_line + i ) ) );
+        }
+        else
+        {
+            memcpy( m_base + m_first, m_line + m_first, LineSize - m_first );
+            m_first = 0;
+        }
+        m_base += LineSize;
+    }
+#endif
+
+    uint64_t* m_dst;
+    bool m_stream;
+#ifdef ETCPAK_STREAM_STORES
+    uint8_t* m_base;
+    int m_first;
+    int m_fill;
+    alignas( 16 ) uint8_t m_line[LineSize];
+#endif
+};
+
+// Called with the source pixels of block w in its block row. Once per cache
+// line of source (four blocks), prefetches those columns of the next row.
+static etcpak_force_inline void PrefetchNextRow( const uint32_t* src, size_t width, int w )
+{
+    if( !prefetch_rows || ( w & 3 ) != 0 ) return;
+    for( int i=4; i<8; i++ )
+    {
+#if defined __GNUC__
+        __builtin_prefetch( src + width * i );
+#elif defined ETCPAK_STREAM_STORES
+        _mm_prefetch( (const char*)( src + width * i ), _MM_HINT_T0 );
+#endif
+    }
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <utility>
+
+#include "CostScheduler.hpp"
+
+static uint32_t BlockCost( const uint32_t* src, unsigned int width )
+{
+    const uint32_t first = src[0] & 0xFFFFFF;
+    bool solid = true;
+    int lmin = 1024, lmax = 0;
+    for( int y=0; y<4; y++ )
+    {
+        for( int x=0; x<4; x++ )
+        {
+            const uint32_t c = src[x];
+            solid &= ( c & 0xFFFFFF ) == first;
+            // Symmetric in r and b, so the channel order doesn't matter
+            const int l = ( c & 0xFF ) + ( ( c >> 7 ) & 0x1FE ) + ( ( c >> 16 ) & 0xFF );
+            lmin = std::min( lmin, l );
+            lmax = std::max( lmax, l );
+        }
+        src += width;
+    }
+    if( solid ) return 1;
+    // Luma range steps mirror SelectModeETC2(): low contrast blocks resolve
+    // in planar mode, mid contrast in ETC1 modes, the rest searches T/H
+    const int range = ( lmax - lmin ) / 4;
+    if( range <= 8 ) return 3;
+    if( range <= 96 ) return 6;
+    return 16;
+}
+
+std::vector<uint32_t> EstimateRowCosts( const DataPart& part )
+{
+    std::vector<uint32_t> ret( part.lines );
+    auto src = part.src;
+    for( unsigned int i=0; i<part.lines; i++ )
+    {
+        uint32_t cost = 0;
+        for( unsigned int x=0; x<part.width; x+=4 )
+        {
+            cost += BlockCost( src + x, part.width );
+        }
+        ret[i] = cost;
+        src += part.width * 4;
+    }
+    return ret;
+}
+
+std::vector<DataPart> ScheduleByCost( const std::vector<DataPart>& parts, unsigned int workers )
+{
+    std::vector<std::pair<uint64_t, DataPart>> pieces;
+    std::vector<std::vector<uint32_t>> costs;
+    costs.reserve( parts.size() );
+
+    uint64_t total = 0;
+    for( auto& part : parts )
+    {
+        costs.emplace_back( EstimateRowCosts( part ) );
+        for( auto& v : costs.back() ) total += v;
+    }
+
+    // A few pieces per worker leave room to balance the tail
+    const uint64_t target = std::max<uint64_t>( 1, total / ( workers * 4 ) );
+
+    for( size_t i=0; i<parts.size(); i++ )
+    {
+        const auto& part = parts[i];
+        const auto& rows = costs[i];
+
+        unsigned int first = 0;
+        uint64_t cost = 0;
+        for( unsigned int row=0; row<part.lines; row++ )
+        {
+            cost += rows[row];
+            if( row == part.lines - 1 || cost >= target )
+            {
+                DataPart piece = part;
+                piece.src = part.src + part.width * 4 * first;
+                piece.lines = row + 1 - first;
+                piece.offset = part.offset + part.width / 4 * first;
+                pieces.emplace_back( cost, piece );
+                first = row + 1;
+                cost = 0;
+            }
+        }
+    }
+
+    // Queue cheapest first: the dispatcher pops from the back
+    std::stable_sort( pieces.begin(), pieces.end(), []( const std::pair<uint64_t, DataPart>& l, const std::pair<uint64_t, DataPart>& r ) { return l.first < r.first; } );
+
+    std::vector<DataPart> ret;
+    ret.reserve( pieces.size() );
+    for( auto& v : pieces ) ret.emplace_back( v.second );
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef __COSTSCHEDULER_HPP__
+#define __COSTSCHEDULER_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+#include "DataProvider.hpp"
+
+// Relative compression cost of each block row of a part. Solid blocks take
+// the early-out path; the rest get costlier with their luma range, as wide
+// ranges are what sends the ETC2 heuristics into the T/H mode searches.
+std::vector<uint32_t> EstimateRowCosts( const DataPart& part );
+
+// Reorders parts for the LIFO TaskDispatch queue so that the most expensive
+// work is picked up first, and splits parts that cost well over an even
+// share per worker into smaller pieces along block rows.
+std::vector<DataPart> ScheduleByCost( const std::vector<DataPart>& parts, unsigned int workers );
+
+#endif
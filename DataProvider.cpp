@@ -5,28 +5,98 @@
 #include "DataProvider.hpp"
 #include "MipMap.hpp"
 
-DataProvider::DataProvider( const char* fn, bool mipmap, bool bgr, bool linearize )
-    : m_offset( 0 )
+DataProvider::DataProvider( const char* fn, bool mipmap, bool bgr, bool linearize, Order order, Bitmap::Storage storage )
+    : m_level( 0 )
+    , m_order( mipmap ? order : LargestFirst )
+    , m_offset( 0 )
     , m_lines( 32 )
     , m_mipmap( mipmap )
     , m_done( false )
     , m_linearize( linearize )
+    , m_consumers( 0 )
+    , m_mipBytes( 0 )
 {
-    m_bmp.emplace_back( new Bitmap( fn, m_lines, bgr ) );
-    m_current = m_bmp[0].get();
+    m_bmp.emplace_back( new Bitmap( fn, m_lines, bgr, storage ) );
+    Init();
+}
+
+DataProvider::DataProvider( const uint8_t* data, size_t size, bool mipmap, bool bgr, bool linearize, Order order, Bitmap::Storage storage )
+    : m_level( 0 )
+    , m_order( mipmap ? order : LargestFirst )
+    , m_offset( 0 )
+    , m_lines( 32 )
+    , m_mipmap( mipmap )
+    , m_done( false )
+    , m_linearize( linearize )
+    , m_consumers( 0 )
+    , m_mipBytes( 0 )
+{
+    m_bmp.emplace_back( new Bitmap( data, size, m_lines, bgr, storage ) );
+    Init();
 }
 
 DataProvider::~DataProvider()
 {
 }
 
+void DataProvider::Init()
+{
+    m_current = m_bmp[0].get();
+    m_size = m_current->Size();
+    m_alpha = m_current->Alpha();
+    m_outOfCore = m_current->OutOfCore();
+    m_sourceBytes = size_t( m_size.x ) * m_size.y * sizeof( uint32_t );
+
+    // Levels are never reallocated, so Release() can look at them while
+    // NextPart() adds new ones
+    const int levels = m_mipmap && m_size.x > 0 ? NumberOfMipLevels( m_size ) : 1;
+    m_bmp.reserve( levels );
+    m_released.resize( levels, 0 );
+}
+
+void DataProvider::AddLevel()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_lines *= 2;
+    m_bmp.emplace_back( new BitmapDownsampled( *m_current, m_lines, m_linearize ) );
+    m_current = m_bmp.back().get();
+    m_mipBytes += size_t( std::max( 4, m_current->Size().x ) ) * std::max( 4, m_current->Size().y ) * sizeof( uint32_t );
+    ReleaseFinished();
+}
+
+void DataProvider::Release( int level )
+{
+    if( m_consumers == 0 ) return;
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_released[level]++;
+    ReleaseFinished();
+}
+
+void DataProvider::ReleaseFinished()
+{
+    if( m_consumers == 0 ) return;
+    const int levels = int( m_released.size() );
+    const int built = int( m_bmp.size() );
+    for( int i=0; i<built; i++ )
+    {
+        if( !m_bmp[i] || m_released[i] < m_consumers ) continue;
+        if( i+1 < levels )
+        {
+            // Still the source of the next level
+            if( i+1 >= built ) continue;
+            if( m_bmp[i+1] && !m_bmp[i+1]->Loaded() ) continue;
+        }
+        m_bmp[i].reset();
+    }
+}
+
 unsigned int DataProvider::NumberOfParts() const
 {
-    unsigned int parts = ( ( m_bmp[0]->Size().y / 4 ) + m_lines - 1 ) / m_lines;
+    unsigned int parts = ( ( m_size.y / 4 ) + m_lines - 1 ) / m_lines;
 
     if( m_mipmap )
     {
-        v2i current = m_bmp[0]->Size();
+        v2i current = m_size;
         int levels = NumberOfMipLevels( current );
         unsigned int lines = m_lines;
         for( int i=1; i<levels; i++ )
@@ -43,10 +113,30 @@ unsigned int DataProvider::NumberOfParts() const
     return parts;
 }
 
+void DataProvider::BuildPyramid()
+{
+    while( m_current->Size().x != 1 || m_current->Size().y != 1 )
+    {
+        AddLevel();
+    }
+
+    // Parts are emitted out of order, but still land at their level's place in the file
+    unsigned int offset = 0;
+    for( auto& bmp : m_bmp )
+    {
+        m_levelOffset.emplace_back( offset );
+        offset += std::max( 4, bmp->Size().x ) / 4 * ( std::max( 4, bmp->Size().y ) / 4 );
+    }
+
+    m_level = int( m_bmp.size() ) - 1;
+}
+
 DataPart DataProvider::NextPart()
 {
     assert( !m_done );
 
+    if( m_order == SmallestFirst && m_levelOffset.empty() ) BuildPyramid();
+
     unsigned int lines = m_lines;
     bool done;
 
@@ -55,18 +145,30 @@ DataPart DataProvider::NextPart()
         ptr,
         std::max<unsigned int>( 4, m_current->Size().x ),
         lines,
-        m_offset
+        m_order == SmallestFirst ? m_levelOffset[m_level] + m_offset : m_offset,
+        m_level
     };
 
-    m_offset += m_current->Size().x / 4 * lines;
+    m_offset += std::max( 4, m_current->Size().x ) / 4 * lines;
 
     if( done )
     {
-        if( m_mipmap && ( m_current->Size().x != 1 || m_current->Size().y != 1 ) )
+        if( m_order == SmallestFirst )
+        {
+            if( m_level == 0 )
+            {
+                m_done = true;
+            }
+            else
+            {
+                m_current = m_bmp[--m_level].get();
+                m_offset = 0;
+            }
+        }
+        else if( m_mipmap && ( m_current->Size().x != 1 || m_current->Size().y != 1 ) )
         {
-            m_lines *= 2;
-            m_bmp.emplace_back( new BitmapDownsampled( *m_current, m_lines, m_linearize ) );
-            m_current = m_bmp[m_bmp.size()-1].get();
+            m_level++;
+            AddLevel();
         }
         else
         {
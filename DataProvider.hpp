@@ -1,7 +1,9 @@
 #ifndef __DATAPROVIDER_HPP__
 #define __DATAPROVIDER_HPP__
 
+#include <assert.h>
 #include <memory>
+#include <mutex>
 #include <stdint.h>
 #include <vector>
 
@@ -13,30 +15,67 @@ struct DataPart
     unsigned int width;
     unsigned int lines;
     unsigned int offset;
+    int level;
 };
 
 class DataProvider
 {
 public:
-    DataProvider( const char* fn, bool mipmap, bool bgr, bool linearize );
+    enum Order
+    {
+        LargestFirst,   // level 0 first, each mip generated when the previous one is done
+        SmallestFirst   // whole pyramid generated up front, then parts from the 1x1 level up
+    };
+
+    DataProvider( const char* fn, bool mipmap, bool bgr, bool linearize, Order order = LargestFirst, Bitmap::Storage storage = Bitmap::Heap );
+    DataProvider( const uint8_t* data, size_t size, bool mipmap, bool bgr, bool linearize, Order order = LargestFirst, Bitmap::Storage storage = Bitmap::Heap );
     ~DataProvider();
 
     unsigned int NumberOfParts() const;
 
     DataPart NextPart();
 
-    bool Alpha() const { return m_bmp[0]->Alpha(); }
-    const v2i& Size() const { return m_bmp[0]->Size(); }
-    const Bitmap& ImageData() const { return *m_bmp[0]; }
+    // With release enabled, each level is freed once all consumers have
+    // called Release() for it and the next level has been downsampled from
+    // it. ImageData() of a freed level must not be used. Release() may be
+    // called from any thread.
+    void EnableRelease( int consumers ) { m_consumers = consumers; }
+    void Release( int level );
+
+    bool Alpha() const { return m_alpha; }
+    const v2i& Size() const { return m_size; }
+    const Bitmap& ImageData() const { return ImageData( 0 ); }
+    const Bitmap& ImageData( int level ) const { assert( m_bmp[level] ); return *m_bmp[level]; }
+    int NumberOfLevels() const { return (int)m_bmp.size(); }
+
+    bool OutOfCore() const { return m_outOfCore; }
+    size_t SourceBytes() const { return m_sourceBytes; }
+    size_t MipBytes() const { return m_mipBytes; }
 
 private:
+    void Init();
+    void BuildPyramid();
+    void AddLevel();
+    void ReleaseFinished();
+
     std::vector<std::unique_ptr<Bitmap>> m_bmp;
+    std::vector<int> m_released;
+    std::vector<unsigned int> m_levelOffset;
     Bitmap* m_current;
+    int m_level;
+    Order m_order;
     unsigned int m_offset;
     unsigned int m_lines;
     bool m_mipmap;
     bool m_done;
     bool m_linearize;
+    v2i m_size;
+    bool m_alpha;
+    bool m_outOfCore;
+    int m_consumers;
+    size_t m_sourceBytes;
+    size_t m_mipBytes;
+    std::mutex m_lock;
 };
 
 #endif
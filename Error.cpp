@@ -1,31 +1,66 @@
+#include <math.h>
 #include <stdint.h>
+#include <stdlib.h>
 
+#include "BitmapHdr.hpp"
 #include "Error.hpp"
+#include "Half.hpp"
 #include "Math.hpp"
 
 float CalcMSE3( const Bitmap& bmp, const Bitmap& out )
 {
-    float err = 0;
+    return CalcMSE3( bmp.Data(), bmp.Size().x, out.Data(), out.Size().x, bmp.Size() );
+}
 
-    const uint32_t* p1 = bmp.Data();
-    const uint32_t* p2 = out.Data();
-    size_t cnt = bmp.Size().x * bmp.Size().y;
+float CalcMSE3( const uint32_t* p1, size_t stride1, const uint32_t* p2, size_t stride2, const v2i& size )
+{
+    float err = 0;
 
-    for( size_t i=0; i<cnt; i++ )
+    for( int y=0; y<size.y; y++ )
     {
-        uint32_t c1 = *p1++;
-        uint32_t c2 = *p2++;
+        for( int x=0; x<size.x; x++ )
+        {
+            uint32_t c1 = p1[x];
+            uint32_t c2 = p2[x];
 
-        err += sq( ( c1 & 0x000000FF ) - ( c2 & 0x000000FF ) );
-        err += sq( ( ( c1 & 0x0000FF00 ) >> 8 ) - ( ( c2 & 0x0000FF00 ) >> 8 ) );
-        err += sq( ( ( c1 & 0x00FF0000 ) >> 16 ) - ( ( c2 & 0x00FF0000 ) >> 16 ) );
+            err += sq( ( c1 & 0x000000FF ) - ( c2 & 0x000000FF ) );
+            err += sq( ( ( c1 & 0x0000FF00 ) >> 8 ) - ( ( c2 & 0x0000FF00 ) >> 8 ) );
+            err += sq( ( ( c1 & 0x00FF0000 ) >> 16 ) - ( ( c2 & 0x00FF0000 ) >> 16 ) );
+        }
+        p1 += stride1;
+        p2 += stride2;
     }
 
-    err /= cnt * 3;
+    err /= size.x * size.y * 3;
 
     return err;
 }
 
+float CalcLogMSE3( const BitmapHdr& bmp, const BitmapHdr& out )
+{
+    double err = 0;
+
+    // Levels that aren't a multiple of 4 have edge pixels no block covers
+    const auto& full = bmp.Size();
+    const v2i size( std::min( full.x, std::max( 4, full.x ) / 4 * 4 ), std::min( full.y, std::max( 4, full.y ) / 4 * 4 ) );
+    for( int y=0; y<size.y; y++ )
+    {
+        const uint64_t* p1 = bmp.Data() + y * bmp.Stride();
+        const uint64_t* p2 = out.Data() + y * out.Stride();
+        for( int x=0; x<size.x; x++ )
+        {
+            for( int c=0; c<3; c++ )
+            {
+                const float v1 = std::max( 0.f, HalfToFloat( uint16_t( p1[x] >> ( c * 16 ) ) ) );
+                const float v2 = std::max( 0.f, HalfToFloat( uint16_t( p2[x] >> ( c * 16 ) ) ) );
+                err += sq( log2f( 1 + v1 ) - log2f( 1 + v2 ) );
+            }
+        }
+    }
+
+    return float( err / ( double( size.x ) * size.y * 3 ) );
+}
+
 float CalcMSE1( const Bitmap& bmp, const Bitmap& out )
 {
     float err = 0;
@@ -46,3 +81,38 @@ float CalcMSE1( const Bitmap& bmp, const Bitmap& out )
 
     return err;
 }
+
+void CalcErrorStats( const uint32_t* p1, size_t stride1, const uint32_t* p2, size_t stride2, const v2i& size, bool alpha, ErrorStats& stats )
+{
+    const uint32_t mask = alpha ? 0xFFFFFFFF : 0x00FFFFFF;
+    const int channels = alpha ? 4 : 3;
+    for( int by=0; by<size.y; by+=4 )
+    {
+        const auto h = std::min( 4, size.y - by );
+        for( int bx=0; bx<size.x; bx+=4 )
+        {
+            const auto w = std::min( 4, size.x - bx );
+            bool diff = false;
+            for( int y=0; y<h; y++ )
+            {
+                auto c1 = p1 + ( by + y ) * stride1 + bx;
+                auto c2 = p2 + ( by + y ) * stride2 + bx;
+                for( int x=0; x<w; x++ )
+                {
+                    if( ( c1[x] & mask ) == ( c2[x] & mask ) ) continue;
+                    diff = true;
+                    for( int c=0; c<channels; c++ )
+                    {
+                        const int32_t v1 = ( c1[x] >> ( c * 8 ) ) & 0xFF;
+                        const int32_t v2 = ( c2[x] >> ( c * 8 ) ) & 0xFF;
+                        const uint32_t d = std::abs( v1 - v2 );
+                        stats.sq[c] += d * d;
+                        stats.max = std::max( stats.max, d );
+                    }
+                }
+            }
+            stats.blocks++;
+            if( diff ) stats.diffBlocks++;
+        }
+    }
+}
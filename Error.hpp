@@ -3,7 +3,24 @@
 
 #include "Bitmap.hpp"
 
+class BitmapHdr;
+
 float CalcMSE3( const Bitmap& bmp, const Bitmap& out );
+float CalcMSE3( const uint32_t* p1, size_t stride1, const uint32_t* p2, size_t stride2, const v2i& size );
 float CalcMSE1( const Bitmap& bmp, const Bitmap& out );
+// Of log2( 1 + v ) in the RGB channels, so errors count relative to the
+// value above 1 and absolute below. Only pixels inside whole blocks count.
+float CalcLogMSE3( const BitmapHdr& bmp, const BitmapHdr& out );
+
+struct ErrorStats
+{
+    uint64_t sq[4];         // sum of squared differences, per channel
+    uint32_t max;           // largest single channel difference
+    uint32_t blocks;
+    uint32_t diffBlocks;    // 4x4 blocks with at least one differing pixel
+};
+
+// Without alpha, only the RGB channels are compared and counted
+void CalcErrorStats( const uint32_t* p1, size_t stride1, const uint32_t* p2, size_t stride2, const v2i& size, bool alpha, ErrorStats& stats );
 
 #endif
@@ -0,0 +1,865 @@
+#include <algorithm>
+#include <array>
+#include <assert.h>
+#include <limits>
+#include <math.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+
+#include "BitmapDownsampled.hpp"
+#include "BlockData.hpp"
+#include "Etc1s.hpp"
+#include "ForceInline.hpp"
+#include "Math.hpp"
+#include "MipMap.hpp"
+#include "Tables.hpp"
+#include "TaskDispatch.hpp"
+
+enum { Etc1sMagic = 0x53315445 };       // "ET1S"
+enum { Etc1sVersion = 1 };
+enum { HeaderWords = 7 };
+
+// Blocks per clustering task, and the most tasks a pass is split into
+enum { TaskBlocks = 8192 };
+enum { MaxTasks = 64 };
+enum { Iterations = 3 };
+
+template<int D>
+using Point = std::array<float, D>;
+
+// Tasks of at least grain items that [0, n) is split into
+static size_t NumberOfTasks( size_t n, size_t grain = TaskBlocks )
+{
+    return std::min<size_t>( MaxTasks, std::max<size_t>( 1, n / grain ) );
+}
+
+// Runs f( begin, end, task ) over [0, n) in tasks of at least grain items on
+// the TaskDispatch, and waits for them
+template<class F>
+static void ParallelFor( size_t n, size_t grain, const F& f )
+{
+    const auto tasks = NumberOfTasks( n, grain );
+    for( size_t i=0; i<tasks; i++ )
+    {
+        const auto begin = n * i / tasks;
+        const auto end = n * ( i+1 ) / tasks;
+        TaskDispatch::Queue( [&f, begin, end, i] { f( begin, end, i ); } );
+    }
+    TaskDispatch::Sync();
+}
+
+static etcpak_force_inline int Expand5( int v )
+{
+    return ( v << 3 ) | ( v >> 2 );
+}
+
+// 5 bit value expanding nearest to v
+static int Quantize5( float v )
+{
+    const int q = std::min( 31, std::max( 0, int( v * 31 / 255 + 0.5f ) ) );
+    int best = q;
+    for( int i=std::max( 0, q-1 ); i<=std::min( 31, q+1 ); i++ )
+    {
+        if( fabs( Expand5( i ) - v ) < fabs( Expand5( best ) - v ) ) best = i;
+    }
+    return best;
+}
+
+// Modifiers of a table, indexed by selector (in increasing order)
+static etcpak_force_inline void Modifiers( int table, int* mod )
+{
+    mod[0] = g_table[table][3];
+    mod[1] = g_table[table][2];
+    mod[2] = g_table[table][0];
+    mod[3] = g_table[table][1];
+}
+
+// Picks the selectors of 16 RGBA pixels for a base color and table and
+// returns the error (of unclamped colors). sel may be null.
+static uint32_t FitSelectors( const uint32_t* px, const int* base, int table, uint8_t* sel )
+{
+    int mod[4];
+    Modifiers( table, mod );
+    // Modifiers are added to all channels, the nearest one to the mean
+    // difference wins; compare three times the difference to the midpoints
+    const int t0 = ( mod[0] + mod[1] ) * 3;
+    const int t2 = ( mod[2] + mod[3] ) * 3;
+
+    uint32_t err = 0;
+    for( int i=0; i<16; i++ )
+    {
+        const int dr = int( px[i] & 0xFF ) - base[0];
+        const int dg = int( ( px[i] >> 8 ) & 0xFF ) - base[1];
+        const int db = int( ( px[i] >> 16 ) & 0xFF ) - base[2];
+        const int d2 = ( dr + dg + db ) * 2;
+        const int s = d2 < 0 ? ( d2 < t0 ? 0 : 1 ) : ( d2 < t2 ? 2 : 3 );
+        const int m = mod[s];
+        err += ( dr - m ) * ( dr - m ) + ( dg - m ) * ( dg - m ) + ( db - m ) * ( db - m );
+        if( sel ) sel[i] = uint8_t( s );
+    }
+    return err;
+}
+
+static etcpak_force_inline void ExpandEndpoint( const Etc1sData::Endpoint& e, int* base )
+{
+    base[0] = Expand5( e.r );
+    base[1] = Expand5( e.g );
+    base[2] = Expand5( e.b );
+}
+
+// Centroids with the few nearest others of each. A point is only moved from
+// its cluster to one of the neighbours, which keeps a pass over the points
+// linear in their number; the assignment it starts from (from the splits or
+// the previous pass) is never far off.
+template<int D>
+class Clusters
+{
+public:
+    enum { Neighbours = 16 };
+
+    Clusters( const std::vector<Point<D>>& centroids )
+        : m_points( centroids )
+        , m_num( std::min<size_t>( Neighbours, centroids.size() ) )
+        , m_neighbours( centroids.size() * m_num )
+    {
+        const auto n = centroids.size();
+        ParallelFor( n, RowsPerTask, [this, n]( size_t begin, size_t end, size_t )
+        {
+            std::vector<std::pair<float, uint32_t>> dist( n );
+            for( size_t i=begin; i<end; i++ )
+            {
+                for( size_t j=0; j<n; j++ ) dist[j] = std::make_pair( Distance( m_points[i], m_points[j] ), uint32_t( j ) );
+                std::partial_sort( dist.begin(), dist.begin() + m_num, dist.end() );
+                for( size_t j=0; j<m_num; j++ ) m_neighbours[i * m_num + j] = dist[j].second;
+            }
+        } );
+    }
+
+    uint32_t Nearest( const Point<D>& p, uint32_t guess ) const
+    {
+        auto idx = guess;
+        auto best = Distance( p, m_points[guess] );
+        for( size_t i=0; i<m_num; i++ )
+        {
+            const auto c = m_neighbours[guess * m_num + i];
+            const auto d = Distance( p, m_points[c] );
+            if( d < best )
+            {
+                best = d;
+                idx = c;
+            }
+        }
+        return idx;
+    }
+
+private:
+    enum { RowsPerTask = 64 };
+
+    static etcpak_force_inline float Distance( const Point<D>& a, const Point<D>& b )
+    {
+        float sum = 0;
+        for( int i=0; i<D; i++ ) sum += sq( a[i] - b[i] );
+        return sum;
+    }
+
+    std::vector<Point<D>> m_points;
+    size_t m_num;
+    std::vector<uint32_t> m_neighbours;
+};
+
+template<int D>
+static Point<D> Mean( const std::vector<Point<D>>& points, const std::vector<uint32_t>& members )
+{
+    double sum[D] = {};
+    for( auto i : members )
+    {
+        for( int j=0; j<D; j++ ) sum[j] += points[i][j];
+    }
+    Point<D> ret;
+    for( int j=0; j<D; j++ ) ret[j] = float( sum[j] / members.size() );
+    return ret;
+}
+
+template<int D>
+static double Error( const std::vector<Point<D>>& points, const std::vector<uint32_t>& members, const Point<D>& mean )
+{
+    double err = 0;
+    for( auto i : members )
+    {
+        for( int j=0; j<D; j++ ) err += sq( points[i][j] - mean[j] );
+    }
+    return err;
+}
+
+template<int D>
+struct Cluster
+{
+    std::vector<uint32_t> members;
+    Point<D> mean;
+    double error;
+};
+
+// Splits a cluster in two with 2-means, seeded on either side of the mean
+// along the dimension of the largest spread. False if it can't be split.
+template<int D>
+static bool Split( const std::vector<Point<D>>& points, Cluster<D>& cluster, Cluster<D>& other )
+{
+    enum { SplitIterations = 4 };
+
+    float var[D] = {};
+    for( auto i : cluster.members )
+    {
+        for( int j=0; j<D; j++ ) var[j] += sq( points[i][j] - cluster.mean[j] );
+    }
+    const int dim = int( std::max_element( var, var+D ) - var );
+    const float dev = sqrtf( var[dim] / cluster.members.size() );
+    Point<D> c[2] = { cluster.mean, cluster.mean };
+    c[0][dim] -= dev;
+    c[1][dim] += dev;
+
+    std::vector<uint32_t> part[2];
+    for( int it=0; it<SplitIterations; it++ )
+    {
+        part[0].clear();
+        part[1].clear();
+        for( auto i : cluster.members )
+        {
+            float d[2] = {};
+            for( int k=0; k<2; k++ )
+            {
+                for( int j=0; j<D; j++ ) d[k] += sq( points[i][j] - c[k][j] );
+            }
+            part[d[1] < d[0] ? 1 : 0].emplace_back( i );
+        }
+        if( part[0].empty() || part[1].empty() ) return false;
+        c[0] = Mean<D>( points, part[0] );
+        c[1] = Mean<D>( points, part[1] );
+    }
+
+    cluster.members = std::move( part[0] );
+    cluster.mean = c[0];
+    cluster.error = Error<D>( points, cluster.members, c[0] );
+    other.members = std::move( part[1] );
+    other.mean = c[1];
+    other.error = Error<D>( points, other.members, c[1] );
+    return true;
+}
+
+// Clusters the points into at most k clusters. The clusters with the largest
+// error are split in two, all of a round in parallel, until there are k of
+// them; Lloyd's iterations over all points then polish the result. Returns
+// the centroids and each point's cluster in assign.
+template<int D>
+static std::vector<Point<D>> KMeans( const std::vector<Point<D>>& points, size_t k, std::vector<uint32_t>& assign )
+{
+    const auto n = points.size();
+
+    std::vector<Cluster<D>> clusters( 1 );
+    clusters[0].members.resize( n );
+    for( size_t i=0; i<n; i++ ) clusters[0].members[i] = uint32_t( i );
+    clusters[0].mean = Mean<D>( points, clusters[0].members );
+    clusters[0].error = Error<D>( points, clusters[0].members, clusters[0].mean );
+    std::vector<bool> done( 1, false );
+
+    while( clusters.size() < k )
+    {
+        std::vector<uint32_t> split;
+        for( size_t i=0; i<clusters.size(); i++ )
+        {
+            if( !done[i] && clusters[i].members.size() > 1 && clusters[i].error > 0 ) split.emplace_back( uint32_t( i ) );
+        }
+        if( split.empty() ) break;
+        std::sort( split.begin(), split.end(), [&clusters]( uint32_t l, uint32_t r ) { return clusters[l].error > clusters[r].error; } );
+        if( split.size() > k - clusters.size() ) split.resize( k - clusters.size() );
+
+        const auto first = clusters.size();
+        clusters.resize( first + split.size() );
+        done.resize( clusters.size(), false );
+        std::vector<char> ok( split.size() );
+        for( size_t i=0; i<split.size(); i++ )
+        {
+            TaskDispatch::Queue( [&points, &clusters, &split, &ok, first, i] { ok[i] = Split<D>( points, clusters[split[i]], clusters[first + i] ); } );
+        }
+        TaskDispatch::Sync();
+
+        // Clusters that didn't split are left alone from now on
+        size_t num = first;
+        for( size_t i=0; i<split.size(); i++ )
+        {
+            if( ok[i] )
+            {
+                if( num != first + i ) clusters[num] = std::move( clusters[first + i] );
+                num++;
+            }
+            else
+            {
+                done[split[i]] = true;
+            }
+        }
+        clusters.resize( num );
+        done.resize( num );
+    }
+
+    k = clusters.size();
+    std::vector<Point<D>> centroids( k );
+    assign.resize( n );
+    for( size_t i=0; i<k; i++ )
+    {
+        centroids[i] = clusters[i].mean;
+        for( auto v : clusters[i].members ) assign[v] = uint32_t( i );
+    }
+    clusters = std::vector<Cluster<D>>();
+
+    const auto tasks = NumberOfTasks( n );
+    std::vector<std::vector<double>> sum( tasks );
+    std::vector<std::vector<uint32_t>> count( tasks );
+    for( int it=0; it<Iterations; it++ )
+    {
+        const Clusters<D> nearest( centroids );
+        ParallelFor( n, TaskBlocks, [&]( size_t begin, size_t end, size_t task )
+        {
+            auto& s = sum[task];
+            auto& c = count[task];
+            s.assign( k * D, 0 );
+            c.assign( k, 0 );
+            for( size_t i=begin; i<end; i++ )
+            {
+                const auto idx = nearest.Nearest( points[i], assign[i] );
+                assign[i] = idx;
+                for( int j=0; j<D; j++ ) s[idx * D + j] += points[i][j];
+                c[idx]++;
+            }
+        } );
+
+        // Empty clusters keep their place
+        for( size_t i=0; i<k; i++ )
+        {
+            double acc[D] = {};
+            uint32_t num = 0;
+            for( size_t t=0; t<tasks; t++ )
+            {
+                for( int j=0; j<D; j++ ) acc[j] += sum[t][i * D + j];
+                num += count[t][i];
+            }
+            if( num == 0 ) continue;
+            for( int j=0; j<D; j++ ) centroids[i][j] = float( acc[j] / num );
+        }
+    }
+
+    std::vector<uint32_t> remap( k, 0 );
+    for( auto v : assign ) remap[v] = 1;
+    std::vector<Point<D>> used;
+    for( size_t i=0; i<k; i++ )
+    {
+        if( remap[i] == 0 ) continue;
+        remap[i] = uint32_t( used.size() );
+        used.emplace_back( centroids[i] );
+    }
+    for( auto& v : assign ) v = remap[v];
+    return used;
+}
+
+// Sums over the pixels of an endpoint's blocks, enough to get the squared
+// error of any base color and table with the blocks' selectors
+struct Moments
+{
+    double sum[3];
+    double selSum[4][3];
+    double selCount[4];
+};
+
+static Etc1sData::Endpoint FitEndpoint( const Moments& m )
+{
+    const double n = m.selCount[0] + m.selCount[1] + m.selCount[2] + m.selCount[3];
+    Etc1sData::Endpoint ret = {};
+    double best = std::numeric_limits<double>::max();
+    for( int t=0; t<8; t++ )
+    {
+        int mod[4];
+        Modifiers( t, mod );
+        double m1 = 0;
+        double m2 = 0;
+        for( int k=0; k<4; k++ )
+        {
+            m1 += mod[k] * m.selCount[k];
+            m2 += mod[k] * mod[k] * m.selCount[k];
+        }
+        // Error less the sum of squared pixels, the same for all tables
+        double err = m2 * 3;
+        int q[3];
+        for( int c=0; c<3; c++ )
+        {
+            q[c] = Quantize5( float( ( m.sum[c] - m1 ) / n ) );
+            const int b = Expand5( q[c] );
+            err += n * b * b - 2 * b * ( m.sum[c] - m1 );
+            for( int k=0; k<4; k++ ) err -= 2 * mod[k] * m.selSum[k][c];
+        }
+        if( err < best )
+        {
+            best = err;
+            ret.r = uint8_t( q[0] );
+            ret.g = uint8_t( q[1] );
+            ret.b = uint8_t( q[2] );
+            ret.table = uint8_t( t );
+        }
+    }
+    return ret;
+}
+
+static uint32_t PackSelectors( const Point<16>& p )
+{
+    uint32_t ret = 0;
+    for( int i=0; i<16; i++ )
+    {
+        const auto s = std::min( 3, std::max( 0, int( p[i] + 0.5f ) ) );
+        ret |= uint32_t( s ) << ( i * 2 );
+    }
+    return ret;
+}
+
+static Point<16> UnpackSelectors( uint32_t sel )
+{
+    Point<16> ret;
+    for( int i=0; i<16; i++ ) ret[i] = float( ( sel >> ( i * 2 ) ) & 0x3 );
+    return ret;
+}
+
+Etc1sData::Etc1sData( const char* fn )
+    : m_size( 0, 0 )
+    , m_levels( 0 )
+{
+    FILE* f = fopen( fn, "rb" );
+    if( !f ) return;
+
+    uint32_t hdr[HeaderWords];
+    if( fread( hdr, sizeof( uint32_t ), HeaderWords, f ) != HeaderWords || hdr[0] != Etc1sMagic || hdr[1] != Etc1sVersion ||
+        hdr[2] == 0 || hdr[2] > 0x7FFFFFFC || hdr[2] % 4 != 0 || hdr[3] == 0 || hdr[3] > 0x7FFFFFFC || hdr[3] % 4 != 0 ||
+        hdr[5] == 0 || hdr[5] > MaxCodebookSize || hdr[6] == 0 || hdr[6] > MaxCodebookSize )
+    {
+        fclose( f );
+        return;
+    }
+
+    const v2i size = v2i( int( hdr[2] ), int( hdr[3] ) );
+    if( hdr[4] != 1 && hdr[4] != uint32_t( NumberOfMipLevels( size ) ) )
+    {
+        fclose( f );
+        return;
+    }
+    const int levels = int( hdr[4] );
+    size_t blocks = 0;
+    for( int i=0; i<levels; i++ )
+    {
+        blocks += size_t( std::max( 4, std::max( 1, size.x >> i ) ) / 4 ) * ( std::max( 4, std::max( 1, size.y >> i ) ) / 4 );
+    }
+
+    // The file must hold what the header declares, so a corrupt header
+    // can't turn into a huge allocation
+    const auto start = ftell( f );
+    fseek( f, 0, SEEK_END );
+    const auto end = ftell( f );
+    fseek( f, start, SEEK_SET );
+    if( start < 0 || end < start || uint64_t( end - start ) < hdr[5] * sizeof( Endpoint ) + hdr[6] * sizeof( uint32_t ) + uint64_t( blocks ) * sizeof( uint32_t ) )
+    {
+        fclose( f );
+        return;
+    }
+
+    m_endpoints.resize( hdr[5] );
+    m_selectors.resize( hdr[6] );
+    m_blocks.resize( blocks );
+    if( fread( m_endpoints.data(), sizeof( Endpoint ), m_endpoints.size(), f ) == m_endpoints.size() &&
+        fread( m_selectors.data(), sizeof( uint32_t ), m_selectors.size(), f ) == m_selectors.size() &&
+        fread( m_blocks.data(), sizeof( uint32_t ), m_blocks.size(), f ) == m_blocks.size() )
+    {
+        m_size = size;
+        m_levels = levels;
+    }
+    fclose( f );
+
+    for( auto v : m_blocks )
+    {
+        if( ( v & 0xFFFF ) >= m_endpoints.size() || ( v >> 16 ) >= m_selectors.size() )
+        {
+            m_levels = 0;
+            break;
+        }
+    }
+}
+
+Etc1sData::Etc1sData( const Bitmap& bmp, bool mipmap, bool linearize, int endpoints, int selectors )
+    : m_size( bmp.Size() )
+    , m_levels( mipmap ? NumberOfMipLevels( bmp.Size() ) : 1 )
+{
+    assert( endpoints > 0 && endpoints <= MaxCodebookSize );
+    assert( selectors > 0 && selectors <= MaxCodebookSize );
+
+    // Pixels of every block, in rows, levels one after another. Mip levels
+    // are made from the previous one and dropped when copied.
+    std::vector<uint32_t> px;
+    {
+        const Bitmap* level = &bmp;
+        std::unique_ptr<Bitmap> mip;
+        for( int i=0; i<m_levels; i++ )
+        {
+            const auto& size = level->Size();
+            const size_t stride = std::max( 4, size.x );
+            const int bx = std::max( 4, size.x ) / 4;
+            const int by = std::max( 4, size.y ) / 4;
+            const auto data = level->Data();
+            const auto first = px.size();
+            px.resize( first + size_t( bx ) * by * 16 );
+            auto dst = px.data() + first;
+            for( int y=0; y<by; y++ )
+            {
+                for( int x=0; x<bx; x++ )
+                {
+                    for( int j=0; j<4; j++ )
+                    {
+                        memcpy( dst, data + ( y * 4 + j ) * stride + x * 4, 4 * sizeof( uint32_t ) );
+                        dst += 4;
+                    }
+                }
+            }
+            if( i+1 < m_levels )
+            {
+                std::unique_ptr<Bitmap> next( new BitmapDownsampled( *level, std::numeric_limits<unsigned int>::max(), linearize ) );
+                next->Data();
+                mip = std::move( next );
+                level = mip.get();
+            }
+        }
+    }
+    const size_t num = px.size() / 16;
+
+    // Endpoints are clustered by the blocks' mean color and the spread of
+    // their intensity, which the table has to cover
+    std::vector<Point<4>> features( num );
+    ParallelFor( num, TaskBlocks, [&]( size_t begin, size_t end, size_t )
+    {
+        for( size_t i=begin; i<end; i++ )
+        {
+            const auto p = px.data() + i * 16;
+            int sum[3] = {};
+            int lum[16];
+            for( int j=0; j<16; j++ )
+            {
+                const int r = p[j] & 0xFF;
+                const int g = ( p[j] >> 8 ) & 0xFF;
+                const int b = ( p[j] >> 16 ) & 0xFF;
+                sum[0] += r;
+                sum[1] += g;
+                sum[2] += b;
+                lum[j] = r + g + b;
+            }
+            const float mean = ( sum[0] + sum[1] + sum[2] ) / 16.f;
+            float var = 0;
+            for( int j=0; j<16; j++ ) var += ( lum[j] - mean ) * ( lum[j] - mean );
+            features[i] = Point<4> { { sum[0] / 16.f, sum[1] / 16.f, sum[2] / 16.f, sqrtf( var / 16 ) / 3 } };
+        }
+    } );
+
+    std::vector<uint32_t> endpointOf;
+    const auto centroids = KMeans<4>( features, endpoints, endpointOf );
+    features = std::vector<Point<4>>();
+
+    // Base color of an endpoint from its centroid; the table with the least
+    // error over the endpoint's blocks
+    const auto ne = centroids.size();
+    const auto tasks = NumberOfTasks( num );
+    m_endpoints.resize( ne );
+    for( size_t i=0; i<ne; i++ )
+    {
+        m_endpoints[i].r = uint8_t( Quantize5( centroids[i][0] ) );
+        m_endpoints[i].g = uint8_t( Quantize5( centroids[i][1] ) );
+        m_endpoints[i].b = uint8_t( Quantize5( centroids[i][2] ) );
+    }
+    {
+        std::vector<std::vector<uint64_t>> tableErr( tasks );
+        ParallelFor( num, TaskBlocks, [&]( size_t begin, size_t end, size_t task )
+        {
+            auto& err = tableErr[task];
+            err.assign( ne * 8, 0 );
+            for( size_t i=begin; i<end; i++ )
+            {
+                const auto e = endpointOf[i];
+                int base[3];
+                ExpandEndpoint( m_endpoints[e], base );
+                for( int t=0; t<8; t++ ) err[e * 8 + t] += FitSelectors( px.data() + i * 16, base, t, nullptr );
+            }
+        } );
+        for( size_t i=0; i<ne; i++ )
+        {
+            uint64_t best = std::numeric_limits<uint64_t>::max();
+            for( int t=0; t<8; t++ )
+            {
+                uint64_t err = 0;
+                for( auto& v : tableErr ) err += v[i * 8 + t];
+                if( err < best )
+                {
+                    best = err;
+                    m_endpoints[i].table = uint8_t( t );
+                }
+            }
+        }
+    }
+
+    // Selectors each block wants with its endpoint
+    std::vector<Point<16>> wanted( num );
+    auto fitWanted = [&]
+    {
+        ParallelFor( num, TaskBlocks, [&]( size_t begin, size_t end, size_t )
+        {
+            for( size_t i=begin; i<end; i++ )
+            {
+                const auto& e = m_endpoints[endpointOf[i]];
+                int base[3];
+                ExpandEndpoint( e, base );
+                uint8_t sel[16];
+                FitSelectors( px.data() + i * 16, base, e.table, sel );
+                for( int j=0; j<16; j++ ) wanted[i][j] = sel[j];
+            }
+        } );
+    };
+    fitWanted();
+
+    std::vector<uint32_t> selectorOf;
+    for( auto& v : KMeans<16>( wanted, selectors, selectorOf ) ) m_selectors.emplace_back( PackSelectors( v ) );
+
+    // With the selectors settled, move the endpoints to the least squares
+    // fit of their blocks, and give the blocks the codebook selectors
+    // nearest to what the new endpoints want
+    std::vector<Point<16>> codebook;
+    for( auto v : m_selectors ) codebook.emplace_back( UnpackSelectors( v ) );
+    const Clusters<16> selectorClusters( codebook );
+    std::vector<std::vector<Moments>> moments( tasks );
+    ParallelFor( num, TaskBlocks, [&]( size_t begin, size_t end, size_t task )
+    {
+        auto& mom = moments[task];
+        mom.assign( ne, Moments() );
+        for( size_t i=begin; i<end; i++ )
+        {
+            auto& m = mom[endpointOf[i]];
+            const auto sel = m_selectors[selectorOf[i]];
+            const auto p = px.data() + i * 16;
+            for( int j=0; j<16; j++ )
+            {
+                const auto s = ( sel >> ( j * 2 ) ) & 0x3;
+                for( int c=0; c<3; c++ )
+                {
+                    const auto v = ( p[j] >> ( c * 8 ) ) & 0xFF;
+                    m.sum[c] += v;
+                    m.selSum[s][c] += v;
+                }
+                m.selCount[s]++;
+            }
+        }
+    } );
+    for( size_t i=0; i<ne; i++ )
+    {
+        Moments m = {};
+        for( auto& v : moments )
+        {
+            for( int c=0; c<3; c++ ) m.sum[c] += v[i].sum[c];
+            for( int k=0; k<4; k++ )
+            {
+                for( int c=0; c<3; c++ ) m.selSum[k][c] += v[i].selSum[k][c];
+                m.selCount[k] += v[i].selCount[k];
+            }
+        }
+        m_endpoints[i] = FitEndpoint( m );
+    }
+    moments = std::vector<std::vector<Moments>>();
+
+    fitWanted();
+    ParallelFor( num, TaskBlocks, [&]( size_t begin, size_t end, size_t )
+    {
+        for( size_t i=begin; i<end; i++ ) selectorOf[i] = selectorClusters.Nearest( wanted[i], selectorOf[i] );
+    } );
+
+    m_blocks.resize( num );
+    for( size_t i=0; i<num; i++ ) m_blocks[i] = endpointOf[i] | ( selectorOf[i] << 16 );
+}
+
+bool Etc1sData::Write( const char* fn ) const
+{
+    FILE* f = fopen( fn, "wb" );
+    if( !f ) return false;
+    const uint32_t hdr[HeaderWords] = { Etc1sMagic, Etc1sVersion, uint32_t( m_size.x ), uint32_t( m_size.y ), uint32_t( m_levels ), uint32_t( m_endpoints.size() ), uint32_t( m_selectors.size() ) };
+    bool ok = fwrite( hdr, sizeof( uint32_t ), HeaderWords, f ) == HeaderWords;
+    ok = ok && fwrite( m_endpoints.data(), sizeof( Endpoint ), m_endpoints.size(), f ) == m_endpoints.size();
+    ok = ok && fwrite( m_selectors.data(), sizeof( uint32_t ), m_selectors.size(), f ) == m_selectors.size();
+    ok = ok && fwrite( m_blocks.data(), sizeof( uint32_t ), m_blocks.size(), f ) == m_blocks.size();
+    return fclose( f ) == 0 && ok;
+}
+
+size_t Etc1sData::FileSize() const
+{
+    return HeaderWords * sizeof( uint32_t ) + ( m_endpoints.size() + m_selectors.size() + m_blocks.size() ) * 4;
+}
+
+static etcpak_force_inline uint32_t ByteSwap( uint32_t v )
+{
+    return ( v >> 24 ) | ( ( v >> 8 ) & 0xFF00 ) | ( ( v << 8 ) & 0xFF0000 ) | ( v << 24 );
+}
+
+static etcpak_force_inline uint16_t To565( int r, int g, int b )
+{
+    return uint16_t( ( ( r * 31 + 127 ) / 255 ) << 11 | ( ( g * 63 + 127 ) / 255 ) << 5 | ( ( b * 31 + 127 ) / 255 ) );
+}
+
+static etcpak_force_inline void From565( uint16_t c, int* rgb )
+{
+    rgb[0] = ( ( c >> 8 ) & 0xF8 ) | ( c >> 13 );
+    rgb[1] = ( ( c >> 3 ) & 0xFC ) | ( ( c >> 9 ) & 0x3 );
+    rgb[2] = ( ( c << 3 ) & 0xF8 ) | ( ( c >> 2 ) & 0x7 );
+}
+
+// DXT1 form of an endpoint with the selectors lo to hi in use: the colors of
+// lo and hi as the endpoints, and the DXT1 index of each selector
+struct Dxt1Endpoint
+{
+    uint32_t colors;
+    uint8_t index[4];
+};
+
+static Dxt1Endpoint ToDxt1( const int palette[4][3], int lo, int hi )
+{
+    Dxt1Endpoint ret = {};
+    auto c0 = To565( palette[hi][0], palette[hi][1], palette[hi][2] );
+    auto c1 = To565( palette[lo][0], palette[lo][1], palette[lo][2] );
+    if( c0 == c1 )
+    {
+        // Three color mode, where index 3 is black; index 0 only
+        ret.colors = c0 | ( uint32_t( c1 ) << 16 );
+        return ret;
+    }
+    const bool swap = c0 < c1;
+    if( swap ) std::swap( c0, c1 );
+    ret.colors = c0 | ( uint32_t( c1 ) << 16 );
+
+    int d[4][3];
+    From565( c0, d[0] );
+    From565( c1, d[1] );
+    for( int c=0; c<3; c++ )
+    {
+        d[2][c] = ( 2 * d[0][c] + d[1][c] ) / 3;
+        d[3][c] = ( d[0][c] + 2 * d[1][c] ) / 3;
+    }
+    for( int k=lo; k<=hi; k++ )
+    {
+        int best = std::numeric_limits<int>::max();
+        for( int i=0; i<4; i++ )
+        {
+            int err = 0;
+            for( int c=0; c<3; c++ ) err += ( palette[k][c] - d[i][c] ) * ( palette[k][c] - d[i][c] );
+            if( err < best )
+            {
+                best = err;
+                ret.index[k] = uint8_t( i );
+            }
+        }
+    }
+    return ret;
+}
+
+// Converts the blocks of every level to BlockData words, a chunk at a time
+// (Store() takes blocks of one level)
+template<class T>
+static void StoreLevels( BlockData& bd, const std::vector<uint32_t>& blocks, T convert )
+{
+    enum { Chunk = 4096 };
+    std::vector<uint64_t> out( Chunk );
+    size_t offset = 0;
+    for( int level=0; level<bd.Levels(); level++ )
+    {
+        const auto size = bd.LevelSize( level );
+        const auto end = offset + size_t( std::max( 4, size.x ) / 4 ) * ( std::max( 4, size.y ) / 4 );
+        for( size_t i=offset; i<end; i+=Chunk )
+        {
+            const auto num = uint32_t( std::min<size_t>( Chunk, end - i ) );
+            for( uint32_t j=0; j<num; j++ ) out[j] = convert( blocks[i+j] );
+            bd.Store( out.data(), i, num );
+        }
+        offset = end;
+    }
+}
+
+void Etc1sData::Transcode( BlockData& bd ) const
+{
+    assert( bd.Size().x == m_size.x && bd.Size().y == m_size.y && bd.Levels() == m_levels );
+
+    if( bd.BlockType() == BlockData::Dxt1 )
+    {
+        // Per endpoint and range of selectors in use
+        std::vector<Dxt1Endpoint> endpoints( m_endpoints.size() * 16 );
+        for( size_t i=0; i<m_endpoints.size(); i++ )
+        {
+            int base[3], mod[4], palette[4][3];
+            ExpandEndpoint( m_endpoints[i], base );
+            Modifiers( m_endpoints[i].table, mod );
+            for( int k=0; k<4; k++ )
+            {
+                for( int c=0; c<3; c++ ) palette[k][c] = std::min( 255, std::max( 0, base[c] + mod[k] ) );
+            }
+            for( int lo=0; lo<4; lo++ )
+            {
+                for( int hi=lo; hi<4; hi++ ) endpoints[i * 16 + lo * 4 + hi] = ToDxt1( palette, lo, hi );
+            }
+        }
+        std::vector<uint8_t> range( m_selectors.size() );
+        for( size_t i=0; i<m_selectors.size(); i++ )
+        {
+            int lo = 3, hi = 0;
+            for( int j=0; j<16; j++ )
+            {
+                const int s = ( m_selectors[i] >> ( j * 2 ) ) & 0x3;
+                lo = std::min( lo, s );
+                hi = std::max( hi, s );
+            }
+            range[i] = uint8_t( lo * 4 + hi );
+        }
+
+        StoreLevels( bd, m_blocks, [this, &endpoints, &range]( uint32_t block )
+        {
+            const auto sel = m_selectors[block >> 16];
+            const auto& e = endpoints[( block & 0xFFFF ) * 16 + range[block >> 16]];
+            uint32_t idx = 0;
+            for( int j=0; j<16; j++ ) idx |= uint32_t( e.index[( sel >> ( j * 2 ) ) & 0x3] ) << ( j * 2 );
+            return uint64_t( e.colors ) | ( uint64_t( idx ) << 32 );
+        } );
+    }
+    else
+    {
+        assert( bd.BlockType() == BlockData::Etc1 || bd.BlockType() == BlockData::Etc2_RGB );
+
+        // Differential mode with no difference, both halves with the same
+        // table. Words are stored big endian.
+        std::vector<uint32_t> endpoints( m_endpoints.size() );
+        for( size_t i=0; i<m_endpoints.size(); i++ )
+        {
+            const auto& e = m_endpoints[i];
+            endpoints[i] = ByteSwap( ( e.r << 27 ) | ( e.g << 19 ) | ( e.b << 11 ) | ( e.table << 5 ) | ( e.table << 2 ) | 0x2 );
+        }
+        // Selectors in ETC1 order (columns, bit planes)
+        static const uint32_t etcIndex[4] = { 3, 2, 0, 1 };
+        std::vector<uint32_t> selectors( m_selectors.size() );
+        for( size_t i=0; i<m_selectors.size(); i++ )
+        {
+            uint32_t bits = 0;
+            for( int j=0; j<16; j++ )
+            {
+                const auto v = etcIndex[( m_selectors[i] >> ( j * 2 ) ) & 0x3];
+                const int pos = ( j % 4 ) * 4 + j / 4;
+                bits |= ( ( v & 0x1 ) << pos ) | ( ( v >> 1 ) << ( pos + 16 ) );
+            }
+            selectors[i] = ByteSwap( bits );
+        }
+
+        StoreLevels( bd, m_blocks, [&endpoints, &selectors]( uint32_t block )
+        {
+            return uint64_t( endpoints[block & 0xFFFF] ) | ( uint64_t( selectors[block >> 16] ) << 32 );
+        } );
+    }
+}
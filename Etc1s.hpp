@@ -0,0 +1,60 @@
+#ifndef __ETC1S_HPP__
+#define __ETC1S_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+#include "Vector.hpp"
+
+class Bitmap;
+class BlockData;
+
+// ETC1S intermediate format. Every block is an ETC1 block restricted to one
+// base color and one modifier table for all 16 pixels, so it is fully given
+// by an endpoint (5:5:5 color, table) and 16 two bit selectors. Both come
+// from codebooks shared by the whole image; a block is just the two indices.
+// Such blocks are cheap to transcode to ETC1 (a copy) or DXT1 (endpoints and
+// selector remapping precomputed per codebook entry).
+//
+// File layout, uint32 little endian unless noted:
+//   "ET1S", version, width, height, levels, endpoints, selectors
+//   endpoints: uint8 r, g, b (5 bit), table
+//   selectors: 2 bits per pixel, pixels in rows, modifiers in increasing order
+//   blocks: uint16 endpoint, uint16 selector; levels in order, blocks in rows
+class Etc1sData
+{
+public:
+    struct Endpoint
+    {
+        uint8_t r, g, b;
+        uint8_t table;
+    };
+
+    enum { MaxCodebookSize = 65536 };
+
+    Etc1sData( const char* fn );
+    // Encodes RGBA pixels and, with mipmap, the mip levels made from them.
+    // The clustering passes are queued on the TaskDispatch.
+    Etc1sData( const Bitmap& bmp, bool mipmap, bool linearize, int endpoints, int selectors );
+
+    bool IsValid() const { return m_levels != 0; }
+    bool Write( const char* fn ) const;
+    // Writes all levels to a BlockData of the same size and levels, of type
+    // Etc1, Etc2_RGB or Dxt1
+    void Transcode( BlockData& bd ) const;
+
+    const v2i& Size() const { return m_size; }
+    int Levels() const { return m_levels; }
+    size_t Endpoints() const { return m_endpoints.size(); }
+    size_t Selectors() const { return m_selectors.size(); }
+    size_t FileSize() const;
+
+private:
+    v2i m_size;
+    int m_levels;
+    std::vector<Endpoint> m_endpoints;
+    std::vector<uint32_t> m_selectors;
+    std::vector<uint32_t> m_blocks;     // endpoint | selector << 16
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include <assert.h>
+#include <string.h>
+
+#include "ForceInline.hpp"
+#include "FrameSequence.hpp"
+
+enum { NoRef = 0xFFFFFFFF };
+
+// Blocks further apart than this (sum over the 4x4 pixels, about 8 levels
+// per channel) aren't worth decoding the previous encoding for
+enum { SimilarError = 16 * 3 * 8 * 8 };
+// Error a kept encoding may add to the fresh one, on top of 1/8 of it
+enum { ErrorSlack = 16 * 3 };
+
+static etcpak_force_inline bool SameBlock( const uint32_t* a, const uint32_t* b, size_t width )
+{
+    uint64_t diff = 0;
+    for( int y=0; y<4; y++ )
+    {
+        uint64_t va[2], vb[2];
+        memcpy( va, a + y * width, 16 );
+        memcpy( vb, b + y * width, 16 );
+        diff |= ( va[0] ^ vb[0] ) | ( va[1] ^ vb[1] );
+    }
+    return diff == 0;
+}
+
+static uint32_t BlockError( const uint32_t* a, size_t strideA, const uint32_t* b, size_t strideB, uint32_t mask )
+{
+    uint32_t err = 0;
+    for( int y=0; y<4; y++ )
+    {
+        for( int x=0; x<4; x++ )
+        {
+            const uint32_t ca = a[x] & mask;
+            const uint32_t cb = b[x] & mask;
+            for( int c=0; c<32; c+=8 )
+            {
+                const int d = int( ( ca >> c ) & 0xFF ) - int( ( cb >> c ) & 0xFF );
+                err += d * d;
+            }
+        }
+        a += strideA;
+        b += strideB;
+    }
+    return err;
+}
+
+FrameSequence::FrameSequence( const v2i& size, BlockData::Type type, bool dither, bool useHeuristics )
+    : m_size( size )
+    , m_type( type )
+    , m_alpha( type == BlockData::Etc2_RGBA || type == BlockData::Dxt5 )
+    , m_dither( dither )
+    , m_useHeuristics( useHeuristics )
+    , m_copied( 0 )
+    , m_reused( 0 )
+    , m_compressed( 0 )
+{
+    assert( size.x % 4 == 0 && size.y % 4 == 0 );
+    const size_t blocks = size_t( size.x / 4 ) * ( size.y / 4 );
+    m_blocks.resize( blocks * ( m_alpha ? 2 : 1 ) );
+    m_ref.resize( blocks, NoRef );
+}
+
+void FrameSequence::Process( BlockData& bd, const uint32_t* src, const uint32_t* prev, int firstRow, int rows )
+{
+    assert( bd.Size().x == m_size.x && bd.Size().y == m_size.y );
+    const size_t width = m_size.x;
+    const int bx = m_size.x / 4;
+    const int words = m_alpha ? 2 : 1;
+
+    // The AVX2 DXT1 compressor works on pairs of blocks
+    const bool pairs = m_type == BlockData::Dxt1 && m_size.x % 8 == 0;
+
+    std::vector<uint8_t> mode( bx );
+    for( int y=firstRow; y<firstRow+rows; y++ )
+    {
+        const auto row = src + size_t( y ) * 4 * width;
+        const auto prevRow = prev ? prev + size_t( y ) * 4 * width : nullptr;
+        const size_t base = size_t( y ) * bx;
+
+        for( int x=0; x<bx; x++ )
+        {
+            if( !prevRow ) mode[x] = Fresh;
+            else if( SameBlock( row + x * 4, prevRow + x * 4, width ) ) mode[x] = Copy;
+            else mode[x] = Classify( bd, row + x * 4, prevRow + x * 4, base + x );
+        }
+        if( pairs )
+        {
+            for( int x=0; x<bx; x+=2 )
+            {
+                if( mode[x] == Fresh || mode[x+1] == Fresh ) mode[x] = mode[x+1] = Fresh;
+            }
+        }
+
+        int x = 0;
+        while( x < bx )
+        {
+            const bool keep = mode[x] != Fresh;
+            int end = x + 1;
+            while( end < bx && ( mode[end] != Fresh ) == keep ) end++;
+            const auto num = uint32_t( end - x );
+            const auto offset = base + x;
+
+            if( keep )
+            {
+                bd.Store( m_blocks.data() + offset * words, offset, num );
+                for( int i=x; i<end; i++ )
+                {
+                    if( mode[i] == Copy )
+                    {
+                        m_copied.fetch_add( 1, std::memory_order_relaxed );
+                    }
+                    else
+                    {
+                        m_reused.fetch_add( 1, std::memory_order_relaxed );
+                    }
+                }
+            }
+            else
+            {
+                if( m_alpha )
+                {
+                    bd.ProcessRGBA( row + x * 4, num, offset, width, m_useHeuristics );
+                }
+                else
+                {
+                    bd.Process( row + x * 4, num, offset, width, Channels::RGB, m_dither, m_useHeuristics );
+                }
+                bd.Load( m_blocks.data() + offset * words, offset, num );
+                for( size_t i=offset; i<offset+num; i++ ) m_ref[i] = NoRef;
+                m_compressed.fetch_add( num, std::memory_order_relaxed );
+            }
+            x = end;
+        }
+    }
+}
+
+uint8_t FrameSequence::Classify( BlockData& bd, const uint32_t* src, const uint32_t* prev, size_t block )
+{
+    const size_t width = m_size.x;
+    const uint32_t mask = m_alpha ? 0xFFFFFFFF : 0x00FFFFFF;
+    if( BlockError( src, width, prev, width, mask ) > SimilarError ) return Fresh;
+
+    // Pixels come in the channel order the compressor takes: BGRA for ETC, RGBA for DXT
+    const auto format = ( m_type == BlockData::Dxt1 || m_type == BlockData::Dxt5 ) ? BlockData::RGBA8 : BlockData::BGRA8;
+    uint32_t decoded[4*4];
+    bd.DecodeBlock( m_blocks.data() + block * ( m_alpha ? 2 : 1 ), decoded, format );
+
+    // A block compressed in the previous frame sets the reference with its
+    // error there; kept blocks carry that on, so the error can't creep up
+    auto ref = m_ref[block];
+    if( ref == NoRef ) ref = BlockError( decoded, 4, prev, width, mask );
+    const auto err = BlockError( decoded, 4, src, width, mask );
+    if( err > ref + ref / 8 + ErrorSlack ) return Fresh;
+
+    m_ref[block] = ref;
+    return Reuse;
+}
@@ -0,0 +1,50 @@
+#ifndef __FRAMESEQUENCE_HPP__
+#define __FRAMESEQUENCE_HPP__
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "BlockData.hpp"
+#include "Vector.hpp"
+
+// Compresses the frames of a sequence against the previous frame. Blocks with
+// unchanged source pixels get the previous output copied. For blocks that
+// changed a little, the previous encoding is tried first and kept if its error
+// on the new pixels stays close to what a fresh compression achieved; only the
+// remaining blocks go through the compressor.
+//
+// Block rows are independent: rows of frame n may be processed as soon as the
+// same rows of frame n-1 are done, while other rows still work on older frames.
+class FrameSequence
+{
+public:
+    FrameSequence( const v2i& size, BlockData::Type type, bool dither, bool useHeuristics );
+
+    // src is frame n, prev frame n-1 (nullptr for the first frame)
+    void Process( BlockData& bd, const uint32_t* src, const uint32_t* prev, int firstRow, int rows );
+
+    uint64_t Copied() const { return m_copied.load( std::memory_order_relaxed ); }
+    uint64_t Reused() const { return m_reused.load( std::memory_order_relaxed ); }
+    uint64_t Compressed() const { return m_compressed.load( std::memory_order_relaxed ); }
+
+private:
+    enum { Fresh, Copy, Reuse };
+
+    uint8_t Classify( BlockData& bd, const uint32_t* src, const uint32_t* prev, size_t block );
+
+    v2i m_size;
+    BlockData::Type m_type;
+    bool m_alpha;
+    bool m_dither;
+    bool m_useHeuristics;
+
+    std::vector<uint64_t> m_blocks;     // previous frame's output
+    std::vector<uint32_t> m_ref;        // error of the fresh encoding a kept block stands in for
+
+    std::atomic<uint64_t> m_copied;
+    std::atomic<uint64_t> m_reused;
+    std::atomic<uint64_t> m_compressed;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __HALF_HPP__
+#define __HALF_HPP__
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ForceInline.hpp"
+
+// IEEE 754 half precision conversions. Floats round to nearest even; values
+// too large for a half become infinity.
+static etcpak_force_inline uint16_t FloatToHalf( float f )
+{
+    uint32_t x;
+    memcpy( &x, &f, sizeof( x ) );
+    const uint32_t sign = x & 0x80000000;
+    x ^= sign;
+
+    uint16_t h;
+    if( x >= 0x47800000 )
+    {
+        h = x > 0x7F800000 ? 0x7E00 : 0x7C00;
+    }
+    else if( x < 0x38800000 )
+    {
+        // Subnormal: let the float adder shift and round the mantissa
+        float v;
+        memcpy( &v, &x, sizeof( v ) );
+        v += 0.5f;
+        memcpy( &x, &v, sizeof( x ) );
+        h = uint16_t( x - 0x3F000000 );
+    }
+    else
+    {
+        const uint32_t odd = ( x >> 13 ) & 1;
+        x += 0xC8000FFF + odd;      // rebias exponent, round
+        h = uint16_t( x >> 13 );
+    }
+    return h | uint16_t( sign >> 16 );
+}
+
+static etcpak_force_inline float HalfToFloat( uint16_t h )
+{
+    uint32_t x = uint32_t( h & 0x7FFF ) << 13;
+    const uint32_t exp = x & 0x0F800000;
+    x += 0x38000000;
+    float f;
+    if( exp == 0x0F800000 )
+    {
+        x += 0x38000000;
+        memcpy( &f, &x, sizeof( f ) );
+    }
+    else if( exp == 0 )
+    {
+        x += 0x00800000;
+        memcpy( &f, &x, sizeof( f ) );
+        f -= 6.10351562e-05f;
+    }
+    else
+    {
+        memcpy( &f, &x, sizeof( f ) );
+    }
+    return ( h & 0x8000 ) ? -f : f;
+}
+
+#endif
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#include "Bitmap.hpp"
+#include "mmap.hpp"
+#include "PageFile.hpp"
+#include "ProcessDxtc.hpp"
+#include "ProcessRGB.hpp"
+
+enum { PageFileMagic = 0x54565445 };    // "ETVT"
+enum { PageFileVersion = 1 };
+
+static uint32_t PvrFormat( BlockData::Type type )
+{
+    switch( type )
+    {
+    case BlockData::Etc1:
+        return 6;
+    case BlockData::Etc2_RGB:
+        return 22;
+    case BlockData::Etc2_RGBA:
+        return 23;
+    case BlockData::Dxt1:
+        return 7;
+    case BlockData::Dxt5:
+        return 11;
+    default:
+        assert( false );
+        return 0;
+    }
+}
+
+PageFile::PageFile( const char* fn, const v2i& size, bool mipmap, BlockData::Type type, int pageSize, int border, const BlockOrder& order )
+    : m_size( size )
+    , m_type( type )
+    , m_pageSize( pageSize )
+    , m_border( border )
+    , m_span( pageSize + border * 2 )
+    , m_order( order )
+    , m_numPages( 0 )
+{
+    assert( pageSize > 0 && border >= 0 && m_span % 4 == 0 );
+
+    v2i current = size;
+    for(;;)
+    {
+        const v2i pages( ( current.x + pageSize - 1 ) / pageSize, ( current.y + pageSize - 1 ) / pageSize );
+        m_pages.emplace_back( pages );
+        m_firstPage.emplace_back( m_numPages );
+        m_numPages += size_t( pages.x ) * pages.y;
+        if( !mipmap || ( pages.x == 1 && pages.y == 1 ) ) break;
+        current.x = std::max( 1, current.x / 2 );
+        current.y = std::max( 1, current.y / 2 );
+    }
+
+    const bool alpha = type == BlockData::Etc2_RGBA || type == BlockData::Dxt5;
+    m_pageBytes = size_t( m_span / 4 ) * ( m_span / 4 ) * ( alpha ? 16 : 8 );
+    const size_t header = sizeof( uint32_t ) * ( 9 + m_pages.size() * 2 ) + sizeof( uint64_t ) * m_numPages;
+    m_dataOffset = ( header + 15 ) & ~size_t( 15 );
+    m_maplen = m_dataOffset + m_pageBytes * m_numPages;
+
+    m_data = nullptr;
+    m_file = fopen( fn, "wb+" );
+    if( !m_file ) return;
+    fseek( m_file, m_maplen - 1, SEEK_SET );
+    const char zero = 0;
+    fwrite( &zero, 1, 1, m_file );
+    fseek( m_file, 0, SEEK_SET );
+    m_data = (uint8_t*)mmap( nullptr, m_maplen, PROT_WRITE, MAP_SHARED, fileno( m_file ), 0 );
+    if( m_data == MAP_FAILED )
+    {
+        m_data = nullptr;
+        return;
+    }
+
+    auto dst = (uint32_t*)m_data;
+    *dst++ = PageFileMagic;
+    *dst++ = PageFileVersion;
+    *dst++ = PvrFormat( type );
+    *dst++ = size.x;
+    *dst++ = size.y;
+    *dst++ = pageSize;
+    *dst++ = border;
+    *dst++ = uint32_t( m_pages.size() );
+    *dst++ = uint32_t( m_numPages );
+    for( auto& v : m_pages )
+    {
+        *dst++ = v.x;
+        *dst++ = v.y;
+    }
+    auto index = (uint8_t*)dst;
+    for( size_t i=0; i<m_numPages; i++ )
+    {
+        const uint64_t offset = m_dataOffset + i * m_pageBytes;
+        memcpy( index + i * sizeof( uint64_t ), &offset, sizeof( uint64_t ) );
+    }
+}
+
+PageFile::~PageFile()
+{
+    if( m_data ) munmap( m_data, m_maplen );
+    if( m_file ) fclose( m_file );
+}
+
+void PageFile::Process( const Bitmap& bmp, int level, int x, int y, bool dither, bool useHeuristics )
+{
+    assert( level < Levels() && x < m_pages[level].x && y < m_pages[level].y );
+
+    // Page with its borders, edge pixels repeated outside of the level.
+    // Downsampled levels only fill whole bands of 4 rows.
+    const auto& size = bmp.Size();
+    const size_t stride = std::max( 4, size.x );
+    const int rows = size.y < 4 ? size.y : size.y & ~3;
+    const auto data = bmp.Data();
+    const int x0 = x * m_pageSize - m_border;
+    const int y0 = y * m_pageSize - m_border;
+    std::vector<uint32_t> src( size_t( m_span ) * m_span );
+    for( int j=0; j<m_span; j++ )
+    {
+        const auto row = data + std::min( std::max( y0 + j, 0 ), rows - 1 ) * stride;
+        auto ptr = src.data() + size_t( j ) * m_span;
+        int i = 0;
+        for( ; i<m_span && x0 + i < 0; i++ ) *ptr++ = row[0];
+        const int copy = std::max( 0, std::min( m_span - i, size.x - ( x0 + i ) ) );
+        memcpy( ptr, row + x0 + i, copy * sizeof( uint32_t ) );
+        ptr += copy;
+        i += copy;
+        for( ; i<m_span; i++ ) *ptr++ = row[size.x - 1];
+    }
+
+    const auto page = m_firstPage[level] + size_t( y ) * m_pages[level].x + x;
+    auto dst = (uint64_t*)( m_data + m_dataOffset + page * m_pageBytes );
+    const v2i blocks( m_span / 4, m_span / 4 );
+    const auto num = uint32_t( blocks.x * blocks.y );
+    const int words = int( m_pageBytes / ( num * sizeof( uint64_t ) ) );
+
+    std::vector<uint64_t> ordered;
+    auto out = dst;
+    if( !m_order.IsLinear() )
+    {
+        ordered.resize( num * words );
+        out = ordered.data();
+    }
+
+    switch( m_type )
+    {
+    case BlockData::Etc1:
+        if( dither )
+        {
+            CompressEtc1RgbDither( src.data(), out, num, m_span );
+        }
+        else
+        {
+            CompressEtc1Rgb( src.data(), out, num, m_span );
+        }
+        break;
+    case BlockData::Etc2_RGB:
+        CompressEtc2Rgb( src.data(), out, num, m_span, useHeuristics );
+        break;
+    case BlockData::Etc2_RGBA:
+        CompressEtc2Rgba( src.data(), out, num, m_span, useHeuristics );
+        break;
+    case BlockData::Dxt1:
+        if( dither )
+        {
+            CompressDxt1Dither( src.data(), out, num, m_span );
+        }
+        else
+        {
+            CompressDxt1( src.data(), out, num, m_span );
+        }
+        break;
+    case BlockData::Dxt5:
+        CompressDxt5( src.data(), out, num, m_span );
+        break;
+    default:
+        assert( false );
+        break;
+    }
+
+    if( !m_order.IsLinear() )
+    {
+        for( int by=0; by<blocks.y; by++ )
+        {
+            for( int bx=0; bx<blocks.x; bx++ )
+            {
+                const auto idx = m_order.Index( bx, by, blocks );
+                memcpy( dst + idx * words, out + ( by * blocks.x + bx ) * words, words * sizeof( uint64_t ) );
+            }
+        }
+    }
+}
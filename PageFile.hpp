@@ -0,0 +1,64 @@
+#ifndef __PAGEFILE_HPP__
+#define __PAGEFILE_HPP__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "BlockData.hpp"
+#include "BlockOrder.hpp"
+#include "Vector.hpp"
+
+class Bitmap;
+
+// Virtual texture page file. Each level is cut into pages of pageSize x
+// pageSize pixels, and every page is stored with a border of its neighbours'
+// pixels (clamped at the texture edges) around it, so the page can be
+// filtered on its own. Levels go down to the first one that fits in a page.
+//
+// Layout, uint32 little endian unless noted:
+//   "ETVT", version, pvr pixel format, width, height, page size, border,
+//   levels, pages
+//   per level: pages across, pages down
+//   per page: uint64 offset of its blocks in the file; levels in order,
+//   pages of a level in rows
+// Every page is ( pageSize + 2 * border )^2 / 16 blocks, in the block order.
+class PageFile
+{
+public:
+    PageFile( const char* fn, const v2i& size, bool mipmap, BlockData::Type type, int pageSize, int border, const BlockOrder& order );
+    ~PageFile();
+
+    PageFile( const PageFile& ) = delete;
+    PageFile& operator=( const PageFile& ) = delete;
+
+    // False if the file couldn't be created
+    bool IsOpen() const { return m_data != nullptr; }
+    int Levels() const { return int( m_pages.size() ); }
+    const v2i& Pages( int level ) const { return m_pages[level]; }
+    size_t NumberOfPages() const { return m_numPages; }
+    size_t DataSize() const { return m_maplen; }
+
+    // Compresses page (x, y) of a level, from the level's pixels (BGRA for
+    // ETC types, RGBA for DXT types)
+    void Process( const Bitmap& bmp, int level, int x, int y, bool dither, bool useHeuristics );
+
+private:
+    v2i m_size;
+    BlockData::Type m_type;
+    int m_pageSize;
+    int m_border;
+    int m_span;             // page size with the borders
+    BlockOrder m_order;
+    std::vector<v2i> m_pages;
+    std::vector<size_t> m_firstPage;
+    size_t m_numPages;
+    size_t m_pageBytes;
+    size_t m_dataOffset;
+
+    FILE* m_file;
+    uint8_t* m_data;
+    size_t m_maplen;
+};
+
+#endif
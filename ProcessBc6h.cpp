@@ -0,0 +1,654 @@
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "BlockWriter.hpp"
+#include "ForceInline.hpp"
+#include "ProcessBc6h.hpp"
+#include "Progress.hpp"
+
+// Fields of the block header. W, X are the endpoints of the first region,
+// Y, Z of the second. Transformed modes store X, Y, Z as deltas from W.
+enum Field
+{
+    RW, GW, BW,
+    RX, GX, BX,
+    RY, GY, BY,
+    RZ, GZ, BZ,
+    D,
+    End
+};
+
+struct Segment
+{
+    uint8_t field;
+    uint8_t shift;
+    uint8_t bits;
+};
+
+struct Mode
+{
+    uint8_t code;
+    uint8_t codeBits;
+    bool partitioned;
+    bool transformed;
+    uint8_t endpointBits;
+    uint8_t deltaBits[3];
+    Segment layout[32];
+};
+
+// Header layouts in stream order, after the mode bits. Modes 13 and 14 store
+// the top bits of W reversed.
+static const Mode Modes[14] = {
+    { 0x00, 2, true, true, 10, { 5, 5, 5 }, {
+        { GY, 4, 1 }, { BY, 4, 1 }, { BZ, 4, 1 }, { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 5 }, { GZ, 4, 1 },
+        { GY, 0, 4 }, { GX, 0, 5 }, { BZ, 0, 1 }, { GZ, 0, 4 }, { BX, 0, 5 }, { BZ, 1, 1 }, { BY, 0, 4 }, { RY, 0, 5 },
+        { BZ, 2, 1 }, { RZ, 0, 5 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x01, 2, true, true, 7, { 6, 6, 6 }, {
+        { GY, 5, 1 }, { GZ, 4, 1 }, { GZ, 5, 1 }, { RW, 0, 7 }, { BZ, 0, 1 }, { BZ, 1, 1 }, { BY, 4, 1 }, { GW, 0, 7 },
+        { BY, 5, 1 }, { BZ, 2, 1 }, { GY, 4, 1 }, { BW, 0, 7 }, { BZ, 3, 1 }, { BZ, 5, 1 }, { BZ, 4, 1 }, { RX, 0, 6 },
+        { GY, 0, 4 }, { GX, 0, 6 }, { GZ, 0, 4 }, { BX, 0, 6 }, { BY, 0, 4 }, { RY, 0, 6 }, { RZ, 0, 6 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x02, 5, true, true, 11, { 5, 4, 4 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 5 }, { RW, 10, 1 }, { GY, 0, 4 }, { GX, 0, 4 }, { GW, 10, 1 },
+        { BZ, 0, 1 }, { GZ, 0, 4 }, { BX, 0, 4 }, { BW, 10, 1 }, { BZ, 1, 1 }, { BY, 0, 4 }, { RY, 0, 5 }, { BZ, 2, 1 },
+        { RZ, 0, 5 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x06, 5, true, true, 11, { 4, 5, 4 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 4 }, { RW, 10, 1 }, { GZ, 4, 1 }, { GY, 0, 4 }, { GX, 0, 5 },
+        { GW, 10, 1 }, { GZ, 0, 4 }, { BX, 0, 4 }, { BW, 10, 1 }, { BZ, 1, 1 }, { BY, 0, 4 }, { RY, 0, 4 }, { BZ, 0, 1 },
+        { BZ, 2, 1 }, { RZ, 0, 4 }, { GY, 4, 1 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x0A, 5, true, true, 11, { 4, 4, 5 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 4 }, { RW, 10, 1 }, { BY, 4, 1 }, { GY, 0, 4 }, { GX, 0, 4 },
+        { GW, 10, 1 }, { BZ, 0, 1 }, { GZ, 0, 4 }, { BX, 0, 5 }, { BW, 10, 1 }, { BY, 0, 4 }, { RY, 0, 4 }, { BZ, 1, 1 },
+        { BZ, 2, 1 }, { RZ, 0, 4 }, { BZ, 4, 1 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x0E, 5, true, true, 9, { 5, 5, 5 }, {
+        { RW, 0, 9 }, { BY, 4, 1 }, { GW, 0, 9 }, { GY, 4, 1 }, { BW, 0, 9 }, { BZ, 4, 1 }, { RX, 0, 5 }, { GZ, 4, 1 },
+        { GY, 0, 4 }, { GX, 0, 5 }, { BZ, 0, 1 }, { GZ, 0, 4 }, { BX, 0, 5 }, { BZ, 1, 1 }, { BY, 0, 4 }, { RY, 0, 5 },
+        { BZ, 2, 1 }, { RZ, 0, 5 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x12, 5, true, true, 8, { 6, 5, 5 }, {
+        { RW, 0, 8 }, { GZ, 4, 1 }, { BY, 4, 1 }, { GW, 0, 8 }, { BZ, 2, 1 }, { GY, 4, 1 }, { BW, 0, 8 }, { BZ, 3, 1 },
+        { BZ, 4, 1 }, { RX, 0, 6 }, { GY, 0, 4 }, { GX, 0, 5 }, { BZ, 0, 1 }, { GZ, 0, 4 }, { BX, 0, 5 }, { BZ, 1, 1 },
+        { BY, 0, 4 }, { RY, 0, 6 }, { RZ, 0, 6 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x16, 5, true, true, 8, { 5, 6, 5 }, {
+        { RW, 0, 8 }, { BZ, 0, 1 }, { BY, 4, 1 }, { GW, 0, 8 }, { GY, 5, 1 }, { GY, 4, 1 }, { BW, 0, 8 }, { GZ, 5, 1 },
+        { BZ, 4, 1 }, { RX, 0, 5 }, { GZ, 4, 1 }, { GY, 0, 4 }, { GX, 0, 6 }, { GZ, 0, 4 }, { BX, 0, 5 }, { BZ, 1, 1 },
+        { BY, 0, 4 }, { RY, 0, 5 }, { BZ, 2, 1 }, { RZ, 0, 5 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x1A, 5, true, true, 8, { 5, 5, 6 }, {
+        { RW, 0, 8 }, { BZ, 1, 1 }, { BY, 4, 1 }, { GW, 0, 8 }, { BY, 5, 1 }, { GY, 4, 1 }, { BW, 0, 8 }, { BZ, 5, 1 },
+        { BZ, 4, 1 }, { RX, 0, 5 }, { GZ, 4, 1 }, { GY, 0, 4 }, { GX, 0, 5 }, { BZ, 0, 1 }, { GZ, 0, 4 }, { BX, 0, 6 },
+        { BY, 0, 4 }, { RY, 0, 5 }, { BZ, 2, 1 }, { RZ, 0, 5 }, { BZ, 3, 1 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x1E, 5, true, false, 6, { 6, 6, 6 }, {
+        { RW, 0, 6 }, { GZ, 4, 1 }, { BZ, 0, 1 }, { BZ, 1, 1 }, { BY, 4, 1 }, { GW, 0, 6 }, { GY, 5, 1 }, { BY, 5, 1 },
+        { BZ, 2, 1 }, { GY, 4, 1 }, { BW, 0, 6 }, { GZ, 5, 1 }, { BZ, 3, 1 }, { BZ, 5, 1 }, { BZ, 4, 1 }, { RX, 0, 6 },
+        { GY, 0, 4 }, { GX, 0, 6 }, { GZ, 0, 4 }, { BX, 0, 6 }, { BY, 0, 4 }, { RY, 0, 6 }, { RZ, 0, 6 }, { D, 0, 5 }, { End, 0, 0 } } },
+    { 0x03, 5, false, false, 10, { 10, 10, 10 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 10 }, { GX, 0, 10 }, { BX, 0, 10 }, { End, 0, 0 } } },
+    { 0x07, 5, false, true, 11, { 9, 9, 9 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 9 }, { RW, 10, 1 }, { GX, 0, 9 }, { GW, 10, 1 }, { BX, 0, 9 },
+        { BW, 10, 1 }, { End, 0, 0 } } },
+    { 0x0B, 5, false, true, 12, { 8, 8, 8 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 8 }, { RW, 11, 1 }, { RW, 10, 1 }, { GX, 0, 8 }, { GW, 11, 1 },
+        { GW, 10, 1 }, { BX, 0, 8 }, { BW, 11, 1 }, { BW, 10, 1 }, { End, 0, 0 } } },
+    { 0x0F, 5, false, true, 16, { 4, 4, 4 }, {
+        { RW, 0, 10 }, { GW, 0, 10 }, { BW, 0, 10 }, { RX, 0, 4 }, { RW, 15, 1 }, { RW, 14, 1 }, { RW, 13, 1 }, { RW, 12, 1 },
+        { RW, 11, 1 }, { RW, 10, 1 }, { GX, 0, 4 }, { GW, 15, 1 }, { GW, 14, 1 }, { GW, 13, 1 }, { GW, 12, 1 }, { GW, 11, 1 },
+        { GW, 10, 1 }, { BX, 0, 4 }, { BW, 15, 1 }, { BW, 14, 1 }, { BW, 13, 1 }, { BW, 12, 1 }, { BW, 11, 1 }, { BW, 10, 1 },
+        { End, 0, 0 } } }
+};
+
+// Mode numbers are 1 based in the format description
+enum
+{
+    Mode1 = 0,
+    Mode2 = 1,
+    Mode10 = 9,
+    Mode11 = 10,
+    Mode12 = 11,
+    Mode13 = 12,
+    Mode14 = 13
+};
+
+// Pixels of the second region, first 32 two region partitions of BC7
+static const uint16_t Partitions[32] = {
+    0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80,
+    0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+    0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE,
+    0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C
+};
+
+// Anchor pixel of the second region; its index has the top bit implied zero
+static const uint8_t Anchor2[32] = {
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15,
+    15,  2,  8,  2,  2,  8,  8, 15,
+     2,  8,  2,  2,  8,  8,  2,  2
+};
+
+static const int Weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const int Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+enum { MaxHalf = 0x7BFF };
+
+static etcpak_force_inline int Unquantize( int q, int bits )
+{
+    if( bits >= 15 ) return q;
+    if( q == 0 ) return 0;
+    if( q == ( 1 << bits ) - 1 ) return 0xFFFF;
+    return ( ( q << 16 ) + 0x8000 ) >> bits;
+}
+
+static etcpak_force_inline int Finish( int v )
+{
+    return ( v * 31 ) >> 6;
+}
+
+// Nearest quantized value to a half
+static etcpak_force_inline int Quantize( int h, int bits )
+{
+    const int max = ( 1 << bits ) - 1;
+    if( bits >= 15 ) return std::min( max, ( h * 64 + 30 ) / 31 );
+    const int q = std::min( max, ( ( h * 64 + 30 ) / 31 << bits ) >> 16 );
+    if( q == max ) return q;
+    const int d0 = h - Finish( Unquantize( q, bits ) );
+    const int d1 = Finish( Unquantize( q+1, bits ) ) - h;
+    return d1 < d0 ? q+1 : q;
+}
+
+static etcpak_force_inline int SignExtend( int v, int bits )
+{
+    return ( v ^ ( 1 << ( bits - 1 ) ) ) - ( 1 << ( bits - 1 ) );
+}
+
+namespace
+{
+struct BitWriter
+{
+    uint64_t lo = 0, hi = 0;
+    int pos = 0;
+
+    void Put( uint32_t v, int bits )
+    {
+        if( pos < 64 )
+        {
+            lo |= uint64_t( v ) << pos;
+            if( pos + bits > 64 ) hi |= uint64_t( v ) >> ( 64 - pos );
+        }
+        else
+        {
+            hi |= uint64_t( v ) << ( pos - 64 );
+        }
+        pos += bits;
+    }
+};
+
+struct BitReader
+{
+    uint64_t lo, hi;
+    int pos = 0;
+
+    uint32_t Get( int bits )
+    {
+        uint64_t v;
+        if( pos < 64 )
+        {
+            v = lo >> pos;
+            if( pos != 0 ) v |= hi << ( 64 - pos );
+        }
+        else
+        {
+            v = hi >> ( pos - 64 );
+        }
+        pos += bits;
+        return uint32_t( v & ( ( 1u << bits ) - 1 ) );
+    }
+};
+
+struct Encoding
+{
+    uint64_t lo, hi;
+    uint64_t error;
+    uint8_t index[16];
+};
+}
+
+static etcpak_force_inline int Interpolate( int a, int b, int w )
+{
+    return Finish( ( a * ( 64 - w ) + b * w + 32 ) >> 6 );
+}
+
+// Picks the nearest of the index levels for every pixel, of the two around
+// its projection on the endpoint line
+static uint64_t FitIndices( const int px[16][3], uint32_t partition, const int unq[4][3], int levels, uint8_t* index )
+{
+    const int* weights = levels == 8 ? Weights3 : Weights4;
+    int ends[4][3];
+    float dir[2][3];
+    float scale[2];
+    const int regions = partition != 0 ? 2 : 1;
+    for( int s=0; s<regions; s++ )
+    {
+        float len2 = 0;
+        for( int c=0; c<3; c++ )
+        {
+            ends[s*2][c] = Finish( unq[s*2][c] );
+            ends[s*2+1][c] = Finish( unq[s*2+1][c] );
+            dir[s][c] = float( ends[s*2+1][c] - ends[s*2][c] );
+            len2 += dir[s][c] * dir[s][c];
+        }
+        scale[s] = len2 > 0 ? 64 / len2 : 0;
+    }
+
+    uint64_t error = 0;
+    for( int i=0; i<16; i++ )
+    {
+        const int s = ( partition >> i ) & 1;
+        const auto a = unq[s*2];
+        const auto b = unq[s*2+1];
+        float t = 0;
+        for( int c=0; c<3; c++ ) t += ( px[i][c] - ends[s*2][c] ) * dir[s][c];
+        const float w = t * scale[s];
+        int k = 0;
+        while( k < levels - 2 && weights[k+1] <= w ) k++;
+
+        uint64_t e0 = 0, e1 = 0;
+        for( int c=0; c<3; c++ )
+        {
+            const int64_t d0 = Interpolate( a[c], b[c], weights[k] ) - px[i][c];
+            const int64_t d1 = Interpolate( a[c], b[c], weights[k+1] ) - px[i][c];
+            e0 += uint64_t( d0 * d0 );
+            e1 += uint64_t( d1 * d1 );
+        }
+        if( e1 < e0 )
+        {
+            index[i] = uint8_t( k+1 );
+            error += e1;
+        }
+        else
+        {
+            index[i] = uint8_t( k );
+            error += e0;
+        }
+    }
+    return error;
+}
+
+static void Pack( const Mode& mode, int partition, const int q[4][3], const uint8_t* index, Encoding& enc )
+{
+    int field[13];
+    for( int i=0; i<4; i++ )
+    {
+        for( int c=0; c<3; c++ )
+        {
+            int v = q[i][c];
+            if( i != 0 && mode.transformed ) v = ( v - q[0][c] ) & ( ( 1 << mode.deltaBits[c] ) - 1 );
+            field[i*3+c] = v;
+        }
+    }
+    field[D] = partition;
+
+    BitWriter bits;
+    bits.Put( mode.code, mode.codeBits );
+    for( auto seg = mode.layout; seg->field != End; seg++ )
+    {
+        bits.Put( ( field[seg->field] >> seg->shift ) & ( ( 1 << seg->bits ) - 1 ), seg->bits );
+    }
+
+    const int ib = mode.partitioned ? 3 : 4;
+    const int anchor2 = mode.partitioned ? Anchor2[partition] : -1;
+    for( int i=0; i<16; i++ )
+    {
+        bits.Put( index[i], ( i == 0 || i == anchor2 ) ? ib - 1 : ib );
+    }
+    assert( bits.pos == 128 );
+    enc.lo = bits.lo;
+    enc.hi = bits.hi;
+}
+
+// Encodes endpoints (in halves, region s from ep[s*2] to ep[s*2+1]) in one
+// mode; false if the deltas of a transformed mode don't fit. A region whose
+// anchor pixel ends up in the upper half of the indices gets its endpoints
+// swapped.
+static bool Encode( const int px[16][3], int m, int partition, const int ep[4][3], Encoding& enc )
+{
+    const auto& mode = Modes[m];
+    const uint32_t mask = mode.partitioned ? Partitions[partition] : 0;
+    const int regions = mode.partitioned ? 2 : 1;
+    const int levels = mode.partitioned ? 8 : 16;
+    const int anchors[2] = { 0, mode.partitioned ? Anchor2[partition] : 0 };
+
+    int order[4] = { 0, 1, 2, 3 };
+    int q[4][3] = {};
+    int unq[4][3] = {};
+    for( int pass=0; pass<2; pass++ )
+    {
+        for( int i=0; i<regions*2; i++ )
+        {
+            for( int c=0; c<3; c++ ) q[i][c] = Quantize( ep[order[i]][c], mode.endpointBits );
+        }
+        if( mode.transformed )
+        {
+            for( int i=1; i<regions*2; i++ )
+            {
+                for( int c=0; c<3; c++ )
+                {
+                    const int lim = 1 << ( mode.deltaBits[c] - 1 );
+                    const int d = q[i][c] - q[0][c];
+                    if( d < -lim || d >= lim ) return false;
+                }
+            }
+        }
+        for( int i=0; i<regions*2; i++ )
+        {
+            for( int c=0; c<3; c++ ) unq[i][c] = Unquantize( q[i][c], mode.endpointBits );
+        }
+        enc.error = FitIndices( px, mask, unq, levels, enc.index );
+
+        bool swap = false;
+        for( int s=0; s<regions; s++ )
+        {
+            if( enc.index[anchors[s]] >= levels / 2 )
+            {
+                std::swap( order[s*2], order[s*2+1] );
+                swap = true;
+            }
+        }
+        if( !swap ) break;
+    }
+
+    // Still flipped after swapping (the quantized ends met): clamp the anchor
+    const int* weights = levels == 8 ? Weights3 : Weights4;
+    for( int s=0; s<regions; s++ )
+    {
+        const int i = anchors[s];
+        if( enc.index[i] < levels / 2 ) continue;
+        for( int c=0; c<3; c++ )
+        {
+            int64_t d = Interpolate( unq[s*2][c], unq[s*2+1][c], weights[enc.index[i]] ) - px[i][c];
+            enc.error -= uint64_t( d * d );
+            d = Interpolate( unq[s*2][c], unq[s*2+1][c], weights[levels/2-1] ) - px[i][c];
+            enc.error += uint64_t( d * d );
+        }
+        enc.index[i] = uint8_t( levels / 2 - 1 );
+    }
+
+    Pack( mode, partition, q, enc.index, enc );
+    return true;
+}
+
+// Corners of the bounding box of the pixels in mask, oriented along the
+// dominant channel by the signs of the covariances with it
+static void BoundingBox( const int px[16][3], uint32_t mask, int a[3], int b[3] )
+{
+    int lo[3] = { MaxHalf, MaxHalf, MaxHalf };
+    int hi[3] = { 0, 0, 0 };
+    for( int i=0; i<16; i++ )
+    {
+        if( !( ( mask >> i ) & 1 ) ) continue;
+        for( int c=0; c<3; c++ )
+        {
+            lo[c] = std::min( lo[c], px[i][c] );
+            hi[c] = std::max( hi[c], px[i][c] );
+        }
+    }
+
+    int dom = 0;
+    for( int c=1; c<3; c++ ) if( hi[c] - lo[c] > hi[dom] - lo[dom] ) dom = c;
+    int64_t cov[3] = {};
+    for( int i=0; i<16; i++ )
+    {
+        if( !( ( mask >> i ) & 1 ) ) continue;
+        const int d = px[i][dom] * 2 - lo[dom] - hi[dom];
+        for( int c=0; c<3; c++ ) cov[c] += int64_t( px[i][c] * 2 - lo[c] - hi[c] ) * d;
+    }
+    for( int c=0; c<3; c++ )
+    {
+        a[c] = cov[c] < 0 ? hi[c] : lo[c];
+        b[c] = cov[c] < 0 ? lo[c] : hi[c];
+    }
+}
+
+// Sums of the pixels and of their products per channel pair, the moments a
+// region's covariance is made of
+struct Moments
+{
+    float v[10];    // count, r, g, b, rr, gg, bb, rg, rb, gb
+};
+
+static etcpak_force_inline void AddMoments( Moments& m, const int* p )
+{
+    const float r = float( p[0] ), g = float( p[1] ), b = float( p[2] );
+    m.v[0] += 1;
+    m.v[1] += r;
+    m.v[2] += g;
+    m.v[3] += b;
+    m.v[4] += r * r;
+    m.v[5] += g * g;
+    m.v[6] += b * b;
+    m.v[7] += r * g;
+    m.v[8] += r * b;
+    m.v[9] += g * b;
+}
+
+// Squared distance of a region's pixels from the line that fits them best,
+// the covariance trace less its largest eigenvalue (by power iteration)
+static float LineError( const Moments& m )
+{
+    const float n = m.v[0];
+    if( n < 2 ) return 0;
+    const float inv = 1 / n;
+    const float rr = m.v[4] - m.v[1] * m.v[1] * inv;
+    const float gg = m.v[5] - m.v[2] * m.v[2] * inv;
+    const float bb = m.v[6] - m.v[3] * m.v[3] * inv;
+    const float rg = m.v[7] - m.v[1] * m.v[2] * inv;
+    const float rb = m.v[8] - m.v[1] * m.v[3] * inv;
+    const float gb = m.v[9] - m.v[2] * m.v[3] * inv;
+    const float trace = rr + gg + bb;
+    if( trace <= 0 ) return 0;
+
+    float x = 1, y = 1, z = 1;
+    for( int i=0; i<4; i++ )
+    {
+        const float nx = rr * x + rg * y + rb * z;
+        const float ny = rg * x + gg * y + gb * z;
+        const float nz = rb * x + gb * y + bb * z;
+        const float len = std::max( std::max( fabsf( nx ), fabsf( ny ) ), fabsf( nz ) );
+        if( len == 0 ) return trace;
+        x = nx / len;
+        y = ny / len;
+        z = nz / len;
+    }
+    const float len2 = x * x + y * y + z * z;
+    const float lambda = ( x * ( rr * x + rg * y + rb * z ) + y * ( rg * x + gg * y + gb * z ) + z * ( rb * x + gb * y + bb * z ) ) / len2;
+    return std::max( 0.f, trace - lambda );
+}
+
+// Partition whose regions are closest to lines
+static int BestPartition( const int px[16][3] )
+{
+    Moments total = {};
+    for( int i=0; i<16; i++ ) AddMoments( total, px[i] );
+
+    int best = 0;
+    float error = -1;
+    for( int p=0; p<32; p++ )
+    {
+        Moments second = {};
+        for( int i=0; i<16; i++ ) if( Partitions[p] >> i & 1 ) AddMoments( second, px[i] );
+        Moments first;
+        for( int i=0; i<10; i++ ) first.v[i] = total.v[i] - second.v[i];
+        const float e = LineError( first ) + LineError( second );
+        if( error < 0 || e < error )
+        {
+            error = e;
+            best = p;
+        }
+    }
+    return best;
+}
+
+// Least squares endpoints for the chosen indices of a one region encoding
+static void Refit( const int px[16][3], const uint8_t* index, int ep[4][3] )
+{
+    float aa = 0, ab = 0, bb = 0;
+    float pa[3] = {}, pb[3] = {};
+    for( int i=0; i<16; i++ )
+    {
+        const float t = Weights4[index[i]] / 64.f;
+        const float u = 1 - t;
+        aa += u * u;
+        ab += u * t;
+        bb += t * t;
+        for( int c=0; c<3; c++ )
+        {
+            pa[c] += u * px[i][c];
+            pb[c] += t * px[i][c];
+        }
+    }
+    const float det = aa * bb - ab * ab;
+    if( det < 1e-3f ) return;
+    for( int c=0; c<3; c++ )
+    {
+        const float a = ( bb * pa[c] - ab * pb[c] ) / det;
+        const float b = ( aa * pb[c] - ab * pa[c] ) / det;
+        ep[0][c] = std::min<int>( MaxHalf, std::max( 0, int( a + 0.5f ) ) );
+        ep[1][c] = std::min<int>( MaxHalf, std::max( 0, int( b + 0.5f ) ) );
+    }
+}
+
+// Mean error per channel (in halves) below which a one region encoding is
+// kept without trying the partitions
+enum { PartitionThreshold = 4 };
+
+// Takes the most precise of the modes (in decreasing precision) the endpoint
+// deltas fit in. The last mode must not be transformed.
+template<size_t N>
+static void EncodeCascade( const int px[16][3], const int (&modes)[N], int partition, const int ep[4][3], Encoding& best )
+{
+    Encoding enc;
+    for( auto m : modes )
+    {
+        if( !Encode( px, m, partition, ep, enc ) ) continue;
+        if( enc.error < best.error ) best = enc;
+        return;
+    }
+    assert( false );
+}
+
+static etcpak_force_inline void ProcessBlock( const int px[16][3], uint64_t& lo, uint64_t& hi )
+{
+    static const int Single[] = { Mode14, Mode13, Mode12, Mode11 };
+    static const int Double[] = { Mode1, Mode2, Mode10 };
+
+    Encoding best;
+    int ep[4][3];
+    BoundingBox( px, 0xFFFF, ep[0], ep[1] );
+    Encode( px, Mode11, 0, ep, best );
+    if( best.error != 0 )
+    {
+        Refit( px, best.index, ep );
+        EncodeCascade( px, Single, 0, ep, best );
+    }
+
+    if( best.error > 16 * 3 * PartitionThreshold * PartitionThreshold )
+    {
+        const int partition = BestPartition( px );
+        const uint32_t mask = Partitions[partition];
+        BoundingBox( px, ~mask & 0xFFFF, ep[0], ep[1] );
+        BoundingBox( px, mask, ep[2], ep[3] );
+        EncodeCascade( px, Double, partition, ep, best );
+    }
+
+    lo = best.lo;
+    hi = best.hi;
+}
+
+static etcpak_force_inline int ClampHalf( uint16_t h )
+{
+    if( h & 0x8000 ) return 0;
+    return std::min<int>( h, MaxHalf );
+}
+
+void CompressBc6h( const uint64_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
+{
+    int i = 0;
+    BlockWriter out( dst );
+    do
+    {
+        int px[16][3];
+        for( int y=0; y<4; y++ )
+        {
+            for( int x=0; x<4; x++ )
+            {
+                const auto v = src[width * y + x];
+                for( int c=0; c<3; c++ ) px[y*4+x][c] = ClampHalf( uint16_t( v >> ( c * 16 ) ) );
+            }
+        }
+        src += 4;
+        if( ++i == width/4 )
+        {
+            src += width * 3;
+            i = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
+        }
+
+        uint64_t lo, hi;
+        ProcessBlock( px, lo, hi );
+        out.Store( lo );
+        out.Store( hi );
+    }
+    while( --blocks );
+}
+
+void DecodeBc6h( const uint64_t* src, uint64_t* dst, size_t width )
+{
+    BitReader bits;
+    bits.lo = src[0];
+    bits.hi = src[1];
+
+    uint32_t code = bits.Get( 2 );
+    if( code & 2 ) code |= bits.Get( 3 ) << 2;
+    int m = 0;
+    while( m < 14 && ( Modes[m].code != code ) ) m++;
+    if( m == 14 )
+    {
+        for( int y=0; y<4; y++ )
+        {
+            for( int x=0; x<4; x++ ) dst[width * y + x] = 0x3C00ull << 48;
+        }
+        return;
+    }
+
+    const auto& mode = Modes[m];
+    int field[13] = {};
+    for( auto seg = mode.layout; seg->field != End; seg++ )
+    {
+        field[seg->field] |= bits.Get( seg->bits ) << seg->shift;
+    }
+
+    const int regions = mode.partitioned ? 2 : 1;
+    const int partition = field[D];
+    int unq[4][3];
+    for( int i=0; i<regions*2; i++ )
+    {
+        for( int c=0; c<3; c++ )
+        {
+            int v = field[i*3+c];
+            if( i != 0 && mode.transformed ) v = ( field[c] + SignExtend( v, mode.deltaBits[c] ) ) & ( ( 1 << mode.endpointBits ) - 1 );
+            unq[i][c] = Unquantize( v, mode.endpointBits );
+        }
+    }
+
+    const int ib = mode.partitioned ? 3 : 4;
+    const int* weights = mode.partitioned ? Weights3 : Weights4;
+    const uint32_t mask = mode.partitioned ? Partitions[partition] : 0;
+    const int anchor2 = mode.partitioned ? Anchor2[partition] : -1;
+    for( int i=0; i<16; i++ )
+    {
+        const int w = weights[bits.Get( ( i == 0 || i == anchor2 ) ? ib - 1 : ib )];
+        const int s = ( mask >> i ) & 1;
+        uint64_t v = 0x3C00ull << 48;
+        for( int c=0; c<3; c++ ) v |= uint64_t( Interpolate( unq[s*2][c], unq[s*2+1][c], w ) ) << ( c * 16 );
+        dst[width * ( i / 4 ) + i % 4] = v;
+    }
+}
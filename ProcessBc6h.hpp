@@ -0,0 +1,16 @@
+#ifndef __PROCESSBC6H_HPP__
+#define __PROCESSBC6H_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Progress;
+
+// Pixels are half float RGBA, R in the low 16 bits. Alpha is ignored, and
+// negative values are clamped to zero (the unsigned format).
+void CompressBc6h( const uint64_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress = nullptr );
+// Decodes an unsigned BC6H block of any mode, alpha set to 1.0. Reserved
+// modes decode to black.
+void DecodeBc6h( const uint64_t* src, uint64_t* dst, size_t width );
+
+#endif
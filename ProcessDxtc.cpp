@@ -1,6 +1,8 @@
+#include "BlockWriter.hpp"
 #include "Dither.hpp"
 #include "ForceInline.hpp"
 #include "ProcessDxtc.hpp"
+#include "Progress.hpp"
 
 #include <assert.h>
 #include <stdint.h>
@@ -802,7 +804,7 @@ static etcpak_force_inline uint64_t ProcessAlpha_SSE( __m128i px0, __m128i px1,
 }
 #endif
 
-void CompressDxt1( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width )
+void CompressDxt1( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
 {
 #ifdef __AVX2__
     if( width%8 == 0 )
@@ -810,10 +812,11 @@ void CompressDxt1( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
         blocks /= 2;
         uint32_t buf[8*4];
         int i = 0;
-        char* dst8 = (char*)dst;
+        BlockWriter out( dst );
 
         do
         {
+            PrefetchNextRow( src, width, i * 2 );
             auto tmp = (char*)buf;
             memcpy( tmp,        src + width * 0, 8*4 );
             memcpy( tmp + 8*4,  src + width * 1, 8*4 );
@@ -824,9 +827,14 @@ void CompressDxt1( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
             {
                 src += width * 3;
                 i = 0;
+                if( progress && !progress->RowDone( width/4 ) ) return;
             }
 
+            uint64_t pair[2];
+            auto dst8 = (char*)pair;
             ProcessRGB_AVX( (uint8_t*)buf, dst8 );
+            out.Store( pair[0] );
+            out.Store( pair[1] );
         }
         while( --blocks );
     }
@@ -836,9 +844,10 @@ void CompressDxt1( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
         uint32_t buf[4*4];
         int i = 0;
 
-        auto ptr = dst;
+        BlockWriter out( dst );
         do
         {
+            PrefetchNextRow( src, width, i );
             auto tmp = (char*)buf;
             memcpy( tmp,        src + width * 0, 4*4 );
             memcpy( tmp + 4*4,  src + width * 1, 4*4 );
@@ -849,27 +858,30 @@ void CompressDxt1( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
             {
                 src += width * 3;
                 i = 0;
+                if( progress && !progress->RowDone( width/4 ) ) return;
             }
 
             const auto c = ProcessRGB( (uint8_t*)buf );
             uint8_t fix[8];
             memcpy( fix, &c, 8 );
             for( int j=4; j<8; j++ ) fix[j] = DxtcIndexTable[fix[j]];
-            memcpy( ptr, fix, sizeof( uint64_t ) );
-            ptr++;
+            uint64_t v;
+            memcpy( &v, fix, sizeof( uint64_t ) );
+            out.Store( v );
         }
         while( --blocks );
     }
 }
 
-void CompressDxt1Dither( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width )
+void CompressDxt1Dither( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
 {
     uint32_t buf[4*4];
     int i = 0;
 
-    auto ptr = dst;
+    BlockWriter out( dst );
     do
     {
+        PrefetchNextRow( src, width, i );
         auto tmp = (char*)buf;
         memcpy( tmp,        src + width * 0, 4*4 );
         memcpy( tmp + 4*4,  src + width * 1, 4*4 );
@@ -880,6 +892,7 @@ void CompressDxt1Dither( const uint32_t* src, uint64_t* dst, uint32_t blocks, si
         {
             src += width * 3;
             i = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
 
         Dither( (uint8_t*)buf );
@@ -888,18 +901,20 @@ void CompressDxt1Dither( const uint32_t* src, uint64_t* dst, uint32_t blocks, si
         uint8_t fix[8];
         memcpy( fix, &c, 8 );
         for( int j=4; j<8; j++ ) fix[j] = DxtcIndexTable[fix[j]];
-        memcpy( ptr, fix, sizeof( uint64_t ) );
-        ptr++;
+        uint64_t v;
+        memcpy( &v, fix, sizeof( uint64_t ) );
+        out.Store( v );
     }
     while( --blocks );
 }
 
-void CompressDxt5( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width )
+void CompressDxt5( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
 {
     int i = 0;
-    auto ptr = dst;
+    BlockWriter out( dst );
     do
     {
+        PrefetchNextRow( src, width, i );
 #ifdef __SSE4_1__
         __m128i px0 = _mm_loadu_si128( (__m128i*)( src + width * 0 ) );
         __m128i px1 = _mm_loadu_si128( (__m128i*)( src + width * 1 ) );
@@ -911,16 +926,18 @@ void CompressDxt5( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
         {
             src += width * 3;
             i = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
 
-        *ptr++ = ProcessAlpha_SSE( px0, px1, px2, px3 );
+        out.Store( ProcessAlpha_SSE( px0, px1, px2, px3 ) );
 
         const auto c = ProcessRGB_SSE( px0, px1, px2, px3 );
         uint8_t fix[8];
         memcpy( fix, &c, 8 );
         for( int j=4; j<8; j++ ) fix[j] = DxtcIndexTable[fix[j]];
-        memcpy( ptr, fix, sizeof( uint64_t ) );
-        ptr++;
+        uint64_t v;
+        memcpy( &v, fix, sizeof( uint64_t ) );
+        out.Store( v );
 #else
         uint32_t rgba[4*4];
         uint8_t alpha[4*4];
@@ -935,6 +952,7 @@ void CompressDxt5( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
         {
             src += width * 3;
             i = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
 
         for( int i=0; i<16; i++ )
@@ -942,14 +960,15 @@ void CompressDxt5( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t w
             alpha[i] = rgba[i] >> 24;
             rgba[i] &= 0xFFFFFF;
         }
-        *ptr++ = ProcessAlpha( alpha );
+        out.Store( ProcessAlpha( alpha ) );
 
         const auto c = ProcessRGB( (uint8_t*)rgba );
         uint8_t fix[8];
         memcpy( fix, &c, 8 );
         for( int j=4; j<8; j++ ) fix[j] = DxtcIndexTable[fix[j]];
-        memcpy( ptr, fix, sizeof( uint64_t ) );
-        ptr++;
+        uint64_t v;
+        memcpy( &v, fix, sizeof( uint64_t ) );
+        out.Store( v );
 #endif
     }
     while( --blocks );
@@ -5,12 +5,16 @@
 #  include <arm_neon.h>
 #endif
 
+#include "BlockWriter.hpp"
 #include "Dither.hpp"
 #include "ForceInline.hpp"
 #include "Math.hpp"
 #include "ProcessCommon.hpp"
 #include "ProcessRGB.hpp"
+#include "Progress.hpp"
+#include "ScratchArena.hpp"
 #include "Tables.hpp"
+#include "TaskDispatch.hpp"
 #include "Vector.hpp"
 #if defined __SSE4_1__ || defined __AVX2__ || defined _MSC_VER
 #  ifdef _MSC_VER
@@ -272,6 +276,17 @@ static etcpak_force_inline unsigned long _bit_scan_forward( unsigned long mask )
 
 typedef std::array<uint16_t, 4> v4i;
 
+// Working memory of the T/H mode search. One is taken from the worker's
+// scratch arena per block row and reused by every block in it, so nothing is
+// cleared per block. The selector fit arrays stay on the stack, where the
+// compiler keeps them in registers.
+struct BlockScratch
+{
+    alignas( 32 ) uint16_t pixErr[16];
+    alignas( 16 ) uint8_t luma[16];
+    uint8_t pixIdx[16];
+};
+
 #ifdef __AVX2__
 static etcpak_force_inline __m256i Sum4_AVX2( const uint8_t* data) noexcept
 {
@@ -2119,7 +2134,7 @@ static etcpak_force_inline std::pair<uint64_t, uint64_t> Planar_NEON( const uint
 #endif
 
 #ifdef __AVX2__
-uint32_t calculateErrorTH( bool tMode, uint8_t( colorsRGB444 )[2][3], uint8_t& dist, uint32_t& pixIndices, uint8_t startDist, __m128i r8, __m128i g8, __m128i b8 )
+uint32_t calculateErrorTH( bool tMode, uint8_t( colorsRGB444 )[2][3], uint8_t& dist, uint32_t& pixIndices, uint8_t startDist, BlockScratch& s, __m128i r8, __m128i g8, __m128i b8 )
 #else
 uint32_t calculateErrorTH( bool tMode, uint8_t* src, uint8_t( colorsRGB444 )[2][3], uint8_t& dist, uint32_t& pixIndices, uint8_t startDist )
 #endif
@@ -2215,11 +2230,10 @@ uint32_t calculateErrorTH( bool tMode, uint8_t* src, uint8_t( colorsRGB444 )[2][
         }
 
         // accumulate the block error
-        alignas( 32 ) uint16_t pixErr16[16] = { 0, };
-        _mm256_storeu_si256( (__m256i*)pixErr16, lowestPixErr );
+        _mm256_store_si256( (__m256i*)s.pixErr, lowestPixErr );
         for( uint8_t p = 0; p < 16; p++ )
         {
-            blockErr += (int)( pixErr16[p] ) * pixErr16[p];
+            blockErr += (int)( s.pixErr[p] ) * s.pixErr[p];
         }
 #else
         for( size_t y = 0; y < 4; ++y )
@@ -2267,22 +2281,24 @@ uint32_t calculateErrorTH( bool tMode, uint8_t* src, uint8_t( colorsRGB444 )[2][
 
 // main T-/H-mode compression function
 #ifdef __AVX2__
-uint32_t compressBlockTH( uint8_t* src, Luma& l, uint32_t& compressed1, uint32_t& compressed2, bool& tMode, __m128i r8, __m128i g8, __m128i b8 )
+uint32_t compressBlockTH( uint8_t* src, Luma& l, uint32_t& compressed1, uint32_t& compressed2, bool& tMode, BlockScratch& s, __m128i r8, __m128i g8, __m128i b8 )
 #else
-uint32_t compressBlockTH( uint8_t *src, Luma& l, uint32_t& compressed1, uint32_t& compressed2, bool &tMode )
+uint32_t compressBlockTH( uint8_t *src, Luma& l, uint32_t& compressed1, uint32_t& compressed2, bool &tMode, BlockScratch& s )
 #endif
 {
 #ifdef __AVX2__
-    alignas( 8 ) uint8_t luma[16] = { 0, };
-    _mm_storeu_si128 ( (__m128i* )luma, l.luma8 );
+    uint8_t* luma = s.luma;
+    _mm_store_si128( (__m128i*)luma, l.luma8 );
 #elif defined __ARM_NEON && defined __aarch64__
-    alignas( 8 ) uint8_t luma[16] = { 0 };
+    uint8_t* luma = s.luma;
     vst1q_u8( luma, l.luma8 );
 #else
     uint8_t* luma = l.val;
 #endif
 
-    uint8_t pixIdx[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    static const uint8_t identity[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    uint8_t* pixIdx = s.pixIdx;
+    memcpy( pixIdx, identity, sizeof( identity ) );
 
     // 1) sorts the pairs of (luma, pix_idx)
     insertionSort( luma, pixIdx );
@@ -2440,7 +2456,7 @@ uint32_t compressBlockTH( uint8_t *src, Luma& l, uint32_t& compressed1, uint32_t
     // 6) finds the best candidate with the lowest error
 #ifdef __AVX2__
     // Vectorized ver
-    bestErr = calculateErrorTH( tMode, colorsRGB444, bestDist, bestPixIndices, startDistCandidate, r8, g8, b8 );
+    bestErr = calculateErrorTH( tMode, colorsRGB444, bestDist, bestPixIndices, startDistCandidate, s, r8, g8, b8 );
 #else
     // Scalar ver
     bestErr = calculateErrorTH( tMode, src, colorsRGB444, bestDist, bestPixIndices, startDistCandidate );
@@ -2981,7 +2997,7 @@ static etcpak_force_inline uint8_t SelectModeETC2( const Luma& luma )
     return ModeUndecided;
 }
 
-static etcpak_force_inline uint64_t ProcessRGB_ETC2( const uint8_t* src, bool useHeuristics )
+static etcpak_force_inline uint64_t ProcessRGB_ETC2( const uint8_t* src, bool useHeuristics, BlockScratch& s )
 {
 #ifdef __AVX2__
     uint64_t d = CheckSolid_AVX2( src );
@@ -3043,7 +3059,7 @@ static etcpak_force_inline uint64_t ProcessRGB_ETC2( const uint8_t* src, bool us
             uint32_t compressed[4] = { 0, 0, 0, 0 };
             bool tMode = false;
 
-            error = compressBlockTH( (uint8_t*)src, luma, compressed[0], compressed[1], tMode, ch.r8, ch.g8, ch.b8 );
+            error = compressBlockTH( (uint8_t*)src, luma, compressed[0], compressed[1], tMode, s, ch.r8, ch.g8, ch.b8 );
             if( tMode )
             {
                 stuff59bits( compressed[0], compressed[1], compressed[2], compressed[3] );
@@ -3107,7 +3123,7 @@ static etcpak_force_inline uint64_t ProcessRGB_ETC2( const uint8_t* src, bool us
             uint32_t compressed[4] = { 0, 0, 0, 0 };
             bool tMode = false;
 
-            result.second = compressBlockTH( (uint8_t*)src, luma, compressed[0], compressed[1], tMode );
+            result.second = compressBlockTH( (uint8_t*)src, luma, compressed[0], compressed[1], tMode, s );
             if( tMode )
             {
                 stuff59bits( compressed[0], compressed[1], compressed[2], compressed[3] );
@@ -3850,12 +3866,14 @@ static etcpak_force_inline uint64_t ProcessAlpha_ETC2( const uint8_t* src )
 }
 
 
-void CompressEtc1Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width )
+void CompressEtc1Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
 {
     int w = 0;
+    BlockWriter out( dst );
     uint32_t buf[4*4];
     do
     {
+        PrefetchNextRow( src, width, w );
 #ifdef __SSE4_1__
         __m128 px0 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 0 ) ) );
         __m128 px1 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 1 ) ) );
@@ -3903,18 +3921,23 @@ void CompressEtc1Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, siz
         {
             src += width * 3;
             w = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
-        *dst++ = ProcessRGB( (uint8_t*)buf );
+        out.Store( ProcessRGB( (uint8_t*)buf ) );
     }
     while( --blocks );
 }
 
-void CompressEtc2Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, bool useHeuristics )
+void CompressEtc2Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, bool useHeuristics, Progress* progress )
 {
     int w = 0;
+    BlockWriter out( dst );
+    ScratchArena::Scope scratch( TaskDispatch::Scratch() );
+    auto s = scratch.Alloc<BlockScratch>();
     uint32_t buf[4*4];
     do
     {
+        PrefetchNextRow( src, width, w );
 #ifdef __SSE4_1__
         __m128 px0 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 0 ) ) );
         __m128 px1 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 1 ) ) );
@@ -3962,8 +3985,11 @@ void CompressEtc2Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, siz
         {
             src += width * 3;
             w = 0;
+            scratch.Reset();
+            s = scratch.Alloc<BlockScratch>();
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
-        *dst++ = ProcessRGB_ETC2( (uint8_t*)buf, useHeuristics );
+        out.Store( ProcessRGB_ETC2( (uint8_t*)buf, useHeuristics, *s ) );
     }
     while( --blocks );
 }
@@ -3971,12 +3997,14 @@ void CompressEtc2Alpha( const uint32_t* src, uint64_t* dst, uint32_t blocks, siz
 #include <chrono>
 #include <thread>
 
-void CompressEtc1Rgb( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width )
+void CompressEtc1Rgb( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
 {
     int w = 0;
+    BlockWriter out( dst );
     uint32_t buf[4*4];
     do
     {
+        PrefetchNextRow( src, width, w );
 #ifdef __SSE4_1__
         __m128 px0 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 0 ) ) );
         __m128 px1 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 1 ) ) );
@@ -4009,18 +4037,21 @@ void CompressEtc1Rgb( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_
         {
             src += width * 3;
             w = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
-        *dst++ = ProcessRGB( (uint8_t*)buf );
+        out.Store( ProcessRGB( (uint8_t*)buf ) );
     }
     while( --blocks );
 }
 
-void CompressEtc1RgbDither( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width )
+void CompressEtc1RgbDither( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, Progress* progress )
 {
     int w = 0;
+    BlockWriter out( dst );
     uint32_t buf[4*4];
     do
     {
+        PrefetchNextRow( src, width, w );
 #ifdef __SSE4_1__
         __m128 px0 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 0 ) ) );
         __m128 px1 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 1 ) ) );
@@ -4059,18 +4090,23 @@ void CompressEtc1RgbDither( const uint32_t* src, uint64_t* dst, uint32_t blocks,
         {
             src += width * 3;
             w = 0;
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
-        *dst++ = ProcessRGB( (uint8_t*)buf );
+        out.Store( ProcessRGB( (uint8_t*)buf ) );
     }
     while( --blocks );
 }
 
-void CompressEtc2Rgb( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, bool useHeuristics )
+void CompressEtc2Rgb( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, bool useHeuristics, Progress* progress )
 {
     int w = 0;
+    BlockWriter out( dst );
+    ScratchArena::Scope scratch( TaskDispatch::Scratch() );
+    auto s = scratch.Alloc<BlockScratch>();
     uint32_t buf[4*4];
     do
     {
+        PrefetchNextRow( src, width, w );
 #ifdef __SSE4_1__
         __m128 px0 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 0 ) ) );
         __m128 px1 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 1 ) ) );
@@ -4103,19 +4139,26 @@ void CompressEtc2Rgb( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_
         {
             src += width * 3;
             w = 0;
+            scratch.Reset();
+            s = scratch.Alloc<BlockScratch>();
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
-        *dst++ = ProcessRGB_ETC2( (uint8_t*)buf, useHeuristics );
+        out.Store( ProcessRGB_ETC2( (uint8_t*)buf, useHeuristics, *s ) );
     }
     while( --blocks );
 }
 
-void CompressEtc2Rgba( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, bool useHeuristics )
+void CompressEtc2Rgba( const uint32_t* src, uint64_t* dst, uint32_t blocks, size_t width, bool useHeuristics, Progress* progress )
 {
     int w = 0;
+    BlockWriter out( dst );
+    ScratchArena::Scope scratch( TaskDispatch::Scratch() );
+    auto s = scratch.Alloc<BlockScratch>();
     uint32_t rgba[4*4];
     uint8_t alpha[4*4];
     do
     {
+        PrefetchNextRow( src, width, w );
 #ifdef __SSE4_1__
         __m128 px0 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 0 ) ) );
         __m128 px1 = _mm_castsi128_ps( _mm_loadu_si128( (__m128i*)( src + width * 1 ) ) );
@@ -4175,9 +4218,12 @@ void CompressEtc2Rgba( const uint32_t* src, uint64_t* dst, uint32_t blocks, size
         {
             src += width * 3;
             w = 0;
+            scratch.Reset();
+            s = scratch.Alloc<BlockScratch>();
+            if( progress && !progress->RowDone( width/4 ) ) return;
         }
-        *dst++ = ProcessAlpha_ETC2( alpha );
-        *dst++ = ProcessRGB_ETC2( (uint8_t*)rgba, useHeuristics );
+        out.Store( ProcessAlpha_ETC2( alpha ) );
+        out.Store( ProcessRGB_ETC2( (uint8_t*)rgba, useHeuristics, *s ) );
     }
     while( --blocks );
 }
@@ -0,0 +1,35 @@
+#ifndef __PROGRESS_HPP__
+#define __PROGRESS_HPP__
+
+#include <atomic>
+#include <stdint.h>
+
+// Shared by all tasks of one compression job. The Compress* drivers add
+// each finished block row to the counter and stop at the next row boundary
+// once the job has been cancelled. Safe to poll from any thread; Cancel()
+// may be called from a signal handler.
+class Progress
+{
+public:
+    Progress() : m_blocks( 0 ), m_total( 0 ), m_cancel( false ) {}
+
+    bool RowDone( uint32_t blocks )
+    {
+        m_blocks.fetch_add( blocks, std::memory_order_relaxed );
+        return !m_cancel.load( std::memory_order_relaxed );
+    }
+
+    void Cancel() { m_cancel.store( true, std::memory_order_relaxed ); }
+    bool Cancelled() const { return m_cancel.load( std::memory_order_relaxed ); }
+
+    void SetTotal( uint64_t total ) { m_total = total; }
+    uint64_t Total() const { return m_total; }
+    uint64_t Blocks() const { return m_blocks.load( std::memory_order_relaxed ); }
+
+private:
+    std::atomic<uint64_t> m_blocks;
+    uint64_t m_total;
+    std::atomic<bool> m_cancel;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <assert.h>
+#include <stdio.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "ProcessDxtc.hpp"
+#include "ProcessRGB.hpp"
+#include "RealtimeCompressor.hpp"
+#include "System.hpp"
+#include "Timing.hpp"
+
+// Waits this many pause instructions for a new frame (or for the workers)
+// before sleeping; a sleeping thread takes tens of microseconds to wake up
+enum { SpinIterations = 1 << 14 };
+
+static inline void Pause()
+{
+#ifdef __SSE2__
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+RealtimeCompressor::RealtimeCompressor( const v2i& size, BlockData::Type type, unsigned int threads, const WorkerPolicy& policy, bool useHeuristics )
+    : m_size( size )
+    , m_type( type )
+    , m_alpha( type == BlockData::Etc2_RGBA || type == BlockData::Dxt5 )
+    , m_useHeuristics( useHeuristics )
+    , m_back( 0 )
+    , m_src( nullptr )
+    , m_start( 0 )
+    , m_inFlight( false )
+    , m_frame( 0 )
+    , m_pending( 0 )
+    , m_exit( false )
+    , m_policy( policy )
+{
+    assert( size.x % 4 == 0 && size.y % 4 == 0 );
+    assert( threads >= 1 );
+
+    m_frameWords = size_t( size.x / 4 ) * ( size.y / 4 ) * ( m_alpha ? 2 : 1 );
+    m_buffer[0].resize( m_frameWords );
+    m_buffer[1].resize( m_frameWords );
+
+    // No point in more stripes than block rows
+    m_threads = std::min<unsigned int>( threads, size.y / 4 );
+    m_stripeEnd.resize( m_threads );
+    // Spinning only helps if the caller and every worker have a cpu to themselves
+    m_spin = System::CPUCores() > m_threads ? SpinIterations : 0;
+    m_cpuOrder = WorkerCpuOrder( policy );
+    m_workers.reserve( m_threads );
+    for( unsigned int i=0; i<m_threads; i++ )
+    {
+        m_workers.emplace_back( [this, i] { Worker( i ); } );
+        char tmp[20];
+        snprintf( tmp, sizeof( tmp ), "Realtime %u", i );
+        System::SetThreadName( m_workers.back(), tmp );
+    }
+}
+
+RealtimeCompressor::~RealtimeCompressor()
+{
+    if( m_inFlight ) Wait();
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_exit.store( true );
+    }
+    m_cvStart.notify_all();
+    for( auto& worker : m_workers ) worker.join();
+}
+
+void RealtimeCompressor::Submit( const uint32_t* src )
+{
+    assert( !m_inFlight );
+    m_inFlight = true;
+    m_src = src;
+    m_pending.store( m_threads, std::memory_order_relaxed );
+    m_start = GetTime();
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_frame.fetch_add( 1, std::memory_order_release );
+    }
+    m_cvStart.notify_all();
+}
+
+const uint64_t* RealtimeCompressor::Wait()
+{
+    assert( m_inFlight );
+    for( int i=0; i<m_spin && m_pending.load( std::memory_order_acquire ) != 0; i++ ) Pause();
+    if( m_pending.load( std::memory_order_acquire ) != 0 )
+    {
+        std::unique_lock<std::mutex> lock( m_lock );
+        m_cvDone.wait( lock, [this] { return m_pending.load( std::memory_order_acquire ) == 0; } );
+    }
+    m_inFlight = false;
+    m_latency.emplace_back( *std::max_element( m_stripeEnd.begin(), m_stripeEnd.end() ) - m_start );
+
+    const auto ret = m_buffer[m_back].data();
+    m_back ^= 1;
+    return ret;
+}
+
+void RealtimeCompressor::Worker( unsigned int idx )
+{
+    ApplyWorkerPolicy( m_policy, m_cpuOrder, idx );
+
+    uint32_t seen = 0;
+    for(;;)
+    {
+        uint32_t frame = m_frame.load( std::memory_order_acquire );
+        for( int i=0; i<m_spin && frame == seen && !m_exit.load( std::memory_order_relaxed ); i++ )
+        {
+            Pause();
+            frame = m_frame.load( std::memory_order_acquire );
+        }
+        if( frame == seen )
+        {
+            std::unique_lock<std::mutex> lock( m_lock );
+            m_cvStart.wait( lock, [this, seen] { return m_frame.load( std::memory_order_acquire ) != seen || m_exit.load(); } );
+            frame = m_frame.load( std::memory_order_acquire );
+        }
+        if( m_exit.load() ) return;
+        seen = frame;
+
+        CompressStripe( idx, m_src, m_buffer[m_back].data() );
+        m_stripeEnd[idx] = GetTime();
+
+        if( m_pending.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            m_cvDone.notify_one();
+        }
+    }
+}
+
+void RealtimeCompressor::CompressStripe( unsigned int idx, const uint32_t* src, uint64_t* dst )
+{
+    const size_t rows = m_size.y / 4;
+    const size_t first = rows * idx / m_threads;
+    const size_t end = rows * ( idx + 1 ) / m_threads;
+    if( first == end ) return;
+
+    const size_t width = m_size.x;
+    const auto blocks = uint32_t( ( end - first ) * ( width / 4 ) );
+    src += first * 4 * width;
+    dst += first * ( width / 4 ) * ( m_alpha ? 2 : 1 );
+
+    switch( m_type )
+    {
+    case BlockData::Etc1:
+        CompressEtc1Rgb( src, dst, blocks, width );
+        break;
+    case BlockData::Etc2_RGB:
+        CompressEtc2Rgb( src, dst, blocks, width, m_useHeuristics );
+        break;
+    case BlockData::Etc2_RGBA:
+        CompressEtc2Rgba( src, dst, blocks, width, m_useHeuristics );
+        break;
+    case BlockData::Dxt1:
+        CompressDxt1( src, dst, blocks, width );
+        break;
+    case BlockData::Dxt5:
+        CompressDxt5( src, dst, blocks, width );
+        break;
+    default:
+        assert( false );
+        break;
+    }
+}
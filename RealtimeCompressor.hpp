@@ -0,0 +1,75 @@
+#ifndef __REALTIMECOMPRESSOR_HPP__
+#define __REALTIMECOMPRESSOR_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "BlockData.hpp"
+#include "TaskDispatch.hpp"
+#include "Vector.hpp"
+
+// Compresses a stream of same-sized frames with the least possible latency.
+// Each persistent worker owns a fixed stripe of block rows, so a frame is
+// started by a single wakeup and needs no task queue. Frames are compressed
+// into two alternating buffers: the previous frame's blocks stay readable
+// (e.g. while being sent) during the next Submit().
+//
+// Source pixels are BGRA for ETC types and RGBA for DXT types.
+class RealtimeCompressor
+{
+public:
+    RealtimeCompressor( const v2i& size, BlockData::Type type, unsigned int threads, const WorkerPolicy& policy = WorkerPolicy(), bool useHeuristics = true );
+    ~RealtimeCompressor();
+
+    RealtimeCompressor( const RealtimeCompressor& ) = delete;
+    RealtimeCompressor& operator=( const RealtimeCompressor& ) = delete;
+
+    // Starts compressing a frame and returns; src must stay valid until Wait()
+    void Submit( const uint32_t* src );
+    // Waits for the submitted frame and returns its blocks, valid until the
+    // Wait() after the next Submit()
+    const uint64_t* Wait();
+    const uint64_t* Compress( const uint32_t* src ) { Submit( src ); return Wait(); }
+
+    size_t FrameBytes() const { return m_frameWords * sizeof( uint64_t ); }
+    unsigned int Threads() const { return m_threads; }
+    // Submit() to completion of each frame so far, in microseconds
+    const std::vector<uint64_t>& Latencies() const { return m_latency; }
+
+private:
+    void Worker( unsigned int idx );
+    void CompressStripe( unsigned int idx, const uint32_t* src, uint64_t* dst );
+
+    v2i m_size;
+    BlockData::Type m_type;
+    bool m_alpha;
+    bool m_useHeuristics;
+    size_t m_frameWords;
+
+    std::vector<uint64_t> m_buffer[2];
+    int m_back;
+
+    const uint32_t* m_src;
+    uint64_t m_start;
+    std::vector<uint64_t> m_stripeEnd;
+    bool m_inFlight;
+    int m_spin;
+    std::vector<uint64_t> m_latency;
+
+    std::atomic<uint32_t> m_frame;
+    std::atomic<uint32_t> m_pending;
+    std::atomic<bool> m_exit;
+    std::mutex m_lock;
+    std::condition_variable m_cvStart, m_cvDone;
+
+    unsigned int m_threads;
+    WorkerPolicy m_policy;
+    std::vector<int> m_cpuOrder;
+    std::vector<std::thread> m_workers;
+};
+
+#endif
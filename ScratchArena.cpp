@@ -0,0 +1,11 @@
+#include "ScratchArena.hpp"
+
+ScratchArena::ScratchArena( size_t capacity )
+    : m_buf( new uint8_t[capacity + LineSize - 1] )
+    , m_capacity( capacity )
+    , m_used( 0 )
+    , m_peak( 0 )
+{
+    const auto addr = uintptr_t( m_buf.get() );
+    m_base = m_buf.get() + ( ( LineSize - addr % LineSize ) % LineSize );
+}
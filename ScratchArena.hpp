@@ -0,0 +1,74 @@
+#ifndef __SCRATCHARENA_HPP__
+#define __SCRATCHARENA_HPP__
+
+#include <assert.h>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for the working memory of compression kernels. Each worker
+// owns one, so nothing is shared between threads; allocations start on cache
+// line boundaries and are released all at once by rewinding to a mark.
+class ScratchArena
+{
+public:
+    enum { LineSize = 64 };
+    enum { DefaultCapacity = 64 * 1024 };
+
+    ScratchArena( size_t capacity = DefaultCapacity );
+
+    ScratchArena( const ScratchArena& ) = delete;
+    ScratchArena& operator=( const ScratchArena& ) = delete;
+
+    // Default initialized, not zeroed
+    template<class T>
+    T* Alloc( size_t num = 1 )
+    {
+        static_assert( alignof( T ) <= LineSize, "Scratch allocations are cache line aligned" );
+        const size_t size = ( sizeof( T ) * num + LineSize - 1 ) & ~size_t( LineSize - 1 );
+        assert( m_used + size <= m_capacity );
+        auto ptr = (T*)( m_base + m_used );
+        m_used += size;
+        if( m_used > m_peak ) m_peak = m_used;
+        for( size_t i=0; i<num; i++ ) new( ptr + i ) T;
+        return ptr;
+    }
+
+    size_t Mark() const { return m_used; }
+    void Rewind( size_t mark ) { assert( mark <= m_used ); m_used = mark; }
+
+    size_t Capacity() const { return m_capacity; }
+    // Most bytes in use at once since creation or the last ResetPeak()
+    size_t Peak() const { return m_peak; }
+    void ResetPeak() { m_peak = m_used; }
+
+    // Rewinds the arena to where it was at construction when it goes out of
+    // scope, or earlier through Reset()
+    class Scope
+    {
+    public:
+        Scope( ScratchArena& arena ) : m_arena( arena ), m_mark( arena.Mark() ) {}
+        ~Scope() { m_arena.Rewind( m_mark ); }
+
+        Scope( const Scope& ) = delete;
+        Scope& operator=( const Scope& ) = delete;
+
+        template<class T>
+        T* Alloc( size_t num = 1 ) { return m_arena.Alloc<T>( num ); }
+        void Reset() { m_arena.Rewind( m_mark ); }
+
+    private:
+        ScratchArena& m_arena;
+        size_t m_mark;
+    };
+
+private:
+    std::unique_ptr<uint8_t[]> m_buf;
+    uint8_t* m_base;
+    size_t m_capacity;
+    size_t m_used;
+    size_t m_peak;
+};
+
+#endif
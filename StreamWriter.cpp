@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <errno.h>
+#ifdef _WIN32
+#  include <io.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+#include "StreamWriter.hpp"
+
+StreamWriter::StreamWriter( int fd, const uint8_t* base )
+    : m_fd( fd )
+    , m_base( base )
+    , m_written( 0 )
+    , m_taken( 0 )
+    , m_released( 0 )
+    , m_pendingBytes( 0 )
+    , m_maxPending( 0 )
+    , m_writing( false )
+    , m_failed( false )
+    , m_release( false )
+{
+}
+
+StreamWriter::~StreamWriter()
+{
+    // Ranges still pending here belong to a cancelled job; the stream ends truncated
+}
+
+void StreamWriter::Write( size_t offset, size_t len )
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    assert( offset >= m_taken );
+    m_pending.emplace( offset, len );
+    m_pendingBytes += len;
+    m_maxPending = std::max( m_maxPending, m_pendingBytes );
+    if( m_writing ) return;
+
+    m_writing = true;
+    for(;;)
+    {
+        const auto start = m_taken;
+        auto it = m_pending.begin();
+        while( it != m_pending.end() && it->first == m_taken )
+        {
+            m_taken += it->second;
+            m_pendingBytes -= it->second;
+            it = m_pending.erase( it );
+        }
+        if( start == m_taken ) break;
+
+        // After a failed write the rest is dropped, but the position still
+        // advances so nobody waits for it
+        const bool failed = m_failed;
+        const auto end = m_taken;
+        lock.unlock();
+        const bool ok = failed || Emit( m_base + start, end - start );
+        if( ok && m_release ) Release( end );
+        lock.lock();
+        if( !ok ) m_failed = true;
+        m_written = end;
+        m_cv.notify_all();
+    }
+    m_writing = false;
+}
+
+void StreamWriter::Wait( size_t offset ) const
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    m_cv.wait_for( lock, std::chrono::milliseconds( 10 ), [this, offset] { return m_written >= offset; } );
+}
+
+size_t StreamWriter::Written() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_written;
+}
+
+size_t StreamWriter::MaxPendingBytes() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_maxPending;
+}
+
+bool StreamWriter::Failed() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_failed;
+}
+
+bool StreamWriter::Emit( const uint8_t* ptr, size_t len )
+{
+    while( len > 0 )
+    {
+#ifdef _WIN32
+        const auto ret = _write( m_fd, ptr, (unsigned int)len );
+#else
+        const auto ret = write( m_fd, ptr, len );
+#endif
+        if( ret < 0 && errno == EINTR ) continue;
+        if( ret <= 0 ) return false;
+        ptr += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+void StreamWriter::Release( size_t end )
+{
+#ifndef _WIN32
+    // Only pages entirely inside the written part
+    const size_t page = sysconf( _SC_PAGESIZE );
+    const auto base = uintptr_t( m_base );
+    const auto first = ( base + m_released + page - 1 ) / page * page;
+    const auto last = ( base + end ) / page * page;
+    if( last <= first ) return;
+    madvise( (void*)first, last - first, MADV_DONTNEED );
+    m_released = last - base;
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef __STREAMWRITER_HPP__
+#define __STREAMWRITER_HPP__
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+// Emits a buffer to a non-seekable file descriptor (pipe, socket, stdout)
+// strictly in order. Ranges that complete ahead of the write position are
+// kept in a reorder window until the gap before them is filled; the caller
+// bounds the window by waiting for the write position before queueing more
+// work (see Wait()).
+//
+// One thread writes at a time, without holding the lock: ranges completed
+// meanwhile are queued and picked up by that thread, so a slow reader stalls
+// only the worker doing the writing.
+class StreamWriter
+{
+public:
+    StreamWriter( int fd, const uint8_t* base );
+    ~StreamWriter();
+
+    void Write( size_t offset, size_t len );
+    // Waits until offset is written, or a short while (for a cancelled job)
+    void Wait( size_t offset ) const;
+
+    // Gives the pages of written ranges back to the system. The buffer must
+    // be a private anonymous mapping; released pages read as zeros.
+    void SetReleaseWritten( bool enable ) { m_release = enable; }
+
+    size_t Written() const;
+    size_t MaxPendingBytes() const;
+    // A write failed; the stream ends there
+    bool Failed() const;
+
+private:
+    bool Emit( const uint8_t* ptr, size_t len );
+    void Release( size_t end );
+
+    int m_fd;
+    const uint8_t* m_base;
+    size_t m_written;
+    size_t m_taken;         // end of the ranges handed to the writing thread
+    size_t m_released;
+    size_t m_pendingBytes;
+    size_t m_maxPending;
+    bool m_writing;
+    bool m_failed;
+    bool m_release;
+    std::map<size_t, size_t> m_pending;
+    mutable std::mutex m_lock;
+    mutable std::condition_variable m_cv;
+};
+
+#endif
@@ -1,13 +1,141 @@
 #include <algorithm>
+#include <limits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
 #ifdef _WIN32
 #  include <windows.h>
+#  include <psapi.h>
 #else
 #  include <pthread.h>
+#  include <sys/resource.h>
 #  include <unistd.h>
 #endif
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sched.h>
+#  include <sys/syscall.h>
+#endif
 
 #include "System.hpp"
 
+#ifdef __linux__
+// Directories of the cgroup this process belongs to, and of all its
+// ancestors, for a v1 controller, or for the v2 hierarchy if controller
+// is null. Limits of every ancestor apply, so callers take the minimum.
+static std::vector<std::string> CgroupDirs( const char* controller )
+{
+    std::vector<std::string> ret;
+    FILE* f = fopen( "/proc/self/cgroup", "r" );
+    if( !f ) return ret;
+
+    char line[1024];
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        auto ctrl = strchr( line, ':' );
+        if( !ctrl ) continue;
+        auto path = strchr( ++ctrl, ':' );
+        if( !path ) continue;
+        *path++ = '\0';
+        path[strcspn( path, "\n" )] = '\0';
+
+        std::string base;
+        if( controller )
+        {
+            // Hierarchies may be co-mounted, e.g. "cpu,cpuacct"
+            bool found = false;
+            for( auto tok = strtok( ctrl, "," ); tok; tok = strtok( nullptr, "," ) )
+            {
+                if( strcmp( tok, controller ) == 0 ) found = true;
+            }
+            if( !found ) continue;
+            base = std::string( "/sys/fs/cgroup/" ) + controller;
+        }
+        else
+        {
+            if( *ctrl != '\0' ) continue;
+            base = "/sys/fs/cgroup";
+            if( access( "/sys/fs/cgroup/cgroup.controllers", F_OK ) != 0 ) base += "/unified";
+        }
+
+        // Inside a cgroup namespace the path may not exist below the mount
+        // point; the mount root then is the process' own cgroup.
+        std::string dir = path;
+        while( !dir.empty() && dir != "/" )
+        {
+            ret.emplace_back( base + dir );
+            dir.erase( dir.find_last_of( '/' ) );
+        }
+        ret.emplace_back( base );
+    }
+    fclose( f );
+    return ret;
+}
+
+static bool ReadValue( const std::string& fn, char* buf, size_t size )
+{
+    FILE* f = fopen( fn.c_str(), "r" );
+    if( !f ) return false;
+    const bool ok = fgets( buf, (int)size, f ) != nullptr;
+    fclose( f );
+    return ok;
+}
+
+static unsigned int CgroupCPUs()
+{
+    double quota = std::numeric_limits<double>::max();
+    char buf[64];
+
+    for( auto& dir : CgroupDirs( nullptr ) )
+    {
+        long long q, p;
+        if( ReadValue( dir + "/cpu.max", buf, sizeof( buf ) ) && sscanf( buf, "%lld %lld", &q, &p ) == 2 && p > 0 )
+        {
+            quota = std::min( quota, double( q ) / p );
+        }
+    }
+    for( auto& dir : CgroupDirs( "cpu" ) )
+    {
+        long long q, p;
+        if( ReadValue( dir + "/cpu.cfs_quota_us", buf, sizeof( buf ) ) && sscanf( buf, "%lld", &q ) == 1 && q > 0 &&
+            ReadValue( dir + "/cpu.cfs_period_us", buf, sizeof( buf ) ) && sscanf( buf, "%lld", &p ) == 1 && p > 0 )
+        {
+            quota = std::min( quota, double( q ) / p );
+        }
+    }
+
+    if( quota == std::numeric_limits<double>::max() ) return std::numeric_limits<unsigned int>::max();
+    // A quota of 2.5 CPUs still keeps 3 threads busy most of the time
+    return (unsigned int)std::max( 1., quota + 0.5 );
+}
+
+static uint64_t CgroupMemory()
+{
+    uint64_t limit = std::numeric_limits<uint64_t>::max();
+    char buf[64];
+
+    for( auto& dir : CgroupDirs( nullptr ) )
+    {
+        unsigned long long v;
+        if( ReadValue( dir + "/memory.max", buf, sizeof( buf ) ) && sscanf( buf, "%llu", &v ) == 1 )
+        {
+            limit = std::min<uint64_t>( limit, v );
+        }
+    }
+    for( auto& dir : CgroupDirs( "memory" ) )
+    {
+        unsigned long long v;
+        if( ReadValue( dir + "/memory.limit_in_bytes", buf, sizeof( buf ) ) && sscanf( buf, "%llu", &v ) == 1 )
+        {
+            limit = std::min<uint64_t>( limit, v );
+        }
+    }
+    return limit;
+}
+#endif
+
 unsigned int System::CPUCores()
 {
     static unsigned int cores = 0;
@@ -27,12 +155,91 @@ unsigned int System::CPUCores()
 #    endif
 #  endif
         tmp = (int)(long)sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+#ifdef __linux__
+        cpu_set_t set;
+        if( sched_getaffinity( 0, sizeof( set ), &set ) == 0 )
+        {
+            tmp = std::min( tmp, CPU_COUNT( &set ) );
+        }
+        tmp = (int)std::min<unsigned int>( tmp, CgroupCPUs() );
 #endif
         cores = (unsigned int)std::max( tmp, 1 );
     }
     return cores;
 }
 
+uint64_t System::MemoryLimit()
+{
+    uint64_t mem;
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof( status );
+    GlobalMemoryStatusEx( &status );
+    mem = status.ullTotalPhys;
+#elif defined _SC_PHYS_PAGES
+    const long pages = sysconf( _SC_PHYS_PAGES );
+    mem = pages > 0 ? uint64_t( pages ) * sysconf( _SC_PAGESIZE ) : 0;
+#else
+    mem = 0;
+#endif
+#ifdef __linux__
+    const auto cg = CgroupMemory();
+    if( cg != std::numeric_limits<uint64_t>::max() && ( mem == 0 || cg < mem ) ) mem = cg;
+#endif
+    return mem;
+}
+
+uint64_t System::PeakMemoryUsage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if( !GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) ) return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if( getrusage( RUSAGE_SELF, &usage ) != 0 ) return 0;
+#  ifdef __APPLE__
+    return usage.ru_maxrss;
+#  else
+    // Kilobytes everywhere but macOS
+    return uint64_t( usage.ru_maxrss ) * 1024;
+#  endif
+#endif
+}
+
+std::vector<System::CPUInfo> System::CPUTopology()
+{
+    std::vector<CPUInfo> ret;
+#ifdef __linux__
+    cpu_set_t set;
+    if( sched_getaffinity( 0, sizeof( set ), &set ) != 0 ) return ret;
+    for( int i=0; i<CPU_SETSIZE; i++ )
+    {
+        if( !CPU_ISSET( i, &set ) ) continue;
+        CPUInfo info = { i, i, 0, 0 };
+        char fn[128];
+        char buf[64];
+        sprintf( fn, "/sys/devices/system/cpu/cpu%i/topology/core_id", i );
+        if( ReadValue( fn, buf, sizeof( buf ) ) ) info.core = atoi( buf );
+        sprintf( fn, "/sys/devices/system/cpu/cpu%i/topology/physical_package_id", i );
+        if( ReadValue( fn, buf, sizeof( buf ) ) ) info.package = atoi( buf );
+        for( auto& v : ret )
+        {
+            if( v.core == info.core && v.package == info.package ) info.thread++;
+        }
+        ret.emplace_back( info );
+    }
+#else
+    for( unsigned int i=0; i<CPUCores(); i++ )
+    {
+        CPUInfo info = { int( i ), int( i ), 0, 0 };
+        ret.emplace_back( info );
+    }
+#endif
+    return ret;
+}
+
 void System::SetThreadName( std::thread& thread, const char* name )
 {
 #ifdef _WIN32
@@ -66,3 +273,44 @@ void System::SetThreadName( std::thread& thread, const char* name )
     pthread_setname_np( thread.native_handle(), name );
 #endif
 }
+
+#ifdef __linux__
+static int OpenCacheCounter( uint64_t config )
+{
+    perf_event_attr attr = {};
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+#endif
+
+CacheCounters::CacheCounters()
+{
+#ifdef __linux__
+    m_fd[0] = OpenCacheCounter( PERF_COUNT_HW_CACHE_REFERENCES );
+    m_fd[1] = OpenCacheCounter( PERF_COUNT_HW_CACHE_MISSES );
+#else
+    m_fd[0] = m_fd[1] = -1;
+#endif
+}
+
+CacheCounters::~CacheCounters()
+{
+#ifdef __linux__
+    for( auto fd : m_fd ) if( fd >= 0 ) close( fd );
+#endif
+}
+
+uint64_t CacheCounters::Read( int fd )
+{
+    uint64_t value = 0;
+#ifdef __linux__
+    // Inherited counters include the counts of child threads
+    if( fd < 0 || read( fd, &value, sizeof( value ) ) != sizeof( value ) ) return 0;
+#endif
+    return value;
+}
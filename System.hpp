@@ -1,15 +1,56 @@
 #ifndef __DARKRL__SYSTEM_HPP__
 #define __DARKRL__SYSTEM_HPP__
 
+#include <stdint.h>
 #include <thread>
+#include <vector>
 
 class System
 {
 public:
+    struct CPUInfo
+    {
+        int cpu;
+        int core;       // physical core id, shared by SMT siblings
+        int package;
+        int thread;     // index of this cpu among its core's siblings
+    };
+
     System() = delete;
 
+    // Usable cores: online processors, limited by the affinity mask (cpuset)
+    // and by cgroup v1/v2 CPU quotas.
     static unsigned int CPUCores();
+    // Physical memory, limited by cgroup v1/v2 memory limits. 0 if unknown.
+    static uint64_t MemoryLimit();
+    // Peak resident set size of this process so far, 0 if unknown.
+    static uint64_t PeakMemoryUsage();
+    // Processors this process may run on, in cpu number order. Falls back
+    // to one core per cpu where the topology can't be read.
+    static std::vector<CPUInfo> CPUTopology();
     static void SetThreadName( std::thread& thread, const char* name );
 };
 
+// Hardware cache references and misses of the calling thread and of the
+// threads it starts afterwards, counted from construction. Linux perf events
+// only; invalid elsewhere or when the kernel denies access.
+class CacheCounters
+{
+public:
+    CacheCounters();
+    ~CacheCounters();
+
+    CacheCounters( const CacheCounters& ) = delete;
+    CacheCounters& operator=( const CacheCounters& ) = delete;
+
+    bool IsValid() const { return m_fd[0] >= 0 && m_fd[1] >= 0; }
+    uint64_t References() const { return Read( m_fd[0] ); }
+    uint64_t Misses() const { return Read( m_fd[1] ); }
+
+private:
+    static uint64_t Read( int fd );
+
+    int m_fd[2];
+};
+
 #endif
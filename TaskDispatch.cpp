@@ -1,15 +1,106 @@
+#include <algorithm>
 #include <assert.h>
 #include <stdio.h>
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#  include <sys/resource.h>
+#  include <unistd.h>
+#endif
+#ifdef __linux__
+#  include <sched.h>
+#  include <sys/syscall.h>
+#endif
 
 #include "Debug.hpp"
+#include "ScratchArena.hpp"
 #include "System.hpp"
 #include "TaskDispatch.hpp"
 
 static TaskDispatch* s_instance = nullptr;
+static thread_local ScratchArena* s_scratch = nullptr;
+
+std::vector<int> WorkerCpuOrder( const WorkerPolicy& policy )
+{
+    auto pinning = policy.pinning;
+    if( pinning == WorkerPolicy::List ) return policy.cpus;
+
+    std::vector<int> order;
+    if( pinning != WorkerPolicy::NoPinning || policy.avoidSmt )
+    {
+        auto topology = System::CPUTopology();
+        if( policy.avoidSmt )
+        {
+            topology.erase( std::remove_if( topology.begin(), topology.end(), []( const System::CPUInfo& v ) { return v.thread != 0; } ), topology.end() );
+            // Keeping threads off SMT siblings requires pinning them
+            if( pinning == WorkerPolicy::NoPinning ) pinning = WorkerPolicy::Compact;
+        }
+        if( pinning == WorkerPolicy::Compact )
+        {
+            std::sort( topology.begin(), topology.end(), []( const System::CPUInfo& l, const System::CPUInfo& r ) {
+                if( l.package != r.package ) return l.package < r.package;
+                if( l.core != r.core ) return l.core < r.core;
+                return l.thread < r.thread;
+            } );
+        }
+        else
+        {
+            std::sort( topology.begin(), topology.end(), []( const System::CPUInfo& l, const System::CPUInfo& r ) {
+                if( l.thread != r.thread ) return l.thread < r.thread;
+                if( l.core != r.core ) return l.core < r.core;
+                return l.package < r.package;
+            } );
+        }
+        for( auto& v : topology ) order.emplace_back( v.cpu );
+    }
+    return order;
+}
+
+void ApplyWorkerPolicy( const WorkerPolicy& policy, const std::vector<int>& cpuOrder, size_t slot )
+{
+#ifdef _WIN32
+    if( !cpuOrder.empty() )
+    {
+        SetThreadAffinityMask( GetCurrentThread(), DWORD_PTR( 1 ) << cpuOrder[slot % cpuOrder.size()] );
+    }
+    if( policy.schedClass == WorkerPolicy::Idle )
+    {
+        SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_IDLE );
+    }
+    else if( policy.schedClass == WorkerPolicy::Batch || policy.nice > 0 )
+    {
+        SetThreadPriority( GetCurrentThread(), policy.nice > 10 ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL );
+    }
+#else
+#  ifdef __linux__
+    if( !cpuOrder.empty() )
+    {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpuOrder[slot % cpuOrder.size()], &set );
+        pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+    }
+    if( policy.schedClass != WorkerPolicy::Normal )
+    {
+        sched_param param = {};
+        pthread_setschedparam( pthread_self(), policy.schedClass == WorkerPolicy::Idle ? SCHED_IDLE : SCHED_BATCH, &param );
+    }
+    // Linux applies nice values to individual threads
+    if( policy.nice != 0 ) setpriority( PRIO_PROCESS, (id_t)syscall( SYS_gettid ), policy.nice );
+#  else
+    // Elsewhere nice is a process attribute; it would slow down the main and
+    // I/O threads too, so workers keep the default priority
+    (void)cpuOrder;
+    (void)slot;
+#  endif
+#endif
+}
 
-TaskDispatch::TaskDispatch( size_t workers )
+TaskDispatch::TaskDispatch( size_t workers, const WorkerPolicy& policy )
     : m_exit( false )
     , m_jobs( 0 )
+    , m_policy( policy )
 {
     assert( !s_instance );
     s_instance = this;
@@ -17,18 +108,35 @@ TaskDispatch::TaskDispatch( size_t workers )
     assert( workers >= 1 );
     workers--;
 
+    m_cpuOrder = WorkerCpuOrder( policy );
+
+    m_scratch.reserve( workers + 1 );
+    for( size_t i=0; i<=workers; i++ ) m_scratch.emplace_back( new ScratchArena );
+
+    // The calling thread runs tasks in Sync() with the first arena, but
+    // keeps its own affinity and priority: an unprivileged process couldn't
+    // restore a lowered priority, and threads it starts later would inherit
+    // the policy.
+    s_scratch = m_scratch[0].get();
+
     m_workers.reserve( workers );
     for( size_t i=0; i<workers; i++ )
     {
         char tmp[16];
         sprintf( tmp, "Worker %zu", i );
 #ifdef __APPLE__
-        auto worker = std::thread( [this, tmp]{
+        auto worker = std::thread( [this, tmp, i]{
             pthread_setname_np( tmp );
+            ApplyWorkerPolicy( m_policy, m_cpuOrder, i );
+            s_scratch = m_scratch[i+1].get();
             Worker();
         } );
 #else
-        auto worker = std::thread( [this]{ Worker(); } );
+        auto worker = std::thread( [this, i]{
+            ApplyWorkerPolicy( m_policy, m_cpuOrder, i );
+            s_scratch = m_scratch[i+1].get();
+            Worker();
+        } );
 #endif
         System::SetThreadName( worker, tmp );
         m_workers.emplace_back( std::move( worker ) );
@@ -51,6 +159,7 @@ TaskDispatch::~TaskDispatch()
 
     assert( s_instance );
     s_instance = nullptr;
+    s_scratch = nullptr;
 }
 
 void TaskDispatch::Queue( const std::function<void(void)>& f )
@@ -91,6 +200,32 @@ void TaskDispatch::Sync()
     s_instance->m_cvJobs.wait( lock, []{ return s_instance->m_jobs == 0; } );
 }
 
+bool TaskDispatch::RunOne()
+{
+    std::unique_lock<std::mutex> lock( s_instance->m_queueLock );
+    if( s_instance->m_queue.empty() ) return false;
+    auto f = s_instance->m_queue.back();
+    s_instance->m_queue.pop_back();
+    lock.unlock();
+    f();
+    return true;
+}
+
+ScratchArena& TaskDispatch::Scratch()
+{
+    if( s_scratch ) return *s_scratch;
+    static thread_local ScratchArena local;
+    return local;
+}
+
+size_t TaskDispatch::ScratchPeak()
+{
+    if( !s_instance ) return Scratch().Peak();
+    size_t peak = 0;
+    for( auto& v : s_instance->m_scratch ) peak = std::max( peak, v->Peak() );
+    return peak;
+}
+
 void TaskDispatch::Worker()
 {
     for(;;)
@@ -4,20 +4,62 @@
 #include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+class ScratchArena;
+
+struct WorkerPolicy
+{
+    enum Pinning
+    {
+        NoPinning,
+        Compact,        // fill all threads of a core, then the next core
+        Scatter,        // spread over packages and cores before using SMT siblings
+        List            // round-robin over cpus
+    };
+
+    enum SchedClass
+    {
+        Normal,
+        Batch,          // SCHED_BATCH, throughput oriented, no wakeup preemption
+        Idle            // SCHED_IDLE, runs only when nothing else wants the cpu
+    };
+
+    WorkerPolicy() : pinning( NoPinning ), avoidSmt( false ), schedClass( Normal ), nice( 0 ) {}
+
+    Pinning pinning;
+    std::vector<int> cpus;
+    bool avoidSmt;      // use one thread per physical core
+    SchedClass schedClass;
+    int nice;
+};
+
+// Cpus that worker slots are pinned to in turn, empty if not pinning
+std::vector<int> WorkerCpuOrder( const WorkerPolicy& policy );
+// Pins and prioritizes the calling thread as the given worker slot
+void ApplyWorkerPolicy( const WorkerPolicy& policy, const std::vector<int>& cpuOrder, size_t slot );
+
 class TaskDispatch
 {
 public:
-    TaskDispatch( size_t workers );
+    TaskDispatch( size_t workers, const WorkerPolicy& policy = WorkerPolicy() );
     ~TaskDispatch();
 
     static void Queue( const std::function<void(void)>& f );
     static void Queue( std::function<void(void)>&& f );
 
     static void Sync();
+    // Runs one queued task on the calling thread. False if none was queued.
+    static bool RunOne();
+
+    // Scratch arena of the calling thread: its worker slot's while a
+    // dispatcher exists, a thread local one otherwise
+    static ScratchArena& Scratch();
+    // Highest use of any worker slot's arena, or of the calling thread's
+    static size_t ScratchPeak();
 
 private:
     void Worker();
@@ -28,6 +70,10 @@ private:
     std::atomic<bool> m_exit;
     size_t m_jobs;
 
+    WorkerPolicy m_policy;
+    std::vector<int> m_cpuOrder;
+
+    std::vector<std::unique_ptr<ScratchArena>> m_scratch;
     std::vector<std::thread> m_workers;
 };
 
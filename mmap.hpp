@@ -3,6 +3,9 @@
 
 #ifndef _WIN32
 #  include <sys/mman.h>
+#  ifndef MAP_POPULATE
+#    define MAP_POPULATE 0
+#  endif
 #else
 #  include <string.h>
 #  include <sys/types.h>
@@ -10,6 +13,8 @@
 #  define PROT_READ 1
 #  define PROT_WRITE 2
 #  define MAP_SHARED 0
+#  define MAP_POPULATE 0
+#  define MAP_FAILED ((void*)-1)
 
 void* mmap( void* addr, size_t length, int prot, int flags, int fd, off_t offset );
 int munmap( void* addr, size_t length );